@@ -0,0 +1,64 @@
+#include "assets.h"
+#include "assets_index.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+
+static const char *TAG = "assets";
+
+#define ASSETS_PARTITION_SUBTYPE 0x40
+
+static const void *s_image;
+static esp_partition_mmap_handle_t s_mmap_handle;
+
+esp_err_t assets_init(void)
+{
+    if (s_image != NULL)
+    {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ASSETS_PARTITION_SUBTYPE, "assets");
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to find assets partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const void *image;
+    esp_err_t ret = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &image, &s_mmap_handle);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to map assets partition (%s)", esp_err_to_name(ret));
+        return ret;
+    }
+
+    ret = assets_index_validate(image, partition->size);
+    if (ret != ESP_OK)
+    {
+        esp_partition_munmap(s_mmap_handle);
+        return ret;
+    }
+
+    s_image = image;
+    return ESP_OK;
+}
+
+void assets_deinit(void)
+{
+    if (s_image != NULL)
+    {
+        esp_partition_munmap(s_mmap_handle);
+        s_image = NULL;
+    }
+}
+
+esp_err_t assets_find(const char *name, const void **data, size_t *size)
+{
+    if (s_image == NULL || name == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return assets_index_find(s_image, name, data, size);
+}
@@ -0,0 +1,81 @@
+#include "assets.h"
+#include "assets_index.h"
+
+#include "esp_log.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *TAG = "assets";
+
+#ifndef ASSETS_IMAGE_DEFAULT_PATH
+#define ASSETS_IMAGE_DEFAULT_PATH "assets.bin"
+#endif
+
+static void *s_image;
+static size_t s_image_size;
+
+esp_err_t assets_init(void)
+{
+    if (s_image != NULL)
+    {
+        return ESP_OK;
+    }
+
+    const char *path = getenv("ASSETS_IMAGE");
+    if (path == NULL)
+    {
+        path = ASSETS_IMAGE_DEFAULT_PATH;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ESP_LOGE(TAG, "Failed to open asset image %s", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        ESP_LOGE(TAG, "Failed to map asset image %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t ret = assets_index_validate(image, st.st_size);
+    if (ret != ESP_OK)
+    {
+        munmap(image, st.st_size);
+        return ret;
+    }
+
+    s_image = image;
+    s_image_size = st.st_size;
+    return ESP_OK;
+}
+
+void assets_deinit(void)
+{
+    if (s_image != NULL)
+    {
+        munmap(s_image, s_image_size);
+        s_image = NULL;
+    }
+}
+
+esp_err_t assets_find(const char *name, const void **data, size_t *size)
+{
+    if (s_image == NULL || name == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return assets_index_find(s_image, name, data, size);
+}
@@ -0,0 +1,69 @@
+#include "assets_index.h"
+
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "assets";
+
+esp_err_t assets_index_validate(const void *image, size_t mapped_size)
+{
+    const assets_header_t *header = image;
+    if (mapped_size < sizeof(*header) || memcmp(header->magic, ASSETS_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ASSETS_VERSION)
+    {
+        ESP_LOGE(TAG, "No valid asset image header");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    size_t index_end = sizeof(*header) + (size_t)header->count * sizeof(assets_entry_t);
+    if (header->image_size > mapped_size || index_end > header->image_size)
+    {
+        ESP_LOGE(TAG, "Asset image size %lu does not fit the mapping (%zu bytes)", (unsigned long)header->image_size,
+                 mapped_size);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    const assets_entry_t *entries = (const assets_entry_t *)(header + 1);
+    for (uint16_t i = 0; i < header->count; i++)
+    {
+        const assets_entry_t *entry = &entries[i];
+        if (memchr(entry->name, '\0', sizeof(entry->name)) == NULL || entry->offset < index_end ||
+            entry->offset > header->image_size || entry->size > header->image_size - entry->offset)
+        {
+            ESP_LOGE(TAG, "Asset index entry %u is malformed", i);
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    ESP_LOGI(TAG, "Asset image with %u entries (%lu bytes)", header->count, (unsigned long)header->image_size);
+    return ESP_OK;
+}
+
+esp_err_t assets_index_find(const void *image, const char *name, const void **data, size_t *size)
+{
+    const assets_header_t *header = image;
+    const assets_entry_t *entries = (const assets_entry_t *)(header + 1);
+
+    int low = 0;
+    int high = (int)header->count - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        int cmp = strncmp(name, entries[mid].name, ASSETS_NAME_LEN);
+        if (cmp == 0)
+        {
+            *data = (const uint8_t *)image + entries[mid].offset;
+            *size = entries[mid].size;
+            return ESP_OK;
+        }
+        if (cmp < 0)
+        {
+            high = mid - 1;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
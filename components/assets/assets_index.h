@@ -0,0 +1,32 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Image layout written by tools/pack_assets.py
+
+#define ASSETS_MAGIC "MTAS"
+#define ASSETS_VERSION 1
+#define ASSETS_NAME_LEN 32
+
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t image_size;
+} assets_header_t;
+
+typedef struct __attribute__((packed))
+{
+    char name[ASSETS_NAME_LEN];
+    uint32_t offset;
+    uint32_t size;
+} assets_entry_t;
+
+/// Checks header and index of a mapped image of `mapped_size` bytes.
+esp_err_t assets_index_validate(const void *image, size_t mapped_size);
+
+/// Binary search over the sorted index of a validated image.
+esp_err_t assets_index_find(const void *image, const char *name, const void **data, size_t *size);
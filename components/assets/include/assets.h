@@ -0,0 +1,30 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stddef.h>
+
+/**
+ * @brief Maps the read-only asset image into the address space.
+ * On the device the `assets` partition is mapped through the flash cache, on the linux target the
+ * image file (ASSETS_IMAGE environment variable, or the one from the build directory) is mmapped.
+ * Calling it again while mapped is a no-op.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no image, ESP_ERR_INVALID_CRC if the
+ *         image header or index is malformed.
+ */
+esp_err_t assets_init(void);
+
+/**
+ * @brief Unmaps the image. Pointers returned by assets_find() become invalid.
+ */
+void assets_deinit(void);
+
+/**
+ * @brief Looks up an asset by name (its path relative to data/, e.g. "capability.json").
+ * The returned pointer points straight into the mapped image and stays valid until assets_deinit().
+ *
+ * @param name Name of the asset.
+ * @param data Receives a pointer to the asset content.
+ * @param size Receives the size of the asset in bytes.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such asset or no image is mapped.
+ */
+esp_err_t assets_find(const char *name, const void **data, size_t *size);
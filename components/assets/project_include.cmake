@@ -0,0 +1,35 @@
+# assets_create_partition_image
+#
+# Packs a directory into a read-only asset image (tools/pack_assets.py) for the given partition.
+# Mirrors spiffs_create_partition_image: with FLASH_IN_PROJECT the image is flashed by `idf.py flash`.
+function(assets_create_partition_image partition base_dir)
+    set(options FLASH_IN_PROJECT)
+    set(multi DEPENDS)
+    cmake_parse_arguments(arg "${options}" "" "${multi}" "${ARGN}")
+
+    idf_build_get_property(idf_path IDF_PATH)
+    idf_build_get_property(python PYTHON)
+    idf_build_get_property(build_dir BUILD_DIR)
+    idf_build_get_property(project_dir PROJECT_DIR)
+    get_filename_component(base_dir_full_path ${base_dir} ABSOLUTE)
+
+    set(image_file ${build_dir}/${partition}.bin)
+    set(pack_assets ${project_dir}/tools/pack_assets.py)
+    file(GLOB_RECURSE asset_files ${base_dir_full_path}/*)
+
+    if(NOT ${IDF_TARGET} STREQUAL "linux")
+        partition_table_get_partition_info(size "--partition-name ${partition}" "size")
+        set(size_arg --size ${size})
+    endif()
+
+    add_custom_command(OUTPUT ${image_file}
+        COMMAND ${python} ${pack_assets} ${base_dir_full_path} ${image_file} ${size_arg}
+        DEPENDS ${asset_files} ${pack_assets} ${arg_DEPENDS}
+        VERBATIM)
+    add_custom_target(${partition}_assets_bin ALL DEPENDS ${image_file})
+
+    if(arg_FLASH_IN_PROJECT AND NOT ${IDF_TARGET} STREQUAL "linux")
+        esptool_py_flash_to_partition(flash "${partition}" "${image_file}")
+        add_dependencies(flash ${partition}_assets_bin)
+    endif()
+endfunction()
@@ -0,0 +1,422 @@
+#include "benchmark.h"
+
+#include "assets.h"
+#include "capability_service.h"
+#include "esp_app_desc.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "led_command.h"
+#include "led_effects.h"
+#include "led_matrix.h"
+#include "led_protocol.h"
+#include "nimble/nimble_port.h"
+#include "persistence.h"
+#include "sdkconfig.h"
+#include "storage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "benchmark";
+
+#define BENCH_MAX_RESULTS 48
+#define BENCH_SAMPLES 64
+#define BENCH_COMMIT_SAMPLES 16     // Every sample is a flash write, keep the wear low
+#define BENCH_SOURCE 0              // Command ring the frames are queued on
+#define BENCH_CONN_HANDLE 1         // Connection the reads pretend to come from
+#define BENCH_NAMESPACE "benchmark" // NVS namespace, the firmware state is never touched
+#define BENCH_KEYS 16
+#define BENCH_CAPA_FILENAME "/storage/capability.json"
+#define BENCH_WS2812_US_PER_LED 30  // Airtime of one pixel, 24 bits at 800 kHz
+#define BENCH_JSON_BEGIN "---- benchmark json begin ----"
+#define BENCH_JSON_END "---- benchmark json end ----"
+
+typedef struct
+{
+    const char *name;
+    uint32_t arg; ///< Parameter of the run, e.g. chunk size or LED count
+    uint32_t samples;
+    uint32_t ops;
+    uint64_t bytes;
+    int64_t total_us;
+    double min_us; ///< Per operation, fastest sample
+    double max_us; ///< Per operation, slowest sample
+} bench_result_t;
+
+static bench_result_t s_results[BENCH_MAX_RESULTS];
+static int s_result_count;
+static bench_result_t s_discarded; // Collects the samples of runs beyond BENCH_MAX_RESULTS
+
+static bench_result_t *bench_begin(const char *name, uint32_t arg)
+{
+    bench_result_t *result = &s_discarded;
+    if (s_result_count < BENCH_MAX_RESULTS)
+    {
+        result = &s_results[s_result_count++];
+    }
+    else
+    {
+        ESP_LOGE(TAG, "No room for the result of %s", name);
+    }
+    memset(result, 0, sizeof(*result));
+    result->name = name;
+    result->arg = arg;
+    return result;
+}
+
+/// Adds a sample that started at `start` and covered `ops` operations moving `bytes` bytes.
+static void bench_sample(bench_result_t *result, int64_t start, uint32_t ops, uint64_t bytes)
+{
+    int64_t elapsed = esp_timer_get_time() - start;
+    double per_op = ops > 0 ? (double)elapsed / ops : 0;
+    if (result->samples == 0 || per_op < result->min_us)
+    {
+        result->min_us = per_op;
+    }
+    if (result->samples == 0 || per_op > result->max_us)
+    {
+        result->max_us = per_op;
+    }
+    result->samples++;
+    result->ops += ops;
+    result->bytes += bytes;
+    result->total_us += elapsed;
+}
+
+// Command dispatch
+
+/// Builds a binary frame of `ops` operations of one opcode, returns its length.
+static size_t bench_frame(uint8_t *frame, uint8_t opcode, uint32_t ops)
+{
+    size_t len = 0;
+    frame[len++] = LS_PROTOCOL_HEADER | LS_PROTOCOL_VERSION;
+    for (uint32_t i = 0; i < ops; i++)
+    {
+        frame[len++] = opcode;
+        switch (opcode)
+        {
+        case LS_OP_SET_RANGE:
+            frame[len++] = (i * 4) & 0xff; // start
+            frame[len++] = (i * 4) >> 8;
+            frame[len++] = 4; // count
+            frame[len++] = 0;
+            break;
+
+        case LS_OP_SET_PIXEL:
+            frame[len++] = i & 0xff; // index
+            frame[len++] = i >> 8;
+            break;
+
+        default:
+            break;
+        }
+        frame[len++] = i;
+        frame[len++] = 0x40;
+        frame[len++] = 0xff - i;
+    }
+    return len;
+}
+
+static void bench_dispatch_run(const char *name, uint8_t opcode, uint32_t ops, bench_result_t *drain)
+{
+    uint8_t frame[256];
+    size_t len = bench_frame(frame, opcode, ops);
+
+    // As many frames as the command ring takes, then the LED task's part runs untimed
+    uint32_t frames = CONFIG_WLED_COMMAND_QUEUE_LEN / ops;
+    frames = frames > 0 ? frames : 1;
+
+    bench_result_t *result = bench_begin(name, ops);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        int failed = 0;
+        int64_t start = esp_timer_get_time();
+        for (uint32_t i = 0; i < frames; i++)
+        {
+            failed += ls_protocol_dispatch(BENCH_SOURCE, frame, len) != 0;
+        }
+        bench_sample(result, start, frames, (uint64_t)frames * len);
+
+        start = esp_timer_get_time();
+        uint32_t applied = led_command_drain();
+        bench_sample(drain, start, applied, 0);
+
+        if (failed > 0)
+        {
+            ESP_LOGE(TAG, "%s: %d frames rejected", name, failed);
+        }
+    }
+}
+
+/// ls_write minus the connection lookup, which needs a central: validation, decoding and queueing
+static void bench_dispatch(void)
+{
+    bench_result_t *drain = bench_begin("led_command_drain", 0);
+    bench_dispatch_run("ls_dispatch_fill", LS_OP_FILL, 1, drain);
+    bench_dispatch_run("ls_dispatch_set_range", LS_OP_SET_RANGE, 8, drain);
+    bench_dispatch_run("ls_dispatch_set_pixel", LS_OP_SET_PIXEL, 32, drain);
+}
+
+// Storage
+
+static void bench_storage_read(void)
+{
+    storage_handle_t handle;
+    if (storage_open(BENCH_CAPA_FILENAME, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "storage_read: %s not found", BENCH_CAPA_FILENAME);
+        return;
+    }
+    ssize_t size = storage_size(handle);
+    uint8_t *buffer = malloc(size > 0 ? size : 1);
+
+    // Whole passes over the file, the last size reads it in one go
+    const size_t chunks[] = {16, 64, 256, size};
+    for (size_t c = 0; buffer != NULL && size > 0 && c < sizeof(chunks) / sizeof(chunks[0]); c++)
+    {
+        bench_result_t *result = bench_begin("storage_read", chunks[c]);
+        for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+        {
+            uint32_t reads = 0;
+            off_t offset = 0;
+            int64_t start = esp_timer_get_time();
+            while (offset < size)
+            {
+                ssize_t n = storage_pread(handle, buffer, chunks[c], offset);
+                if (n <= 0)
+                {
+                    break;
+                }
+                offset += n;
+                reads++;
+            }
+            bench_sample(result, start, reads, offset);
+        }
+    }
+
+    free(buffer);
+    storage_close(handle);
+}
+
+// Persistence
+
+static void bench_key(char *key, size_t size, int i)
+{
+    snprintf(key, size, "bench%02d", i);
+}
+
+static void bench_persistence(void)
+{
+    char key[16];
+
+    bench_result_t *result = bench_begin("persistence_save", 0);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        int64_t start = esp_timer_get_time();
+        for (int32_t i = 0; i < BENCH_KEYS; i++)
+        {
+            bench_key(key, sizeof(key), i);
+            int32_t value = sample * BENCH_KEYS + i;
+            persistence_save(VALUE_TYPE_INT32, key, &value);
+        }
+        bench_sample(result, start, BENCH_KEYS, BENCH_KEYS * sizeof(int32_t));
+    }
+
+    // A save followed by its commit, the worst case a caller can cause
+    result = bench_begin("persistence_save_commit", 0);
+    for (int sample = 0; sample < BENCH_COMMIT_SAMPLES; sample++)
+    {
+        bench_key(key, sizeof(key), sample % BENCH_KEYS);
+        int32_t value = -sample;
+        int64_t start = esp_timer_get_time();
+        persistence_save(VALUE_TYPE_INT32, key, &value);
+        persistence_flush();
+        bench_sample(result, start, 1, sizeof(int32_t));
+    }
+
+    result = bench_begin("persistence_load", 0);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < BENCH_KEYS; i++)
+        {
+            int32_t value;
+            bench_key(key, sizeof(key), i);
+            persistence_load(VALUE_TYPE_INT32, key, &value);
+        }
+        bench_sample(result, start, BENCH_KEYS, BENCH_KEYS * sizeof(int32_t));
+    }
+
+    // Reopening drops the cache, so every first load reads NVS
+    persistence_deinit();
+    persistence_init(BENCH_NAMESPACE);
+    result = bench_begin("persistence_load_uncached", 0);
+    for (int i = 0; i < BENCH_KEYS; i++)
+    {
+        int32_t value;
+        bench_key(key, sizeof(key), i);
+        int64_t start = esp_timer_get_time();
+        persistence_load(VALUE_TYPE_INT32, key, &value);
+        bench_sample(result, start, 1, sizeof(int32_t));
+    }
+}
+
+// Capability document
+
+static void bench_capa_read_run(bench_result_t *result, ble_gatt_access_fn *read, bool invalidate)
+{
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(NULL, 0);
+    if (om == NULL)
+    {
+        ESP_LOGE(TAG, "%s: no mbuf", result->name);
+        return;
+    }
+    if (invalidate)
+    {
+        capa_document_invalidate();
+    }
+
+    struct ble_gatt_access_ctxt ctxt = {.op = BLE_GATT_ACCESS_OP_READ_CHR, .om = om};
+    int64_t start = esp_timer_get_time();
+    int rc = read(BENCH_CONN_HANDLE, 0, &ctxt, NULL);
+    bench_sample(result, start, 1, OS_MBUF_PKTLEN(om));
+    os_mbuf_free_chain(om);
+
+    if (rc != 0)
+    {
+        ESP_LOGE(TAG, "%s: read failed (%d)", result->name, rc);
+    }
+}
+
+static void bench_capabilities(void)
+{
+    // One mbuf at a time, the document needs several blocks of the small NimBLE pool
+    bench_result_t *result = bench_begin("capa_read", 0);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        bench_capa_read_run(result, capa_read, false);
+    }
+
+    result = bench_begin("capa_read_reload", 0);
+    for (int sample = 0; sample < BENCH_COMMIT_SAMPLES; sample++)
+    {
+        bench_capa_read_run(result, capa_read, true);
+    }
+
+    result = bench_begin("capa_binary_read", 0);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        bench_capa_read_run(result, capa_binary_read, false);
+    }
+}
+
+// Rendering
+
+/// Waits until the strip is done with the last frame, so a flush measures the packing only.
+static void bench_strip_idle(uint32_t count)
+{
+    uint32_t airtime_ms = count * BENCH_WS2812_US_PER_LED / 1000 + 1;
+    TickType_t ticks = pdMS_TO_TICKS(airtime_ms);
+    vTaskDelay(ticks > 0 ? ticks : 1);
+}
+
+static void bench_render_run(uint32_t count)
+{
+    // Candle does per pixel noise and waves, the most expensive of the built-in effects
+    led_effect_params_t params = {
+        .start = 0, .count = count, .color = {255, 147, 41}, .color2 = {0, 0, 0}, .period_ms = 2000};
+    bench_result_t *result = bench_begin("render", count);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        led_effects_start(LED_EFFECT_CANDLE, &params);
+        int64_t start = esp_timer_get_time();
+        led_effects_schedule();
+        bench_sample(result, start, 1, count * 3);
+
+        // Without effects the next schedule restarts the frame clock, the next sample renders at once
+        led_effects_stop(0, count);
+        led_effects_schedule();
+    }
+    led_matrix_flush();
+
+    result = bench_begin("pack", count);
+    for (int sample = 0; sample < BENCH_SAMPLES; sample++)
+    {
+        led_matrix_set_range(0, count, sample, 0x20, 0xff - sample);
+        led_matrix_commit();
+        bench_strip_idle(count);
+
+        int64_t start = esp_timer_get_time();
+        led_matrix_flush();
+        bench_sample(result, start, 1, count * 3);
+    }
+    bench_strip_idle(count);
+}
+
+static void bench_render(void)
+{
+    uint32_t size = led_matrix_get_size();
+    for (uint32_t count = 16; count < size; count *= 4)
+    {
+        bench_render_run(count);
+    }
+    bench_render_run(size);
+}
+
+static void bench_report(void)
+{
+    const esp_app_desc_t *app_desc = esp_app_get_description();
+    printf("\n" BENCH_JSON_BEGIN "\n");
+    printf("{\"version\":\"%s\",\"idf\":\"%s\",\"target\":\"%s\",\"led_count\":%lu,\"results\":[\n", app_desc->version,
+           app_desc->idf_ver, CONFIG_IDF_TARGET, (unsigned long)led_matrix_get_size());
+
+    for (int i = 0; i < s_result_count; i++)
+    {
+        const bench_result_t *result = &s_results[i];
+        double mean_us = result->ops > 0 ? (double)result->total_us / result->ops : 0;
+        double seconds = result->total_us / 1e6;
+
+        printf("  {\"name\":\"%s\",\"arg\":%lu,\"samples\":%lu,\"ops\":%lu,\"mean_us\":%.3f,\"min_us\":%.3f,"
+               "\"max_us\":%.3f,\"ops_per_s\":%.1f",
+               result->name, (unsigned long)result->arg, (unsigned long)result->samples, (unsigned long)result->ops,
+               mean_us, result->min_us, result->max_us, seconds > 0 ? result->ops / seconds : 0);
+        if (result->bytes > 0)
+        {
+            printf(",\"bytes_per_s\":%.1f", seconds > 0 ? result->bytes / seconds : 0);
+        }
+        printf("}%s\n", i + 1 < s_result_count ? "," : "");
+    }
+
+    printf("]}\n");
+    printf(BENCH_JSON_END "\n");
+    fflush(stdout);
+}
+
+void benchmark_run(void)
+{
+    ESP_LOGI(TAG, "Running benchmarks");
+    s_result_count = 0;
+
+    // The components log as they are set up and torn down, keep that out of the measurements and
+    // away from the report
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    persistence_init(BENCH_NAMESPACE);
+    storage_init();
+    assets_init();
+    led_matrix_setup();
+    nimble_port_init(); // Only for the mbufs of the capability reads, the host is not started
+
+    bench_dispatch();
+    bench_storage_read();
+    bench_persistence();
+    bench_capabilities();
+    bench_render();
+
+    persistence_deinit();
+    esp_log_level_set("*", CONFIG_LOG_DEFAULT_LEVEL);
+    bench_report();
+}
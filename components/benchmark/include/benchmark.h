@@ -0,0 +1,25 @@
+#pragma once
+
+/// Microbenchmarks of the hot paths, built with CONFIG_WLED_BENCHMARK
+///
+/// Measures binary command dispatch, storage reads per chunk size, persistence saves and
+/// loads with and without commits, capability document serving, and effect rendering and strip
+/// packing per LED count. The components are driven directly from the calling task, so nothing
+/// else of the firmware may be running. Logging is limited to errors while they run. The results are
+/// printed as one JSON document on stdout, on lines of their own between two marker lines, so it can
+/// be cut out of a serial console or host log that also carries log output:
+///
+///     ---- benchmark json begin ----
+///     {"version": "...", "idf": "...", "target": "...", "led_count": 1024, "results": [
+///       {"name": "ls_dispatch_fill", "arg": 1, "samples": 64, "ops": 4096, "mean_us": 3.1,
+///        "min_us": 2.8, "max_us": 9.5, "ops_per_s": 322580.6, "bytes_per_s": 1612903.2},
+///       ...
+///     ]}
+///     ---- benchmark json end ----
+///
+/// `arg` is the parameter of the run (ops per frame, chunk size or LED count), min and max are per
+/// operation over the samples, and bytes_per_s is only present for runs that move data.
+
+/// Runs every benchmark and prints the results. Uses its own NVS namespace, the state of the
+/// firmware is left alone.
+void benchmark_run(void);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Append-only journal of small state records in the `journal` partition
+///
+/// The partition is split into two areas. Records are appended to the active area; when it runs full
+/// the journal is compacted: the owner writes a snapshot of its whole state into the other area, which
+/// then becomes the active one. Every record carries a CRC, so a record torn by a power cut ends the
+/// replay instead of being applied. Records appended shortly before a snapshot may be replayed on top
+/// of it, so applying a record twice has to be harmless.
+
+#define JOURNAL_RECORD_MAX 1024 ///< Largest payload accepted by journal_append()
+
+/// Called for every valid record, oldest first.
+typedef void (*journal_replay_fn_t)(uint8_t type, const void *data, size_t len, void *ctx);
+
+/// Called by the journal task during compaction. Writes the current state with journal_compact_write()
+/// and returns false if that failed.
+typedef bool (*journal_snapshot_fn_t)(void *ctx);
+
+typedef struct
+{
+    uint32_t appended;    ///< Records accepted by journal_append()
+    uint32_t dropped;     ///< Records rejected because the RAM buffers were full
+    uint32_t written;     ///< Bytes appended to flash
+    uint32_t compactions; ///< Snapshots written
+    uint32_t torn;        ///< Corrupt records found at boot
+} journal_stats_t;
+
+/**
+ * @brief Opens the journal partition, replays its records and starts the journal task.
+ * @param replay   Receives every record stored so far, before this function returns.
+ * @param snapshot Writes the full state during compaction.
+ * @param ctx      Passed to both callbacks.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no journal partition.
+ */
+esp_err_t journal_init(journal_replay_fn_t replay, journal_snapshot_fn_t snapshot, void *ctx);
+
+/**
+ * @brief Queues a record. Only copies it into a RAM buffer; the journal task writes the buffer to
+ * flash in one sequential write shortly after. If the buffers are full the record is dropped and a
+ * compaction is scheduled, whose snapshot contains the lost change.
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE for payloads above JOURNAL_RECORD_MAX, ESP_ERR_NO_MEM if dropped.
+ */
+esp_err_t journal_append(uint8_t type, const void *data, size_t len);
+
+/**
+ * @brief Writes one snapshot record. Only valid inside the journal_snapshot_fn_t callback.
+ * Unlike journal_append() the payload may be larger than JOURNAL_RECORD_MAX (up to 65534 bytes).
+ */
+esp_err_t journal_compact_write(uint8_t type, const void *data, size_t len);
+
+void journal_get_stats(journal_stats_t *stats);
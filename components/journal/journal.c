@@ -0,0 +1,383 @@
+#include "journal.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "journal";
+
+#define JOURNAL_PARTITION_SUBTYPE 0x41
+#define JOURNAL_MAGIC 0x314a544d        // "MTJ1"
+#define JOURNAL_SECTOR_SIZE 4096
+#define JOURNAL_FLUSH_DELAY_MS 100      // Gathers a burst of records into one flash write
+#define JOURNAL_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+/// Start of an area. Written last during compaction, so an interrupted compaction leaves no valid header.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t crc;
+    uint32_t reserved;
+} journal_area_header_t;
+
+/// Start of a record, followed by `len` payload bytes padded to 4. Erased flash reads as len 0xFFFF.
+typedef struct
+{
+    uint16_t len;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t crc; ///< Over len, type, reserved and the payload
+} journal_record_header_t;
+
+/// Per RAM buffer, there are two. Sized so a record of JOURNAL_RECORD_MAX fits an empty buffer.
+#define JOURNAL_BUFFER_SIZE (sizeof(journal_record_header_t) + JOURNAL_ALIGN(JOURNAL_RECORD_MAX))
+
+typedef struct
+{
+    const esp_partition_t *partition;
+    size_t area_size;
+    int active;
+    uint32_t sequence;
+    size_t write_offset;
+    size_t compact_offset;
+
+    uint8_t buffers[2][JOURNAL_BUFFER_SIZE];
+    size_t fill;
+    int current;
+    bool compact_requested;
+
+    journal_snapshot_fn_t snapshot;
+    void *ctx;
+    SemaphoreHandle_t lock;
+    TaskHandle_t task;
+    journal_stats_t stats;
+} journal_t;
+
+static journal_t s_journal;
+
+static size_t journal_area_base(int area)
+{
+    return (size_t)area * s_journal.area_size;
+}
+
+static uint32_t journal_record_crc(const journal_record_header_t *header, const void *data)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(journal_record_header_t, crc));
+    return esp_rom_crc32_le(crc, data, header->len);
+}
+
+static uint32_t journal_area_crc(const journal_area_header_t *header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(journal_area_header_t, crc));
+}
+
+static bool journal_area_read_header(int area, uint32_t *sequence)
+{
+    journal_area_header_t header;
+    if (esp_partition_read(s_journal.partition, journal_area_base(area), &header, sizeof(header)) != ESP_OK ||
+        header.magic != JOURNAL_MAGIC || header.crc != journal_area_crc(&header))
+    {
+        return false;
+    }
+    *sequence = header.sequence;
+    return true;
+}
+
+static esp_err_t journal_area_write_header(int area, uint32_t sequence)
+{
+    journal_area_header_t header = {
+        .magic = JOURNAL_MAGIC,
+        .sequence = sequence,
+    };
+    header.crc = journal_area_crc(&header);
+    return esp_partition_write(s_journal.partition, journal_area_base(area), &header, sizeof(header));
+}
+
+/// Replays the active area and positions the write offset behind its last valid record. Returns false
+/// if it ended on a corrupt record, after which nothing may be appended to the area.
+static bool journal_replay(journal_replay_fn_t replay, void *ctx)
+{
+    size_t base = journal_area_base(s_journal.active);
+    size_t offset = sizeof(journal_area_header_t);
+    uint8_t *payload = NULL;
+    size_t payload_size = 0;
+    bool clean = true;
+    uint32_t records = 0;
+
+    while (offset + sizeof(journal_record_header_t) <= s_journal.area_size)
+    {
+        journal_record_header_t header;
+        if (esp_partition_read(s_journal.partition, base + offset, &header, sizeof(header)) != ESP_OK)
+        {
+            clean = false;
+            break;
+        }
+        if (header.len == 0xFFFF && header.type == 0xFF && header.crc == 0xFFFFFFFF)
+        {
+            break; // Erased, end of the journal
+        }
+
+        size_t size = sizeof(header) + JOURNAL_ALIGN(header.len);
+        if (header.len == 0xFFFF || offset + size > s_journal.area_size)
+        {
+            clean = false;
+            break;
+        }
+
+        if (header.len > payload_size)
+        {
+            uint8_t *grown = realloc(payload, header.len);
+            if (grown == NULL)
+            {
+                ESP_LOGE(TAG, "Failed to allocate %u bytes for replay", header.len);
+                clean = false;
+                break;
+            }
+            payload = grown;
+            payload_size = header.len;
+        }
+
+        if (esp_partition_read(s_journal.partition, base + offset + sizeof(header), payload, header.len) != ESP_OK ||
+            header.crc != journal_record_crc(&header, payload))
+        {
+            clean = false;
+            break;
+        }
+
+        replay(header.type, payload, header.len, ctx);
+        offset += size;
+        records++;
+    }
+    free(payload);
+
+    if (!clean)
+    {
+        s_journal.stats.torn++;
+        ESP_LOGW(TAG, "Corrupt record at offset %zu, compacting", offset);
+    }
+    s_journal.write_offset = offset;
+    ESP_LOGI(TAG, "Replayed %lu records from area %d (sequence %lu, %zu bytes)", (unsigned long)records,
+             s_journal.active, (unsigned long)s_journal.sequence, offset);
+    return clean;
+}
+
+esp_err_t journal_compact_write(uint8_t type, const void *data, size_t len)
+{
+    journal_record_header_t header = {
+        .len = len,
+        .type = type,
+    };
+    size_t size = sizeof(header) + JOURNAL_ALIGN(len);
+    if (len >= 0xFFFF || s_journal.compact_offset + size > s_journal.area_size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    header.crc = journal_record_crc(&header, data);
+
+    static const uint8_t padding[3];
+    size_t base = journal_area_base(s_journal.active ^ 1) + s_journal.compact_offset;
+    esp_err_t ret = esp_partition_write(s_journal.partition, base, &header, sizeof(header));
+    if (ret == ESP_OK && len > 0)
+    {
+        ret = esp_partition_write(s_journal.partition, base + sizeof(header), data, len);
+    }
+    if (ret == ESP_OK && JOURNAL_ALIGN(len) != len)
+    {
+        ret = esp_partition_write(s_journal.partition, base + sizeof(header) + len, padding, JOURNAL_ALIGN(len) - len);
+    }
+    if (ret == ESP_OK)
+    {
+        s_journal.compact_offset += size;
+    }
+    return ret;
+}
+
+/// Writes a snapshot into the inactive area and switches to it. The old area stays valid until the
+/// new header is written, so a power cut during compaction loses nothing.
+static bool journal_compact(void)
+{
+    int next = s_journal.active ^ 1;
+    esp_err_t ret = esp_partition_erase_range(s_journal.partition, journal_area_base(next), s_journal.area_size);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to erase area %d (%s)", next, esp_err_to_name(ret));
+        return false;
+    }
+
+    s_journal.compact_offset = sizeof(journal_area_header_t);
+    if (!s_journal.snapshot(s_journal.ctx) || journal_area_write_header(next, s_journal.sequence + 1) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to write snapshot");
+        return false;
+    }
+
+    s_journal.active = next;
+    s_journal.sequence++;
+    s_journal.write_offset = s_journal.compact_offset;
+    s_journal.stats.compactions++;
+    ESP_LOGI(TAG, "Compacted into area %d (%zu bytes)", next, s_journal.write_offset);
+    return true;
+}
+
+static void journal_task(void *args)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(JOURNAL_FLUSH_DELAY_MS));
+
+        // Swap buffers, appends continue into the other one while this one is written
+        xSemaphoreTake(s_journal.lock, portMAX_DELAY);
+        const uint8_t *buffer = s_journal.buffers[s_journal.current];
+        size_t len = s_journal.fill;
+        bool compact = s_journal.compact_requested;
+        s_journal.current ^= 1;
+        s_journal.fill = 0;
+        s_journal.compact_requested = false;
+        xSemaphoreGive(s_journal.lock);
+
+        // Records are appended after their change was applied, so a snapshot taken now already
+        // contains everything in this buffer
+        if (compact || s_journal.write_offset + len > s_journal.area_size ||
+            s_journal.write_offset > s_journal.area_size * 3 / 4)
+        {
+            if (journal_compact())
+            {
+                continue;
+            }
+            if (s_journal.write_offset + len > s_journal.area_size)
+            {
+                ESP_LOGE(TAG, "Journal full, dropping %zu bytes", len);
+                continue;
+            }
+        }
+
+        if (len > 0)
+        {
+            esp_err_t ret = esp_partition_write(s_journal.partition,
+                                                journal_area_base(s_journal.active) + s_journal.write_offset, buffer, len);
+            if (ret != ESP_OK)
+            {
+                ESP_LOGE(TAG, "Failed to write %zu bytes (%s)", len, esp_err_to_name(ret));
+                continue;
+            }
+            s_journal.write_offset += len;
+            s_journal.stats.written += len;
+        }
+    }
+}
+
+esp_err_t journal_init(journal_replay_fn_t replay, journal_snapshot_fn_t snapshot, void *ctx)
+{
+    if (s_journal.task != NULL)
+    {
+        return ESP_OK;
+    }
+    if (replay == NULL || snapshot == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    s_journal.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE, "journal");
+    if (s_journal.partition == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to find journal partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_journal.area_size = (s_journal.partition->size / 2) & ~(size_t)(JOURNAL_SECTOR_SIZE - 1);
+    s_journal.snapshot = snapshot;
+    s_journal.ctx = ctx;
+
+    uint32_t sequence[2];
+    bool valid[2] = {journal_area_read_header(0, &sequence[0]), journal_area_read_header(1, &sequence[1])};
+    bool clean = true;
+    if (!valid[0] && !valid[1])
+    {
+        ESP_LOGI(TAG, "No journal found, starting a new one");
+        s_journal.active = 0;
+        s_journal.sequence = 1;
+        s_journal.write_offset = sizeof(journal_area_header_t);
+        esp_err_t ret = esp_partition_erase_range(s_journal.partition, 0, s_journal.area_size);
+        if (ret == ESP_OK)
+        {
+            ret = journal_area_write_header(0, s_journal.sequence);
+        }
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to format journal (%s)", esp_err_to_name(ret));
+            return ret;
+        }
+    }
+    else
+    {
+        s_journal.active = valid[1] && (!valid[0] || (int32_t)(sequence[1] - sequence[0]) > 0) ? 1 : 0;
+        s_journal.sequence = sequence[s_journal.active];
+        clean = journal_replay(replay, ctx);
+    }
+
+    s_journal.lock = xSemaphoreCreateMutex();
+    s_journal.compact_requested = !clean;
+    if (s_journal.lock == NULL ||
+        xTaskCreate(journal_task, "journal", configMINIMAL_STACK_SIZE * 3, NULL, 1, &s_journal.task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start journal task");
+        return ESP_ERR_NO_MEM;
+    }
+    if (!clean)
+    {
+        xTaskNotifyGive(s_journal.task);
+    }
+    return ESP_OK;
+}
+
+esp_err_t journal_append(uint8_t type, const void *data, size_t len)
+{
+    if (len > JOURNAL_RECORD_MAX)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (s_journal.task == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    journal_record_header_t header = {
+        .len = len,
+        .type = type,
+    };
+    header.crc = journal_record_crc(&header, data);
+    size_t size = sizeof(header) + JOURNAL_ALIGN(len);
+
+    xSemaphoreTake(s_journal.lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if (s_journal.fill + size > JOURNAL_BUFFER_SIZE)
+    {
+        s_journal.stats.dropped++;
+        s_journal.compact_requested = true;
+        ret = ESP_ERR_NO_MEM;
+    }
+    else
+    {
+        uint8_t *dst = &s_journal.buffers[s_journal.current][s_journal.fill];
+        memcpy(dst, &header, sizeof(header));
+        memcpy(dst + sizeof(header), data, len);
+        memset(dst + sizeof(header) + len, 0, JOURNAL_ALIGN(len) - len);
+        s_journal.fill += size;
+        s_journal.stats.appended++;
+    }
+    xSemaphoreGive(s_journal.lock);
+
+    xTaskNotifyGive(s_journal.task);
+    return ret;
+}
+
+void journal_get_stats(journal_stats_t *stats)
+{
+    *stats = s_journal.stats;
+}
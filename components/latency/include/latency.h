@@ -0,0 +1,97 @@
+#pragma once
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+/// Latency instrumentation from a BLE write to the frame that shows it
+///
+/// Every record queued for the LED task carries the time it was received. The LED task reports the
+/// records it applies and the moment it hands the frame to the strip driver, which yields the
+/// receive -> apply -> transmit histograms. Values are microseconds of esp_timer, which unlike the
+/// cycle counters is the same clock on both cores.
+///
+/// Without CONFIG_WLED_LATENCY_TRACE the recording functions are empty inlines and the rest is not
+/// declared, so the instrumentation costs nothing.
+
+typedef enum
+{
+    LATENCY_RX_TO_APPLY,    ///< Received by the write callback until applied by the LED task
+    LATENCY_APPLY_TO_TX,    ///< Applied until the frame starts going out to the strip
+    LATENCY_RX_TO_TX,       ///< End to end, from the oldest record in the frame
+    LATENCY_FRAME,          ///< LED task busy time per transmitted frame
+    LATENCY_QUEUE_DEPTH,    ///< Records applied per frame (a count, not a time)
+    LATENCY_PERSIST_SAVE,   ///< persistence_save() and friends, as seen by the caller
+    LATENCY_PERSIST_COMMIT, ///< Writing the dirty keys and the NVS commit
+    LATENCY_METRIC_COUNT,
+} latency_metric_t;
+
+#define LATENCY_BUCKETS 16 ///< Bucket i holds values in [2^i, 2^(i+1)), the last one everything above
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+#if CONFIG_WLED_LATENCY_TRACE
+
+/// Current time in microseconds, wraps after about 71 minutes.
+uint32_t latency_now(void);
+
+/// Adds a value to a histogram, from any task.
+void latency_record(latency_metric_t metric, uint32_t value);
+
+/// Records the time passed since `stamp`.
+static inline void latency_since(latency_metric_t metric, uint32_t stamp)
+{
+    latency_record(metric, latency_now() - stamp);
+}
+
+/// LED task. Marks the start of the work on a frame.
+void latency_frame_begin(void);
+
+/// LED task. Reports a record received at `stamp` that was just applied to the back buffer.
+void latency_frame_input(uint32_t stamp);
+
+/// LED task. Reports that the frame holding every record since the last call starts transmitting.
+void latency_frame_transmit(void);
+
+void latency_get(latency_metric_t metric, latency_histogram_t *histogram);
+const char *latency_metric_name(latency_metric_t metric);
+void latency_reset(void);
+
+/// Starts a console on the configured console port with the `latency` command, which prints the
+/// histograms and takes `reset` to clear them.
+esp_err_t latency_console_start(void);
+
+#else
+
+static inline uint32_t latency_now(void)
+{
+    return 0;
+}
+
+static inline void latency_record(latency_metric_t metric, uint32_t value)
+{
+}
+
+static inline void latency_since(latency_metric_t metric, uint32_t stamp)
+{
+}
+
+static inline void latency_frame_begin(void)
+{
+}
+
+static inline void latency_frame_input(uint32_t stamp)
+{
+}
+
+static inline void latency_frame_transmit(void)
+{
+}
+
+#endif
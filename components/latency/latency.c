@@ -0,0 +1,191 @@
+#include "latency.h"
+
+#if CONFIG_WLED_LATENCY_TRACE
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "latency";
+
+static latency_histogram_t histograms[LATENCY_METRIC_COUNT];
+static portMUX_TYPE histograms_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const metric_names[LATENCY_METRIC_COUNT] = {
+    [LATENCY_RX_TO_APPLY] = "rx_to_apply",
+    [LATENCY_APPLY_TO_TX] = "apply_to_tx",
+    [LATENCY_RX_TO_TX] = "rx_to_tx",
+    [LATENCY_FRAME] = "frame",
+    [LATENCY_QUEUE_DEPTH] = "queue_depth",
+    [LATENCY_PERSIST_SAVE] = "persist_save",
+    [LATENCY_PERSIST_COMMIT] = "persist_commit",
+};
+
+/// Frame in progress, only touched by the LED task
+static struct
+{
+    bool pending;
+    uint32_t begin;
+    uint32_t oldest_rx;
+    uint32_t first_apply;
+} frame;
+
+uint32_t latency_now(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void latency_record(latency_metric_t metric, uint32_t value)
+{
+    latency_histogram_t *histogram = &histograms[metric];
+    uint32_t bucket = 31 - __builtin_clz(value | 1);
+
+    portENTER_CRITICAL(&histograms_lock);
+    histogram->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+    portEXIT_CRITICAL(&histograms_lock);
+}
+
+void latency_frame_begin(void)
+{
+    frame.begin = latency_now();
+}
+
+void latency_frame_input(uint32_t stamp)
+{
+    uint32_t now = latency_now();
+    latency_record(LATENCY_RX_TO_APPLY, now - stamp);
+
+    if (!frame.pending)
+    {
+        frame.pending = true;
+        frame.oldest_rx = stamp;
+        frame.first_apply = now;
+    }
+    else if ((int32_t)(stamp - frame.oldest_rx) < 0)
+    {
+        frame.oldest_rx = stamp;
+    }
+}
+
+void latency_frame_transmit(void)
+{
+    uint32_t now = latency_now();
+    latency_record(LATENCY_FRAME, now - frame.begin);
+
+    // Effect frames carry no client input
+    if (frame.pending)
+    {
+        latency_record(LATENCY_APPLY_TO_TX, now - frame.first_apply);
+        latency_record(LATENCY_RX_TO_TX, now - frame.oldest_rx);
+        frame.pending = false;
+    }
+}
+
+void latency_get(latency_metric_t metric, latency_histogram_t *histogram)
+{
+    portENTER_CRITICAL(&histograms_lock);
+    *histogram = histograms[metric];
+    portEXIT_CRITICAL(&histograms_lock);
+}
+
+const char *latency_metric_name(latency_metric_t metric)
+{
+    return metric < LATENCY_METRIC_COUNT ? metric_names[metric] : "unknown";
+}
+
+void latency_reset(void)
+{
+    portENTER_CRITICAL(&histograms_lock);
+    memset(histograms, 0, sizeof(histograms));
+    portEXIT_CRITICAL(&histograms_lock);
+}
+
+/// Returns the smallest bucket bound below which `percent` of the values lie.
+static uint32_t latency_percentile(const latency_histogram_t *histogram, uint32_t percent)
+{
+    uint64_t target = ((uint64_t)histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target)
+        {
+            return 2u << i;
+        }
+    }
+    return histogram->max;
+}
+
+static int latency_command(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "reset") == 0)
+    {
+        latency_reset();
+        printf("latency histograms cleared\n");
+        return 0;
+    }
+
+    printf("%-15s %10s %10s %10s %10s %10s\n", "metric", "count", "mean", "p50<", "p99<", "max");
+    for (int i = 0; i < LATENCY_METRIC_COUNT; i++)
+    {
+        latency_histogram_t histogram;
+        latency_get(i, &histogram);
+        printf("%-15s %10lu %10lu %10lu %10lu %10lu\n", metric_names[i], (unsigned long)histogram.count,
+               (unsigned long)(histogram.count > 0 ? histogram.sum / histogram.count : 0),
+               (unsigned long)latency_percentile(&histogram, 50), (unsigned long)latency_percentile(&histogram, 99),
+               (unsigned long)histogram.max);
+    }
+    return 0;
+}
+
+esp_err_t latency_console_start(void)
+{
+    esp_console_repl_t *repl = NULL;
+    esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    repl_config.prompt = "town>";
+
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    esp_console_dev_usb_serial_jtag_config_t dev_config = ESP_CONSOLE_DEV_USB_SERIAL_JTAG_CONFIG_DEFAULT();
+    esp_err_t err = esp_console_new_repl_usb_serial_jtag(&dev_config, &repl_config, &repl);
+#elif CONFIG_ESP_CONSOLE_USB_CDC
+    esp_console_dev_usb_cdc_config_t dev_config = ESP_CONSOLE_DEV_CDC_CONFIG_DEFAULT();
+    esp_err_t err = esp_console_new_repl_usb_cdc(&dev_config, &repl_config, &repl);
+#else
+    esp_console_dev_uart_config_t dev_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    esp_err_t err = esp_console_new_repl_uart(&dev_config, &repl_config, &repl);
+#endif
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to create the console (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    const esp_console_cmd_t command = {
+        .command = "latency",
+        .help = "Print the latency histograms in microseconds, 'latency reset' clears them",
+        .hint = "[reset]",
+        .func = latency_command,
+    };
+    err = esp_console_cmd_register(&command);
+    if (err == ESP_OK)
+    {
+        err = esp_console_start_repl(repl);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start the console (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+/// Fixed size command records passed from the BLE host task to the LED task.
+///
+/// Every source (one per BLE connection) has its own lock-free single producer / single consumer ring.
+/// The producer reserves room for a whole batch, fills the records in place and publishes them at once;
+/// the LED task drains every published record of all sources once per frame, starting with a different
+/// source each frame, and commits them as a single frame, so a batch never shows up half applied.
+
+typedef enum
+{
+    LED_CMD_FILL,         ///< color
+    LED_CMD_SET_RANGE,    ///< start, count, color
+    LED_CMD_FADE_RANGE,   ///< start, count, color (target), period_ms (transition)
+    LED_CMD_EFFECT,       ///< effect, start, count, color, color2, period_ms
+    LED_CMD_STOP_EFFECT,  ///< start, count
+    LED_CMD_SCENE_SAVE,   ///< effect (scene id), start (name slot from led_scene_stage_name(), 0 for none)
+    LED_CMD_SCENE_RECALL, ///< effect (scene id)
+} led_command_op_t;
+
+#define LED_COMMAND_SOURCES CONFIG_WLED_COMMAND_SOURCES
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t effect;
+    uint16_t period_ms;
+    uint16_t start;
+    uint16_t count;
+    uint8_t color[3];
+    uint8_t color2[3];
+} led_command_t;
+
+typedef struct
+{
+    uint32_t published;
+    uint32_t applied;
+    uint32_t dropped;
+    uint32_t high_watermark;
+} led_command_stats_t;
+
+/// Producer side. Returns false, and counts the records as dropped, if fewer than `n` are free in the
+/// ring of `source`. Sources beyond LED_COMMAND_SOURCES share rings.
+bool led_command_reserve(uint8_t source, uint32_t n);
+
+/// Producer side. Returns the `i`-th record of the current reservation.
+led_command_t *led_command_at(uint8_t source, uint32_t i);
+
+/// Producer side. Makes the first `n` reserved records visible to the LED task and wakes it.
+void led_command_publish(uint8_t source, uint32_t n);
+
+/// Producer side. Reserves, copies and publishes a single record.
+bool led_command_push(uint8_t source, const led_command_t *cmd);
+
+/// Consumer side, called by the LED task. Applies all published records to the back buffer and
+/// returns how many were applied. The caller commits the frame.
+uint32_t led_command_drain(void);
+
+/// Applies a single record to the back buffer right away, bypassing the queue, e.g. to restore state
+/// before the LED task runs. The caller commits the frame.
+void led_command_apply(const led_command_t *cmd);
+
+typedef void (*led_command_observer_fn_t)(const led_command_t *cmd);
+
+/// Registers a function the LED task calls with every record it drained and applied, e.g. to
+/// persist the LED state. Pass NULL to remove it.
+void led_command_set_observer(led_command_observer_fn_t observer);
+
+void led_command_get_stats(led_command_stats_t *stats);
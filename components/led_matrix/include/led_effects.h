@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum
+{
+    LED_EFFECT_FADE,      ///< One-shot blend from `color` to `color2` over `period_ms`, then holds `color2`.
+                          ///< Unlike the other effects it is not gamma corrected, see led_effect_render_fn_t
+    LED_EFFECT_FLICKER,   ///< `color` with random short dropouts, like a worn fluorescent tube
+    LED_EFFECT_CHASE,     ///< A single `color` pixel running over a `color2` background once per `period_ms`
+    LED_EFFECT_CANDLE,    ///< `color` modulated by slow per-pixel waves and noise
+    LED_EFFECT_DAY_NIGHT, ///< Smooth cycle between `color` (day) and `color2` (night) every `period_ms`
+    LED_EFFECT_BUILTIN_COUNT,
+} led_effect_id_t;
+
+#define LED_EFFECT_MAX 8
+
+typedef struct
+{
+    uint32_t start;
+    uint32_t count;
+    uint8_t color[3];
+    uint8_t color2[3];
+    uint32_t period_ms;
+} led_effect_params_t;
+
+typedef struct
+{
+    led_effect_params_t params;
+    uint32_t started_ms;
+    uint32_t seed;
+} led_effect_state_t;
+
+/// Renders one frame of an effect into `rgb`, which points at pixel `state->params.start` and holds
+/// `state->params.count` pixels. `elapsed_ms` counts from the start of the effect. Returns false
+/// when the effect has finished and its slot can be released. `rgb` goes to the strip as written:
+/// the built-in effects pass their colors through led_gamma8(), raw client colors set by fills,
+/// ranges, blits and streams are never corrected.
+typedef bool (*led_effect_render_fn_t)(led_effect_state_t *state, uint32_t elapsed_ms, uint8_t *rgb);
+
+typedef struct
+{
+    const char *name;
+    led_effect_render_fn_t render;
+} led_effect_t;
+
+typedef struct
+{
+    uint32_t frames;
+    uint32_t skipped_frames;
+    uint32_t last_render_us;
+    uint32_t max_render_us;
+} led_effect_stats_t;
+
+/// Registers an effect under `id`. The built-in effects occupy ids below LED_EFFECT_BUILTIN_COUNT.
+bool led_effects_register(uint8_t id, const led_effect_t *effect);
+
+/// Starts effect `id` on a pixel range, replacing any running effect on an overlapping range.
+bool led_effects_start(uint8_t id, const led_effect_params_t *params);
+
+/// Stops every effect overlapping the range. The pixels keep their last rendered color.
+void led_effects_stop(uint32_t start, uint32_t count);
+
+/// Renders and commits a frame if one is due. Called by the LED task, returns the number of
+/// milliseconds until the next frame is due or UINT32_MAX if no effect is running.
+uint32_t led_effects_schedule(void);
+
+/// Copies id and parameters of up to `max` running effects, returns how many were copied.
+uint32_t led_effects_get_active(uint8_t *ids, led_effect_params_t *params, uint32_t max);
+
+void led_effects_get_stats(led_effect_stats_t *stats);
+
+/// Fixed point helpers shared with other renderers.
+uint8_t led_sin8(uint8_t theta);
+uint8_t led_gamma8(uint8_t value);
+uint8_t led_blend8(uint8_t from, uint8_t to, uint8_t amount);
@@ -1,7 +1,55 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/// Entry point of the LED task.
 void led_matrix_init(void *args);
+
+/// Creates the strip drivers and framebuffers. Called by the LED task; call it earlier to restore a
+/// frame before the task starts. Calling it again is a no-op.
+void led_matrix_setup(void);
+
 uint32_t led_matrix_get_size();
+
+/// Draws into the back buffer. Nothing is sent to the strip until led_matrix_commit() is called.
 void led_matrix_set_pixel(uint32_t index, uint8_t red, uint8_t green, uint8_t blue);
+
+/// Reads a pixel back from the back buffer as it goes to the strip, black if the index is out of
+/// range.
+void led_matrix_get_pixel(uint32_t index, uint8_t rgb[3]);
+
+/// Sets every pixel to the same color in one pass over the back buffer.
+void led_matrix_fill(uint8_t red, uint8_t green, uint8_t blue);
+
+/// Sets `count` pixels starting at `start` to the same color. The range is clipped to the matrix size.
+void led_matrix_set_range(uint32_t start, uint32_t count, uint8_t red, uint8_t green, uint8_t blue);
+
+/// Copies `n` packed RGB pixels (3 bytes each) into the back buffer, starting at index 0.
+void led_matrix_blit(const uint8_t *rgb, size_t n);
+
+/// Copies the first `n` pixels of the back buffer into `rgb`, the counterpart of led_matrix_blit().
+void led_matrix_read(uint8_t *rgb, size_t n);
+
+typedef void (*led_matrix_draw_fn_t)(uint8_t *rgb, uint32_t count, void *ctx);
+
+/// Calls `draw` with the back buffer locked. `rgb` points at pixel `start` and holds `count` packed
+/// RGB pixels, all of which are treated as changed. The range is clipped to the matrix size.
+void led_matrix_draw(uint32_t start, uint32_t count, led_matrix_draw_fn_t draw, void *ctx);
+
+/// Publishes the pixels changed since the last commit and wakes the LED task to refresh the strip.
+void led_matrix_commit(void);
+
+/// Sends the committed pixels to the strip once the previous frame is out. The LED task does this
+/// every frame; anyone else may only call it while the task is not running, e.g. a benchmark.
+/// Returns false if nothing was committed since the last call.
+bool led_matrix_flush(void);
+
+/// Wakes the LED task so it re-evaluates its schedule, e.g. after an effect was started.
+void led_matrix_wake(void);
+
+/// Blocks until the LED task has applied every command and streamed frame queued before the call and
+/// sent the result, so a test harness sees one frame per input. Waits for the LED task to start if it
+/// was only created; must not be called by the LED task itself or when there is none.
+void led_matrix_sync(void);
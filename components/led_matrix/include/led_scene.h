@@ -0,0 +1,36 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdint.h>
+
+/// Named scenes: a whole frame plus the effects running on it, stored run-length encoded as a
+/// persistence blob. Saving and recalling run on the LED task (LED_CMD_SCENE_SAVE/RECALL), so a
+/// recall lands in the back buffer in one go and is shown as a single frame.
+
+#define LED_SCENE_MAX 8
+#define LED_SCENE_NAME_LEN 16 ///< Including the terminator
+#define LED_SCENE_STAGED_NAMES 8 ///< Names of saves queued at the same time
+
+typedef struct
+{
+    uint8_t id;
+    char name[LED_SCENE_NAME_LEN];
+} led_scene_info_t;
+
+/// Creates the lock guarding the scene index. Called by led_matrix_setup(), before any task uses scenes.
+void led_scene_init(void);
+
+/// Holds `name` for one LED_CMD_SCENE_SAVE and returns the slot the command carries in `start`, or 0
+/// for an empty name or if all slots are taken. Every returned slot must reach led_scene_save(),
+/// which frees it. Called by the producer before queueing the command.
+uint16_t led_scene_stage_name(const char *name);
+
+/// Stores the back buffer and the running effects as scene `id`. The name staged in `name_slot` only
+/// enters the scene list once the save succeeded; slot 0 keeps the current name.
+esp_err_t led_scene_save(uint8_t id, uint16_t name_slot);
+
+/// Replaces the back buffer and the running effects with scene `id`. The caller commits the frame.
+esp_err_t led_scene_recall(uint8_t id);
+
+/// Copies the saved scenes into `out`, returns how many there are (at most `max` are copied).
+uint32_t led_scene_list(led_scene_info_t *out, uint32_t max);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Streamed frames from a live show controller.
+///
+/// The producer (BLE host task) assembles a frame on top of a private shadow copy of the matrix,
+/// which holds the last frame it submitted. A submitted frame hands only the pixels it wrote to the
+/// LED task, which copies them into the back buffer and commits them as one frame. If the LED task
+/// has not picked up the previous frame yet, both are merged and the older one counts as late.
+
+typedef struct
+{
+    uint32_t received; ///< Frames submitted completely
+    uint32_t applied;  ///< Frames shown, merged frames count once
+    uint32_t dropped;  ///< Frames abandoned because a fragment was lost or malformed
+    uint32_t late;     ///< Frames with an old sequence number or superseded before they were shown
+} led_stream_stats_t;
+
+/// Producer side. Starts assembling frame `sequence` of `source`, abandoning an incomplete one of any
+/// source. Returns false, and counts the frame as late, if the sequence number is not newer than the
+/// last one begun by the same source since led_stream_reset().
+bool led_stream_begin(uint8_t source, uint16_t sequence);
+
+/// Producer side. Returns the `count` packed RGB pixels at `start` of the frame being assembled for
+/// the caller to decode into, and marks them as written. They hold the last submitted frame, or what
+/// this frame already wrote there, so delta encodings can update them in place. Returns NULL if the range lies outside the matrix.
+uint8_t *led_stream_span(uint32_t start, uint32_t count);
+
+/// Producer side. Copies `count` packed RGB pixels to `start` of the frame being assembled. Returns
+/// false if the range lies outside the matrix.
+bool led_stream_write(uint32_t start, const uint8_t *rgb, uint32_t count);
+
+/// Producer side. Hands the pixels written by the assembled frame to the LED task and wakes it.
+void led_stream_submit(void);
+
+/// Producer side. Abandons the frame being assembled, rolls its pixels back to the last submitted frame
+/// and counts it as dropped.
+void led_stream_abort(void);
+
+/// Producer side. Forgets the sequence number of `source` and abandons its frame if one is being
+/// assembled, e.g. when the controller disconnected. Its next frame is accepted whatever its
+/// sequence number, so a controller that reconnects or takes over the source may start at 0.
+void led_stream_reset(uint8_t source);
+
+/// Consumer side, called by the LED task. Copies the latest submitted frame into the back buffer and
+/// returns true if there was one. The caller commits the frame.
+bool led_stream_apply(void);
+
+void led_stream_get_stats(led_stream_stats_t *stats);
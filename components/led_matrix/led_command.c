@@ -0,0 +1,222 @@
+#include "led_command.h"
+
+#include "esp_log.h"
+#include "latency.h"
+#include "led_effects.h"
+#include "led_matrix.h"
+#include "led_scene.h"
+#include "sdkconfig.h"
+#include <stdatomic.h>
+#include <string.h>
+
+static const char *TAG = "led_command";
+
+#define LED_COMMAND_QUEUE_MASK (CONFIG_WLED_COMMAND_QUEUE_LEN - 1)
+
+_Static_assert((CONFIG_WLED_COMMAND_QUEUE_LEN & LED_COMMAND_QUEUE_MASK) == 0,
+               "WLED_COMMAND_QUEUE_LEN must be a power of two");
+
+/// One ring per source, so a client flooding its queue never takes room from another one
+typedef struct
+{
+    led_command_t ring[CONFIG_WLED_COMMAND_QUEUE_LEN];
+#if CONFIG_WLED_LATENCY_TRACE
+    uint32_t received[CONFIG_WLED_COMMAND_QUEUE_LEN]; ///< Kept next to the ring, the records stay as journaled
+#endif
+
+    // Free running indices, only the producer writes head and only the consumer writes tail
+    atomic_uint head;
+    atomic_uint tail;
+} led_command_queue_t;
+
+static led_command_queue_t queues[LED_COMMAND_SOURCES];
+static uint8_t first_source;
+
+static led_command_stats_t stats;
+static led_command_observer_fn_t observer;
+
+static led_command_queue_t *queue_of(uint8_t source)
+{
+    return &queues[source % LED_COMMAND_SOURCES];
+}
+
+bool led_command_reserve(uint8_t source, uint32_t n)
+{
+    led_command_queue_t *queue = queue_of(source);
+    uint32_t used = atomic_load_explicit(&queue->head, memory_order_relaxed) -
+                    atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (n > CONFIG_WLED_COMMAND_QUEUE_LEN - used)
+    {
+        stats.dropped += n;
+        return false;
+    }
+    return true;
+}
+
+led_command_t *led_command_at(uint8_t source, uint32_t i)
+{
+    led_command_queue_t *queue = queue_of(source);
+    return &queue->ring[(atomic_load_explicit(&queue->head, memory_order_relaxed) + i) & LED_COMMAND_QUEUE_MASK];
+}
+
+void led_command_publish(uint8_t source, uint32_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    led_command_queue_t *queue = queue_of(source);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+#if CONFIG_WLED_LATENCY_TRACE
+    // Published from the write callback, so this is the time the client's write arrived
+    uint32_t now = latency_now();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        queue->received[(head + i) & LED_COMMAND_QUEUE_MASK] = now;
+    }
+#endif
+    uint32_t new_head = head + n;
+    atomic_store_explicit(&queue->head, new_head, memory_order_release);
+
+    stats.published += n;
+    uint32_t used = new_head - atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (used > stats.high_watermark)
+    {
+        stats.high_watermark = used;
+    }
+
+    led_matrix_wake();
+}
+
+bool led_command_push(uint8_t source, const led_command_t *cmd)
+{
+    if (!led_command_reserve(source, 1))
+    {
+        return false;
+    }
+
+    *led_command_at(source, 0) = *cmd;
+    led_command_publish(source, 1);
+    return true;
+}
+
+void led_command_apply(const led_command_t *cmd)
+{
+    switch (cmd->op)
+    {
+    case LED_CMD_FILL:
+        led_effects_stop(0, led_matrix_get_size());
+        led_matrix_fill(cmd->color[0], cmd->color[1], cmd->color[2]);
+        break;
+
+    case LED_CMD_SET_RANGE:
+        led_effects_stop(cmd->start, cmd->count);
+        led_matrix_set_range(cmd->start, cmd->count, cmd->color[0], cmd->color[1], cmd->color[2]);
+        break;
+
+    case LED_CMD_FADE_RANGE: {
+        if (cmd->period_ms == 0)
+        {
+            led_effects_stop(cmd->start, cmd->count);
+            led_matrix_set_range(cmd->start, cmd->count, cmd->color[0], cmd->color[1], cmd->color[2]);
+            break;
+        }
+
+        led_effect_params_t params = {
+            .start = cmd->start,
+            .count = cmd->count,
+            .color2 = {cmd->color[0], cmd->color[1], cmd->color[2]},
+            .period_ms = cmd->period_ms,
+        };
+
+        // Fade from whatever the first pixel of the range shows right now. The back buffer holds
+        // strip colors, the same space the fade blends in, so there is no jump.
+        led_matrix_get_pixel(cmd->start, params.color);
+        led_effects_start(LED_EFFECT_FADE, &params);
+        break;
+    }
+
+    case LED_CMD_EFFECT: {
+        led_effect_params_t params = {
+            .start = cmd->start,
+            .count = cmd->count,
+            .color = {cmd->color[0], cmd->color[1], cmd->color[2]},
+            .color2 = {cmd->color2[0], cmd->color2[1], cmd->color2[2]},
+            .period_ms = cmd->period_ms,
+        };
+        led_effects_start(cmd->effect, &params);
+        break;
+    }
+
+    case LED_CMD_STOP_EFFECT:
+        led_effects_stop(cmd->start, cmd->count);
+        break;
+
+    case LED_CMD_SCENE_SAVE:
+        led_scene_save(cmd->effect, cmd->start);
+        break;
+
+    case LED_CMD_SCENE_RECALL:
+        led_scene_recall(cmd->effect);
+        break;
+
+    default:
+        ESP_LOGW(TAG, "Unknown command %u", cmd->op);
+        break;
+    }
+}
+
+static uint32_t led_command_drain_queue(led_command_queue_t *queue)
+{
+    uint32_t current = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t end = atomic_load_explicit(&queue->head, memory_order_acquire);
+    uint32_t count = end - current;
+
+    led_command_observer_fn_t notify = observer;
+    for (; current != end; current++)
+    {
+        const led_command_t *cmd = &queue->ring[current & LED_COMMAND_QUEUE_MASK];
+        led_command_apply(cmd);
+#if CONFIG_WLED_LATENCY_TRACE
+        latency_frame_input(queue->received[current & LED_COMMAND_QUEUE_MASK]);
+#endif
+        if (notify != NULL)
+        {
+            notify(cmd);
+        }
+    }
+
+    atomic_store_explicit(&queue->tail, end, memory_order_release);
+    return count;
+}
+
+uint32_t led_command_drain(void)
+{
+    // Round robin: the source that goes first moves on every frame, so no client always loses
+    // when two of them change the same pixels
+    uint32_t count = 0;
+    for (int i = 0; i < LED_COMMAND_SOURCES; i++)
+    {
+        count += led_command_drain_queue(&queues[(first_source + i) % LED_COMMAND_SOURCES]);
+    }
+    first_source = (first_source + 1) % LED_COMMAND_SOURCES;
+
+    if (count > 0)
+    {
+        latency_record(LATENCY_QUEUE_DEPTH, count);
+    }
+
+    stats.applied += count;
+    return count;
+}
+
+void led_command_set_observer(led_command_observer_fn_t fn)
+{
+    observer = fn;
+}
+
+void led_command_get_stats(led_command_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
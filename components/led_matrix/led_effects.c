@@ -0,0 +1,414 @@
+#include "led_effects.h"
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "led_matrix.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+static const char *TAG = "led_effects";
+
+#define LED_EFFECT_SLOTS 4
+#define LED_EFFECT_FRAME_US (1000000 / CONFIG_WLED_EFFECT_FPS)
+
+// 128 + 127 * sin(2 * pi * i / 256)
+static const uint8_t sin8_table[256] = {
+    128, 131, 134, 137, 140, 144, 147, 150, 153, 156, 159, 162, 165, 168, 171, 174,
+    177, 179, 182, 185, 188, 191, 193, 196, 199, 201, 204, 206, 209, 211, 213, 216,
+    218, 220, 222, 224, 226, 228, 230, 232, 234, 235, 237, 239, 240, 241, 243, 244,
+    245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254, 254, 255, 255, 255,
+    255, 255, 255, 255, 254, 254, 254, 253, 253, 252, 251, 250, 250, 249, 248, 246,
+    245, 244, 243, 241, 240, 239, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220,
+    218, 216, 213, 211, 209, 206, 204, 201, 199, 196, 193, 191, 188, 185, 182, 179,
+    177, 174, 171, 168, 165, 162, 159, 156, 153, 150, 147, 144, 140, 137, 134, 131,
+    128, 125, 122, 119, 116, 112, 109, 106, 103, 100,  97,  94,  91,  88,  85,  82,
+     79,  77,  74,  71,  68,  65,  63,  60,  57,  55,  52,  50,  47,  45,  43,  40,
+     38,  36,  34,  32,  30,  28,  26,  24,  22,  21,  19,  17,  16,  15,  13,  12,
+     11,  10,   8,   7,   6,   6,   5,   4,   3,   3,   2,   2,   2,   1,   1,   1,
+      1,   1,   1,   1,   2,   2,   2,   3,   3,   4,   5,   6,   6,   7,   8,  10,
+     11,  12,  13,  15,  16,  17,  19,  21,  22,  24,  26,  28,  30,  32,  34,  36,
+     38,  40,  43,  45,  47,  50,  52,  55,  57,  60,  63,  65,  68,  71,  74,  77,
+     79,  82,  85,  88,  91,  94,  97, 100, 103, 106, 109, 112, 116, 119, 122, 125
+};
+
+// 255 * (i / 255) ^ 2.2
+static const uint8_t gamma8_table[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255
+};
+
+typedef struct
+{
+    bool active;
+    uint8_t id;
+    led_effect_state_t state;
+} led_effect_slot_t;
+
+static led_effect_t effects[LED_EFFECT_MAX];
+static led_effect_slot_t slots[LED_EFFECT_SLOTS];
+static led_effect_stats_t stats;
+static int64_t next_frame_us;
+static SemaphoreHandle_t effects_lock;
+
+uint8_t led_sin8(uint8_t theta)
+{
+    return sin8_table[theta];
+}
+
+uint8_t led_gamma8(uint8_t value)
+{
+    return gamma8_table[value];
+}
+
+uint8_t led_blend8(uint8_t from, uint8_t to, uint8_t amount)
+{
+    return (uint8_t)(from + (((int32_t)to - from) * amount + 127) / 255);
+}
+
+static inline uint8_t scale8(uint8_t value, uint8_t scale)
+{
+    return (uint8_t)(((uint16_t)value * (scale + 1)) >> 8);
+}
+
+static inline uint32_t xorshift32(uint32_t *seed)
+{
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static inline void put_pixel(uint8_t *rgb, uint32_t index, uint8_t red, uint8_t green, uint8_t blue)
+{
+    uint8_t *pixel = &rgb[index * 3];
+    pixel[0] = gamma8_table[red];
+    pixel[1] = gamma8_table[green];
+    pixel[2] = gamma8_table[blue];
+}
+
+static void fill_blend(const led_effect_params_t *params, uint8_t amount, uint8_t *rgb)
+{
+    uint8_t red = led_blend8(params->color[0], params->color2[0], amount);
+    uint8_t green = led_blend8(params->color[1], params->color2[1], amount);
+    uint8_t blue = led_blend8(params->color[2], params->color2[2], amount);
+    for (uint32_t i = 0; i < params->count; i++)
+    {
+        put_pixel(rgb, i, red, green, blue);
+    }
+}
+
+static bool effect_fade(led_effect_state_t *state, uint32_t elapsed_ms, uint8_t *rgb)
+{
+    const led_effect_params_t *params = &state->params;
+    bool running = elapsed_ms < params->period_ms;
+    uint8_t amount = running ? (uint8_t)(((uint64_t)elapsed_ms * 255) / params->period_ms) : 255;
+
+    // A fade is a transition between two strip colors, e.g. the pixel as it is shown right now and
+    // a color a client set, so it blends without gamma correction and ends exactly on `color2`
+    uint8_t red = led_blend8(params->color[0], params->color2[0], amount);
+    uint8_t green = led_blend8(params->color[1], params->color2[1], amount);
+    uint8_t blue = led_blend8(params->color[2], params->color2[2], amount);
+    for (uint32_t i = 0; i < params->count; i++)
+    {
+        uint8_t *pixel = &rgb[i * 3];
+        pixel[0] = red;
+        pixel[1] = green;
+        pixel[2] = blue;
+    }
+    return running;
+}
+
+static bool effect_flicker(led_effect_state_t *state, uint32_t elapsed_ms, uint8_t *rgb)
+{
+    const led_effect_params_t *params = &state->params;
+    uint32_t noise = xorshift32(&state->seed);
+
+    // About one frame in twelve drops to a dim, random level
+    uint8_t level = (noise & 0xFF) < 21 ? (uint8_t)((noise >> 8) & 0x3F) : 255;
+    uint8_t red = scale8(params->color[0], level);
+    uint8_t green = scale8(params->color[1], level);
+    uint8_t blue = scale8(params->color[2], level);
+    for (uint32_t i = 0; i < params->count; i++)
+    {
+        put_pixel(rgb, i, red, green, blue);
+    }
+    return true;
+}
+
+static bool effect_chase(led_effect_state_t *state, uint32_t elapsed_ms, uint8_t *rgb)
+{
+    const led_effect_params_t *params = &state->params;
+    uint32_t head = (uint32_t)(((uint64_t)(elapsed_ms % params->period_ms) * params->count) / params->period_ms);
+    for (uint32_t i = 0; i < params->count; i++)
+    {
+        const uint8_t *color = (i == head) ? params->color : params->color2;
+        put_pixel(rgb, i, color[0], color[1], color[2]);
+    }
+    return true;
+}
+
+static bool effect_candle(led_effect_state_t *state, uint32_t elapsed_ms, uint8_t *rgb)
+{
+    const led_effect_params_t *params = &state->params;
+    for (uint32_t i = 0; i < params->count; i++)
+    {
+        // Two incommensurate waves per pixel give a slow breathing, the noise adds the flutter
+        uint8_t slow = led_sin8((uint8_t)((elapsed_ms >> 3) + i * 37));
+        uint8_t fast = led_sin8((uint8_t)((elapsed_ms >> 1) + i * 91));
+        int32_t level = 160 + (slow >> 2) + (fast >> 3) - (int32_t)(xorshift32(&state->seed) & 0x1F);
+        level = level < 0 ? 0 : (level > 255 ? 255 : level);
+
+        put_pixel(rgb, i, scale8(params->color[0], level), scale8(params->color[1], level),
+                  scale8(params->color[2], level));
+    }
+    return true;
+}
+
+static bool effect_day_night(led_effect_state_t *state, uint32_t elapsed_ms, uint8_t *rgb)
+{
+    const led_effect_params_t *params = &state->params;
+    uint8_t phase = (uint8_t)(((uint64_t)(elapsed_ms % params->period_ms) * 256) / params->period_ms);
+
+    // Cosine shaped: full day at phase 0, full night half way through the period
+    fill_blend(params, 255 - led_sin8(phase + 64), rgb);
+    return true;
+}
+
+static const led_effect_t builtin_effects[LED_EFFECT_BUILTIN_COUNT] = {
+    [LED_EFFECT_FADE] = {"fade", effect_fade},
+    [LED_EFFECT_FLICKER] = {"flicker", effect_flicker},
+    [LED_EFFECT_CHASE] = {"chase", effect_chase},
+    [LED_EFFECT_CANDLE] = {"candle", effect_candle},
+    [LED_EFFECT_DAY_NIGHT] = {"day_night", effect_day_night},
+};
+
+static bool ranges_overlap(uint32_t start_a, uint32_t count_a, uint32_t start_b, uint32_t count_b)
+{
+    return start_a < start_b + count_b && start_b < start_a + count_a;
+}
+
+static void led_effects_init(void)
+{
+    if (effects_lock != NULL)
+    {
+        return;
+    }
+
+    effects_lock = xSemaphoreCreateMutex();
+    memcpy(effects, builtin_effects, sizeof(builtin_effects));
+}
+
+bool led_effects_register(uint8_t id, const led_effect_t *effect)
+{
+    if (id >= LED_EFFECT_MAX || effect == NULL || effect->render == NULL)
+    {
+        return false;
+    }
+
+    led_effects_init();
+    xSemaphoreTake(effects_lock, portMAX_DELAY);
+    effects[id] = *effect;
+    xSemaphoreGive(effects_lock);
+    return true;
+}
+
+bool led_effects_start(uint8_t id, const led_effect_params_t *params)
+{
+    uint32_t size = led_matrix_get_size();
+    if (id >= LED_EFFECT_MAX || params == NULL || params->start >= size || params->count == 0)
+    {
+        return false;
+    }
+
+    led_effects_init();
+    xSemaphoreTake(effects_lock, portMAX_DELAY);
+
+    if (effects[id].render == NULL)
+    {
+        xSemaphoreGive(effects_lock);
+        ESP_LOGW(TAG, "Effect %u is not registered", id);
+        return false;
+    }
+
+    led_effect_slot_t *free_slot = NULL;
+    for (int i = 0; i < LED_EFFECT_SLOTS; i++)
+    {
+        led_effect_slot_t *slot = &slots[i];
+        if (slot->active &&
+            ranges_overlap(slot->state.params.start, slot->state.params.count, params->start, params->count))
+        {
+            slot->active = false;
+        }
+        if (!slot->active && free_slot == NULL)
+        {
+            free_slot = slot;
+        }
+    }
+
+    if (free_slot != NULL)
+    {
+        free_slot->id = id;
+        free_slot->state.params = *params;
+        if (free_slot->state.params.count > size - params->start)
+        {
+            free_slot->state.params.count = size - params->start;
+        }
+        if (free_slot->state.params.period_ms == 0)
+        {
+            free_slot->state.params.period_ms = 1;
+        }
+        free_slot->state.started_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        free_slot->state.seed = esp_random() | 1;
+        free_slot->active = true;
+    }
+
+    xSemaphoreGive(effects_lock);
+
+    if (free_slot == NULL)
+    {
+        ESP_LOGW(TAG, "No free effect slot for %s", effects[id].name);
+        return false;
+    }
+
+    led_matrix_wake();
+    ESP_LOGI(TAG, "Started %s on %lu..%lu", effects[id].name, (unsigned long)params->start,
+             (unsigned long)(params->start + params->count - 1));
+    return true;
+}
+
+void led_effects_stop(uint32_t start, uint32_t count)
+{
+    if (effects_lock == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(effects_lock, portMAX_DELAY);
+    for (int i = 0; i < LED_EFFECT_SLOTS; i++)
+    {
+        if (slots[i].active && ranges_overlap(slots[i].state.params.start, slots[i].state.params.count, start, count))
+        {
+            slots[i].active = false;
+        }
+    }
+    xSemaphoreGive(effects_lock);
+}
+
+static void render_slot(uint8_t *rgb, uint32_t count, void *ctx)
+{
+    led_effect_slot_t *slot = ctx;
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    if (!effects[slot->id].render(&slot->state, now_ms - slot->state.started_ms, rgb))
+    {
+        slot->active = false;
+    }
+}
+
+uint32_t led_effects_schedule(void)
+{
+    if (effects_lock == NULL)
+    {
+        return UINT32_MAX;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(effects_lock, portMAX_DELAY);
+
+    bool active = false;
+    for (int i = 0; i < LED_EFFECT_SLOTS && !active; i++)
+    {
+        active = slots[i].active;
+    }
+    if (!active)
+    {
+        next_frame_us = 0;
+        xSemaphoreGive(effects_lock);
+        return UINT32_MAX;
+    }
+
+    if (next_frame_us != 0 && now < next_frame_us)
+    {
+        xSemaphoreGive(effects_lock);
+        return (uint32_t)((next_frame_us - now + 999) / 1000);
+    }
+
+    for (int i = 0; i < LED_EFFECT_SLOTS; i++)
+    {
+        if (slots[i].active)
+        {
+            led_matrix_draw(slots[i].state.params.start, slots[i].state.params.count, render_slot, &slots[i]);
+        }
+    }
+
+    xSemaphoreGive(effects_lock);
+
+    led_matrix_commit();
+
+    int64_t done = esp_timer_get_time();
+    uint32_t render_us = (uint32_t)(done - now);
+    stats.frames++;
+    stats.last_render_us = render_us;
+    if (render_us > stats.max_render_us)
+    {
+        stats.max_render_us = render_us;
+    }
+
+    // A frame that blew its budget does not get caught up in a burst, the missed slots are
+    // dropped so the LED task never hogs the core the BLE host shares with it
+    next_frame_us = (next_frame_us == 0 ? now : next_frame_us) + LED_EFFECT_FRAME_US;
+    if (next_frame_us <= done)
+    {
+        uint32_t behind = (uint32_t)((done - next_frame_us) / LED_EFFECT_FRAME_US) + 1;
+        stats.skipped_frames += behind;
+        next_frame_us += (int64_t)behind * LED_EFFECT_FRAME_US;
+    }
+
+    return (uint32_t)((next_frame_us - done + 999) / 1000);
+}
+
+uint32_t led_effects_get_active(uint8_t *ids, led_effect_params_t *params, uint32_t max)
+{
+    if (effects_lock == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t n = 0;
+    xSemaphoreTake(effects_lock, portMAX_DELAY);
+    for (int i = 0; i < LED_EFFECT_SLOTS && n < max; i++)
+    {
+        if (slots[i].active)
+        {
+            ids[n] = slots[i].id;
+            params[n] = slots[i].state.params;
+            n++;
+        }
+    }
+    xSemaphoreGive(effects_lock);
+    return n;
+}
+
+void led_effects_get_stats(led_effect_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
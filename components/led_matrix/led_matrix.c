@@ -1,22 +1,99 @@
 #include "led_matrix.h"
 
 #include "esp_log.h"
+#include "latency.h"
+#include "led_command.h"
+#include "led_effects.h"
+#include "led_scene.h"
+#include "led_stream.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "led_strip.h"
 #include "sdkconfig.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "led_matrix";
+
+#define LED_MATRIX_BYTES_PER_PIXEL 3
+
+typedef struct
+{
+    uint8_t gpio_pin;
+    uint32_t size;
+} led_segment_config_t;
+
+// Every segment is an independent strip on its own GPIO and RMT channel. Segments are chained
+// in this order into one logical index space.
+static const led_segment_config_t segment_configs[CONFIG_WLED_SEGMENT_COUNT] = {
+    {CONFIG_WLED_DIN_PIN, CONFIG_WLED_LED_COUNT},
+#if CONFIG_WLED_SEGMENT_COUNT >= 2
+    {CONFIG_WLED_SEGMENT2_DIN_PIN, CONFIG_WLED_SEGMENT2_LED_COUNT},
+#endif
+#if CONFIG_WLED_SEGMENT_COUNT >= 3
+    {CONFIG_WLED_SEGMENT3_DIN_PIN, CONFIG_WLED_SEGMENT3_LED_COUNT},
+#endif
+#if CONFIG_WLED_SEGMENT_COUNT >= 4
+    {CONFIG_WLED_SEGMENT4_DIN_PIN, CONFIG_WLED_SEGMENT4_LED_COUNT},
+#endif
+};
 
 typedef struct
 {
     led_strip_handle_t led_strip;
+    uint32_t start;
+    uint32_t size;
+    bool dirty;
+    bool in_flight;
+} led_segment_t;
+
+typedef struct
+{
+    led_segment_t segments[CONFIG_WLED_SEGMENT_COUNT];
     uint32_t size;
+
+    // Callers draw into the back buffer; led_matrix_commit() publishes the dirty part of it to the
+    // front buffer, which only the LED task reads when it refills the strip driver.
+    uint8_t *back;
+    uint8_t *front;
+
+    // Dirty ranges as [start, end) pixel indices, empty when start >= end
+    uint32_t back_dirty_start;
+    uint32_t back_dirty_end;
+    uint32_t front_dirty_start;
+    uint32_t front_dirty_end;
+
+    SemaphoreHandle_t lock;
+    TaskHandle_t task;
+    atomic_uint passes; ///< Iterations of the LED task loop, see led_matrix_sync()
 } led_matrix_t;
 
 led_matrix_t led_matrix;
 
-static void led_strip_init(uint8_t gpio_pin, uint32_t size)
+static void dirty_range_add(uint32_t *start, uint32_t *end, uint32_t from, uint32_t to)
 {
-    led_matrix.size = size;
+    if (*start >= *end)
+    {
+        *start = from;
+        *end = to;
+        return;
+    }
 
+    if (from < *start)
+    {
+        *start = from;
+    }
+    if (to > *end)
+    {
+        *end = to;
+    }
+}
+
+static void led_strip_init(led_segment_t *segment, uint8_t gpio_pin, uint32_t size, bool with_dma)
+{
     led_strip_config_t strip_config = {.strip_gpio_num = gpio_pin,
                                        .max_leds = size,
                                        .led_model = LED_MODEL_WS2812,
@@ -29,10 +106,46 @@ static void led_strip_init(uint8_t gpio_pin, uint32_t size)
                                          .resolution_hz = 0,
                                          .mem_block_symbols = 0,
                                          .flags = {
-                                             .with_dma = true,
+                                             .with_dma = with_dma,
                                          }};
 
-    ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_matrix.led_strip));
+    ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &segment->led_strip));
+}
+
+void led_matrix_setup(void)
+{
+    if (led_matrix.size != 0)
+    {
+        return;
+    }
+
+    uint32_t size = 0;
+    for (int i = 0; i < CONFIG_WLED_SEGMENT_COUNT; i++)
+    {
+        led_segment_t *segment = &led_matrix.segments[i];
+        segment->start = size;
+        segment->size = segment_configs[i].size;
+
+        // RMT chips have at most one DMA capable TX channel, it goes to the first (usually longest) segment
+        led_strip_init(segment, segment_configs[i].gpio_pin, segment->size, i == 0);
+        size += segment->size;
+
+        ESP_LOGI(TAG, "Segment %d: %lu LEDs on GPIO %u, index %lu..%lu", i, (unsigned long)segment->size,
+                 segment_configs[i].gpio_pin, (unsigned long)segment->start, (unsigned long)(size - 1));
+    }
+
+    led_matrix.back = calloc(size, LED_MATRIX_BYTES_PER_PIXEL);
+    led_matrix.front = calloc(size, LED_MATRIX_BYTES_PER_PIXEL);
+    led_matrix.lock = xSemaphoreCreateMutex();
+    if (led_matrix.back == NULL || led_matrix.front == NULL || led_matrix.lock == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate framebuffer for %lu LEDs", (unsigned long)size);
+        abort();
+    }
+    led_scene_init();
+
+    // Publishing the size last keeps early callers from touching buffers that do not exist yet
+    led_matrix.size = size;
 }
 
 uint32_t led_matrix_get_size()
@@ -42,24 +155,338 @@ uint32_t led_matrix_get_size()
 
 void led_matrix_set_pixel(uint32_t index, uint8_t red, uint8_t green, uint8_t blue)
 {
-    led_strip_set_pixel(led_matrix.led_strip, index, red, green, blue);
+    if (index >= led_matrix.size)
+    {
+        return;
+    }
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    uint8_t *pixel = &led_matrix.back[index * LED_MATRIX_BYTES_PER_PIXEL];
+    if (pixel[0] != red || pixel[1] != green || pixel[2] != blue)
+    {
+        pixel[0] = red;
+        pixel[1] = green;
+        pixel[2] = blue;
+        dirty_range_add(&led_matrix.back_dirty_start, &led_matrix.back_dirty_end, index, index + 1);
+    }
+    xSemaphoreGive(led_matrix.lock);
+}
+
+void led_matrix_get_pixel(uint32_t index, uint8_t rgb[3])
+{
+    if (index >= led_matrix.size)
+    {
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        return;
+    }
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    memcpy(rgb, &led_matrix.back[index * LED_MATRIX_BYTES_PER_PIXEL], LED_MATRIX_BYTES_PER_PIXEL);
+    xSemaphoreGive(led_matrix.lock);
+}
+
+static void fill_pixels(uint8_t *dst, uint32_t count, uint8_t red, uint8_t green, uint8_t blue)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    dst[0] = red;
+    dst[1] = green;
+    dst[2] = blue;
+
+    // Grow the filled region by doubling it, so a fill is a handful of memcpy calls instead of a pixel loop
+    size_t filled = LED_MATRIX_BYTES_PER_PIXEL;
+    size_t total = (size_t)count * LED_MATRIX_BYTES_PER_PIXEL;
+    while (filled < total)
+    {
+        size_t chunk = (filled < total - filled) ? filled : total - filled;
+        memcpy(dst + filled, dst, chunk);
+        filled += chunk;
+    }
+}
+
+void led_matrix_set_range(uint32_t start, uint32_t count, uint8_t red, uint8_t green, uint8_t blue)
+{
+    if (start >= led_matrix.size || count == 0)
+    {
+        return;
+    }
+    if (count > led_matrix.size - start)
+    {
+        count = led_matrix.size - start;
+    }
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    fill_pixels(&led_matrix.back[start * LED_MATRIX_BYTES_PER_PIXEL], count, red, green, blue);
+    dirty_range_add(&led_matrix.back_dirty_start, &led_matrix.back_dirty_end, start, start + count);
+    xSemaphoreGive(led_matrix.lock);
+}
+
+void led_matrix_fill(uint8_t red, uint8_t green, uint8_t blue)
+{
+    led_matrix_set_range(0, led_matrix.size, red, green, blue);
+}
+
+void led_matrix_blit(const uint8_t *rgb, size_t n)
+{
+    if (rgb == NULL || n == 0 || led_matrix.size == 0)
+    {
+        return;
+    }
+    if (n > led_matrix.size)
+    {
+        n = led_matrix.size;
+    }
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    memcpy(led_matrix.back, rgb, n * LED_MATRIX_BYTES_PER_PIXEL);
+    dirty_range_add(&led_matrix.back_dirty_start, &led_matrix.back_dirty_end, 0, n);
+    xSemaphoreGive(led_matrix.lock);
+}
+
+void led_matrix_read(uint8_t *rgb, size_t n)
+{
+    if (rgb == NULL || n == 0 || led_matrix.size == 0)
+    {
+        return;
+    }
+    if (n > led_matrix.size)
+    {
+        n = led_matrix.size;
+    }
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    memcpy(rgb, led_matrix.back, n * LED_MATRIX_BYTES_PER_PIXEL);
+    xSemaphoreGive(led_matrix.lock);
+}
+
+void led_matrix_draw(uint32_t start, uint32_t count, led_matrix_draw_fn_t draw, void *ctx)
+{
+    if (start >= led_matrix.size || count == 0 || draw == NULL)
+    {
+        return;
+    }
+    if (count > led_matrix.size - start)
+    {
+        count = led_matrix.size - start;
+    }
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    draw(&led_matrix.back[start * LED_MATRIX_BYTES_PER_PIXEL], count, ctx);
+    dirty_range_add(&led_matrix.back_dirty_start, &led_matrix.back_dirty_end, start, start + count);
+    xSemaphoreGive(led_matrix.lock);
+}
+
+void led_matrix_commit(void)
+{
+    if (led_matrix.size == 0)
+    {
+        return;
+    }
+
+    bool changed = false;
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    uint32_t start = led_matrix.back_dirty_start;
+    uint32_t end = led_matrix.back_dirty_end;
+    if (start < end)
+    {
+        memcpy(&led_matrix.front[start * LED_MATRIX_BYTES_PER_PIXEL],
+               &led_matrix.back[start * LED_MATRIX_BYTES_PER_PIXEL], (end - start) * LED_MATRIX_BYTES_PER_PIXEL);
+        dirty_range_add(&led_matrix.front_dirty_start, &led_matrix.front_dirty_end, start, end);
+        led_matrix.back_dirty_start = 0;
+        led_matrix.back_dirty_end = 0;
+        changed = true;
+    }
+    xSemaphoreGive(led_matrix.lock);
+
+    if (changed)
+    {
+        led_matrix_wake();
+    }
+}
+
+void led_matrix_wake(void)
+{
+    if (led_matrix.task != NULL)
+    {
+        xTaskNotifyGive(led_matrix.task);
+    }
+}
+
+void led_matrix_sync(void)
+{
+    while (led_matrix.task == NULL)
+    {
+        vTaskDelay(1);
+    }
+
+    // The pass running right now may have missed what the caller queued, the one after it cannot.
+    // Waking on every poll keeps an idle task from sleeping through the second pass.
+    unsigned int target = atomic_load(&led_matrix.passes) + 2;
+    while ((int)(atomic_load(&led_matrix.passes) - target) < 0)
+    {
+        led_matrix_wake();
+        vTaskDelay(1);
+    }
+}
+
+/// Copies the committed pixels into the strip drivers and marks the touched segments dirty.
+/// Returns false if there is nothing new to send.
+static bool led_matrix_present(void)
+{
+    bool changed = false;
+
+    xSemaphoreTake(led_matrix.lock, portMAX_DELAY);
+    uint32_t start = led_matrix.front_dirty_start;
+    uint32_t end = led_matrix.front_dirty_end;
+    if (start < end)
+    {
+        for (int s = 0; s < CONFIG_WLED_SEGMENT_COUNT; s++)
+        {
+            led_segment_t *segment = &led_matrix.segments[s];
+            uint32_t from = start > segment->start ? start : segment->start;
+            uint32_t to = end < segment->start + segment->size ? end : segment->start + segment->size;
+            if (from >= to)
+            {
+                continue;
+            }
+
+            for (uint32_t i = from; i < to; i++)
+            {
+                const uint8_t *pixel = &led_matrix.front[i * LED_MATRIX_BYTES_PER_PIXEL];
+                led_strip_set_pixel(segment->led_strip, i - segment->start, pixel[0], pixel[1], pixel[2]);
+            }
+            segment->dirty = true;
+        }
+        led_matrix.front_dirty_start = 0;
+        led_matrix.front_dirty_end = 0;
+        changed = true;
+    }
+    xSemaphoreGive(led_matrix.lock);
+
+    return changed;
+}
+
+/// Waits until every segment still transmitting has its frame on the wire.
+static void led_segments_wait_done(void)
+{
+    for (int i = 0; i < CONFIG_WLED_SEGMENT_COUNT; i++)
+    {
+        led_segment_t *segment = &led_matrix.segments[i];
+        if (segment->in_flight)
+        {
+            led_strip_refresh_wait_done(segment->led_strip);
+            segment->in_flight = false;
+        }
+    }
+}
+
+/// Starts the transmit on every dirty segment. The RMT channels run in parallel, so a frame
+/// takes as long as the longest changed segment instead of the sum of all of them.
+static void led_segments_refresh_async(void)
+{
+    for (int i = 0; i < CONFIG_WLED_SEGMENT_COUNT; i++)
+    {
+        led_segment_t *segment = &led_matrix.segments[i];
+        if (!segment->dirty)
+        {
+            continue;
+        }
+
+        segment->dirty = false;
+        if (led_strip_refresh_async(segment->led_strip) == ESP_OK)
+        {
+            segment->in_flight = true;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Failed to start refresh of segment %d", i);
+        }
+    }
+}
+
+bool led_matrix_flush(void)
+{
+    // The RMT encoder reads the driver buffer while the transfer runs, so the previous
+    // frame has to be on the wire completely before the next one is copied in. Commits made
+    // in the meantime only touch the back/front buffers and are merged into this frame.
+    led_segments_wait_done();
+
+    if (!led_matrix_present())
+    {
+        return false;
+    }
+
+    // Start the transmit and go straight back to waiting, callers keep rendering
+    // into the back buffer while the frame goes out
+    led_segments_refresh_async();
+    return true;
+}
+
+/// Logs the free stack whenever it reaches a new low. Applying commands may journal them, save
+/// scenes to NVS or decode a recalled one, which is where the LED task needs most of its stack.
+static void led_matrix_check_stack(void)
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    static UBaseType_t stack_low = UINT32_MAX;
+    UBaseType_t free_bytes = uxTaskGetStackHighWaterMark(NULL);
+    if (free_bytes < stack_low)
+    {
+        stack_low = free_bytes;
+        ESP_LOGI(TAG, "Stack high-water mark: %u bytes free", (unsigned)free_bytes);
+    }
+#endif
 }
 
 void led_matrix_init(void *args)
 {
     ESP_LOGI(pcTaskGetName(NULL), "Calling led_matrix_init()");
 
-    led_strip_init(CONFIG_WLED_DIN_PIN, CONFIG_WLED_LED_COUNT);
-    int value = 0;
-    for (int i = 0; i < led_matrix.size; i++)
+    led_matrix.task = xTaskGetCurrentTaskHandle();
+    led_matrix_setup();
+
+    // The driver buffers start cleared, so push the initial (black) frame once
+    for (int i = 0; i < CONFIG_WLED_SEGMENT_COUNT; i++)
     {
-        led_matrix_set_pixel(i, 0, value, 0);
+        led_matrix.segments[i].dirty = true;
     }
+    led_segments_refresh_async();
 
     while (true)
     {
-        led_strip_refresh(led_matrix.led_strip);
-        vTaskDelay(pdMS_TO_TICKS(100));
+        // Sleep until a frame is committed or the next effect frame is due; an idle town causes
+        // no RMT traffic at all
+        uint32_t wait_ms = led_effects_schedule();
+        TickType_t wait = portMAX_DELAY;
+        if (wait_ms != UINT32_MAX)
+        {
+            wait = pdMS_TO_TICKS(wait_ms);
+            wait = wait > 0 ? wait : 1;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+        latency_frame_begin();
+
+        // Everything clients queued since the last frame is applied in one go and shown as one frame,
+        // together with the latest streamed frame
+        bool streamed = led_stream_apply();
+        uint32_t applied = led_command_drain();
+        if (applied > 0 || streamed)
+        {
+            led_matrix_commit();
+        }
+        if (applied > 0)
+        {
+            led_matrix_check_stack();
+        }
+
+        if (led_matrix_flush())
+        {
+            latency_frame_transmit();
+        }
+        atomic_fetch_add(&led_matrix.passes, 1);
     }
 
     ESP_LOGI(pcTaskGetName(NULL), "Exiting led_matrix_init()");
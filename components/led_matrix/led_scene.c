@@ -0,0 +1,329 @@
+#include "led_scene.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "led_command.h"
+#include "led_effects.h"
+#include "led_matrix.h"
+#include "persistence.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "led_scene";
+
+#define LED_SCENE_VERSION 1
+#define LED_SCENE_INDEX_KEY "scenes"
+#define LED_SCENE_RUN_BYTES 4 // run length u8, color[3]
+
+/// Header of a scene blob, followed by `effect_count` led_command_t records and the RLE runs
+typedef struct __attribute__((packed))
+{
+    uint8_t version;
+    uint8_t effect_count;
+    uint16_t pixel_count;
+} led_scene_header_t;
+
+/// Names of all scenes, stored under LED_SCENE_INDEX_KEY. An empty name marks an unused id.
+typedef struct
+{
+    char names[LED_SCENE_MAX][LED_SCENE_NAME_LEN];
+} led_scene_index_t;
+
+static led_scene_index_t index_cache;
+static bool index_loaded;
+static SemaphoreHandle_t index_lock;
+
+/// Names travelling with queued saves, one slot per LED_CMD_SCENE_SAVE. An empty name marks a free slot.
+static char staged_names[LED_SCENE_STAGED_NAMES][LED_SCENE_NAME_LEN];
+
+static void scene_key(uint8_t id, char key[8])
+{
+    snprintf(key, 8, "scene%u", id);
+}
+
+/// Loads the index on first use. Called with index_lock held.
+static void scene_index_load(void)
+{
+    if (index_loaded)
+    {
+        return;
+    }
+    size_t len = sizeof(index_cache);
+    if (persistence_load_value(VALUE_TYPE_BLOB, LED_SCENE_INDEX_KEY, &index_cache, &len) != ESP_OK ||
+        len != sizeof(index_cache))
+    {
+        memset(&index_cache, 0, sizeof(index_cache));
+    }
+    index_loaded = true;
+}
+
+void led_scene_init(void)
+{
+    if (index_lock != NULL)
+    {
+        return;
+    }
+
+    index_lock = xSemaphoreCreateMutex();
+    if (index_lock == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create scene index mutex");
+        abort();
+    }
+}
+
+static void scene_index_lock(void)
+{
+    xSemaphoreTake(index_lock, portMAX_DELAY);
+    scene_index_load();
+}
+
+uint16_t led_scene_stage_name(const char *name)
+{
+    if (name == NULL || name[0] == '\0')
+    {
+        return 0;
+    }
+
+    uint16_t slot = 0;
+    scene_index_lock();
+    for (uint16_t i = 0; i < LED_SCENE_STAGED_NAMES && slot == 0; i++)
+    {
+        if (staged_names[i][0] == '\0')
+        {
+            snprintf(staged_names[i], LED_SCENE_NAME_LEN, "%s", name);
+            slot = i + 1;
+        }
+    }
+    xSemaphoreGive(index_lock);
+
+    if (slot == 0)
+    {
+        ESP_LOGW(TAG, "No free slot for the scene name %s, saving without it", name);
+    }
+    return slot;
+}
+
+/// Size of the RLE encoding of `count` pixels.
+static size_t rle_size(const uint8_t *rgb, uint32_t count)
+{
+    size_t size = 0;
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t run = 1;
+        while (i + run < count && run < UINT8_MAX && memcmp(&rgb[i * 3], &rgb[(i + run) * 3], 3) == 0)
+        {
+            run++;
+        }
+        size += LED_SCENE_RUN_BYTES;
+        i += run;
+    }
+    return size;
+}
+
+static void rle_encode(const uint8_t *rgb, uint32_t count, uint8_t *out)
+{
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t run = 1;
+        while (i + run < count && run < UINT8_MAX && memcmp(&rgb[i * 3], &rgb[(i + run) * 3], 3) == 0)
+        {
+            run++;
+        }
+        out[0] = run;
+        memcpy(&out[1], &rgb[i * 3], 3);
+        out += LED_SCENE_RUN_BYTES;
+        i += run;
+    }
+}
+
+esp_err_t led_scene_save(uint8_t id, uint16_t name_slot)
+{
+    // The staged name belongs to this save alone, its slot is freed whether the save succeeds or not
+    char name[LED_SCENE_NAME_LEN] = "";
+    if (name_slot > 0 && name_slot <= LED_SCENE_STAGED_NAMES)
+    {
+        scene_index_lock();
+        memcpy(name, staged_names[name_slot - 1], LED_SCENE_NAME_LEN);
+        staged_names[name_slot - 1][0] = '\0';
+        xSemaphoreGive(index_lock);
+    }
+
+    if (id >= LED_SCENE_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t size = led_matrix_get_size();
+    uint8_t *frame = malloc(size * 3);
+    if (frame == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    led_matrix_read(frame, size);
+
+    uint8_t ids[LED_EFFECT_MAX];
+    led_effect_params_t params[LED_EFFECT_MAX];
+    uint32_t effect_count = led_effects_get_active(ids, params, LED_EFFECT_MAX);
+
+    size_t effects_len = effect_count * sizeof(led_command_t);
+    size_t len = sizeof(led_scene_header_t) + effects_len + rle_size(frame, size);
+    uint8_t *blob = malloc(len);
+    if (blob == NULL)
+    {
+        free(frame);
+        return ESP_ERR_NO_MEM;
+    }
+
+    led_scene_header_t header = {
+        .version = LED_SCENE_VERSION,
+        .effect_count = effect_count,
+        .pixel_count = size,
+    };
+    memcpy(blob, &header, sizeof(header));
+    for (uint32_t i = 0; i < effect_count; i++)
+    {
+        led_command_t cmd = {
+            .op = LED_CMD_EFFECT,
+            .effect = ids[i],
+            .period_ms = params[i].period_ms,
+            .start = params[i].start,
+            .count = params[i].count,
+            .color = {params[i].color[0], params[i].color[1], params[i].color[2]},
+            .color2 = {params[i].color2[0], params[i].color2[1], params[i].color2[2]},
+        };
+        memcpy(&blob[sizeof(header) + i * sizeof(cmd)], &cmd, sizeof(cmd));
+    }
+    rle_encode(frame, size, &blob[sizeof(header) + effects_len]);
+    free(frame);
+
+    char key[8];
+    scene_key(id, key);
+    esp_err_t ret = persistence_save_blob(key, blob, len);
+    free(blob);
+
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    // Make sure the scene shows up in the list, even if it was never named
+    scene_index_lock();
+    if (name[0] != '\0')
+    {
+        memcpy(index_cache.names[id], name, LED_SCENE_NAME_LEN);
+    }
+    else if (index_cache.names[id][0] == '\0')
+    {
+        snprintf(index_cache.names[id], LED_SCENE_NAME_LEN, "Scene %u", id);
+    }
+    ret = persistence_save_blob(LED_SCENE_INDEX_KEY, &index_cache, sizeof(index_cache));
+    xSemaphoreGive(index_lock);
+
+    ESP_LOGI(TAG, "Saved scene %u (%zu bytes, %lu effects)", id, len, (unsigned long)effect_count);
+    return ret;
+}
+
+typedef struct
+{
+    const uint8_t *runs;
+    size_t runs_len;
+} led_scene_decode_t;
+
+/// Expands the RLE runs straight into the back buffer, pixels not covered by the scene turn black.
+static void scene_decode(uint8_t *rgb, uint32_t count, void *ctx)
+{
+    const led_scene_decode_t *decode = ctx;
+    uint32_t pixel = 0;
+    for (size_t pos = 0; pos + LED_SCENE_RUN_BYTES <= decode->runs_len && pixel < count; pos += LED_SCENE_RUN_BYTES)
+    {
+        const uint8_t *run = &decode->runs[pos];
+        for (uint32_t i = 0; i < run[0] && pixel < count; i++, pixel++)
+        {
+            memcpy(&rgb[pixel * 3], &run[1], 3);
+        }
+    }
+    memset(&rgb[pixel * 3], 0, (count - pixel) * 3);
+}
+
+esp_err_t led_scene_recall(uint8_t id)
+{
+    if (id >= LED_SCENE_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char key[8];
+    scene_key(id, key);
+    size_t len = 0;
+    esp_err_t ret = persistence_load_value(VALUE_TYPE_BLOB, key, NULL, &len);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Scene %u not found", id);
+        return ret;
+    }
+
+    uint8_t *blob = malloc(len);
+    if (blob == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    ret = persistence_load_value(VALUE_TYPE_BLOB, key, blob, &len);
+
+    led_scene_header_t header;
+    if (ret == ESP_OK && len >= sizeof(header))
+    {
+        memcpy(&header, blob, sizeof(header));
+    }
+    size_t effects_len = ret == ESP_OK && len >= sizeof(header) ? header.effect_count * sizeof(led_command_t) : 0;
+    if (ret != ESP_OK || len < sizeof(header) || header.version != LED_SCENE_VERSION ||
+        len < sizeof(header) + effects_len)
+    {
+        ESP_LOGE(TAG, "Scene %u is corrupt", id);
+        free(blob);
+        return ret != ESP_OK ? ret : ESP_ERR_INVALID_CRC;
+    }
+
+    uint32_t size = led_matrix_get_size();
+    led_effects_stop(0, size);
+    led_scene_decode_t decode = {
+        .runs = &blob[sizeof(header) + effects_len],
+        .runs_len = len - sizeof(header) - effects_len,
+    };
+    led_matrix_draw(0, size, scene_decode, &decode);
+
+    for (uint32_t i = 0; i < header.effect_count; i++)
+    {
+        led_command_t cmd;
+        memcpy(&cmd, &blob[sizeof(header) + i * sizeof(cmd)], sizeof(cmd));
+        led_command_apply(&cmd);
+    }
+    free(blob);
+
+    ESP_LOGI(TAG, "Recalled scene %u", id);
+    return ESP_OK;
+}
+
+uint32_t led_scene_list(led_scene_info_t *out, uint32_t max)
+{
+    uint32_t count = 0;
+    scene_index_lock();
+    for (uint8_t id = 0; id < LED_SCENE_MAX; id++)
+    {
+        if (index_cache.names[id][0] == '\0')
+        {
+            continue;
+        }
+        if (count < max)
+        {
+            out[count].id = id;
+            memcpy(out[count].name, index_cache.names[id], LED_SCENE_NAME_LEN);
+        }
+        count++;
+    }
+    xSemaphoreGive(index_lock);
+    return count;
+}
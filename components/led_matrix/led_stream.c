@@ -0,0 +1,311 @@
+#include "led_stream.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "latency.h"
+#include "led_command.h"
+#include "led_matrix.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "led_stream";
+
+#define LED_STREAM_BYTES_PER_PIXEL 3
+#define LED_STREAM_MASK_BITS 32
+
+typedef struct
+{
+    uint32_t size;
+
+    // Producer side, only touched by the BLE host task. The frame buffer equals the shadow except for
+    // the pixels written since the frame began, which are marked in the written mask.
+    uint8_t *shadow;
+    uint8_t *frame;
+    uint32_t *written;
+    bool assembling;
+    uint8_t source;
+    bool has_sequence[LED_COMMAND_SOURCES];
+    uint16_t last_sequence[LED_COMMAND_SOURCES];
+    uint32_t dirty_start;
+    uint32_t dirty_end;
+
+    // Handed over under the lock, only the pixels marked in the pending mask are applied
+    uint8_t *ready;
+    uint32_t *pending;
+    uint32_t ready_start;
+    uint32_t ready_end;
+#if CONFIG_WLED_LATENCY_TRACE
+    uint32_t ready_received;
+#endif
+    SemaphoreHandle_t lock;
+
+    led_stream_stats_t stats;
+} led_stream_t;
+
+static led_stream_t stream;
+
+static void mask_set(uint32_t *mask, uint32_t start, uint32_t end)
+{
+    for (uint32_t i = start; i < end; i++)
+    {
+        mask[i / LED_STREAM_MASK_BITS] |= 1u << (i % LED_STREAM_MASK_BITS);
+    }
+}
+
+static bool mask_test(const uint32_t *mask, uint32_t i)
+{
+    return mask[i / LED_STREAM_MASK_BITS] & (1u << (i % LED_STREAM_MASK_BITS));
+}
+
+/// Finds the next run of marked pixels in [*start, end), clears it and returns false if there is none.
+static bool mask_take_run(uint32_t *mask, uint32_t *start, uint32_t end, uint32_t *run_end)
+{
+    uint32_t i = *start;
+    while (i < end && !mask_test(mask, i))
+    {
+        i = mask[i / LED_STREAM_MASK_BITS] == 0 ? (i / LED_STREAM_MASK_BITS + 1) * LED_STREAM_MASK_BITS : i + 1;
+    }
+    if (i >= end)
+    {
+        return false;
+    }
+
+    *start = i;
+    while (i < end && mask_test(mask, i))
+    {
+        mask[i / LED_STREAM_MASK_BITS] &= ~(1u << (i % LED_STREAM_MASK_BITS));
+        i++;
+    }
+    *run_end = i;
+    return true;
+}
+
+static void copy_pixels(uint8_t *to, const uint8_t *from, uint32_t start, uint32_t end)
+{
+    memcpy(&to[start * LED_STREAM_BYTES_PER_PIXEL], &from[start * LED_STREAM_BYTES_PER_PIXEL],
+           (end - start) * LED_STREAM_BYTES_PER_PIXEL);
+}
+
+/// Allocates the buffers on first use, once the matrix size is known.
+static bool led_stream_init(void)
+{
+    if (stream.size != 0)
+    {
+        return true;
+    }
+
+    uint32_t size = led_matrix_get_size();
+    if (size == 0)
+    {
+        return false;
+    }
+
+    uint32_t mask_words = (size + LED_STREAM_MASK_BITS - 1) / LED_STREAM_MASK_BITS;
+    stream.shadow = calloc(size, LED_STREAM_BYTES_PER_PIXEL);
+    stream.frame = calloc(size, LED_STREAM_BYTES_PER_PIXEL);
+    stream.written = calloc(mask_words, sizeof(uint32_t));
+    stream.ready = calloc(size, LED_STREAM_BYTES_PER_PIXEL);
+    stream.pending = calloc(mask_words, sizeof(uint32_t));
+    stream.lock = xSemaphoreCreateMutex();
+    if (stream.shadow == NULL || stream.frame == NULL || stream.written == NULL || stream.ready == NULL ||
+        stream.pending == NULL || stream.lock == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate stream buffers for %lu LEDs", (unsigned long)size);
+        free(stream.shadow);
+        free(stream.frame);
+        free(stream.written);
+        free(stream.ready);
+        free(stream.pending);
+        if (stream.lock != NULL)
+        {
+            vSemaphoreDelete(stream.lock);
+        }
+        memset(&stream, 0, sizeof(stream));
+        return false;
+    }
+
+    // Delta frames sent before the first full frame update what is shown
+    led_matrix_read(stream.shadow, size);
+    memcpy(stream.frame, stream.shadow, size * LED_STREAM_BYTES_PER_PIXEL);
+    stream.size = size;
+    return true;
+}
+
+bool led_stream_begin(uint8_t source, uint16_t sequence)
+{
+    if (!led_stream_init())
+    {
+        return false;
+    }
+
+    led_stream_abort();
+
+    // Every controller counts on its own, a sequence number only orders frames of the same source
+    source %= LED_COMMAND_SOURCES;
+    if (stream.has_sequence[source] && (int16_t)(sequence - stream.last_sequence[source]) <= 0)
+    {
+        stream.stats.late++;
+        return false;
+    }
+
+    stream.assembling = true;
+    stream.source = source;
+    stream.last_sequence[source] = sequence;
+    stream.has_sequence[source] = true;
+    stream.dirty_start = 0;
+    stream.dirty_end = 0;
+    return true;
+}
+
+uint8_t *led_stream_span(uint32_t start, uint32_t count)
+{
+    if (!stream.assembling || start >= stream.size || count > stream.size - start)
+    {
+        return NULL;
+    }
+
+    if (stream.dirty_start == stream.dirty_end)
+    {
+        stream.dirty_start = start;
+        stream.dirty_end = start + count;
+    }
+    else
+    {
+        stream.dirty_start = start < stream.dirty_start ? start : stream.dirty_start;
+        stream.dirty_end = start + count > stream.dirty_end ? start + count : stream.dirty_end;
+    }
+    mask_set(stream.written, start, start + count);
+    return &stream.frame[start * LED_STREAM_BYTES_PER_PIXEL];
+}
+
+bool led_stream_write(uint32_t start, const uint8_t *rgb, uint32_t count)
+{
+    uint8_t *span = led_stream_span(start, count);
+    if (span == NULL)
+    {
+        return false;
+    }
+    memcpy(span, rgb, count * LED_STREAM_BYTES_PER_PIXEL);
+    return true;
+}
+
+void led_stream_submit(void)
+{
+    if (!stream.assembling)
+    {
+        return;
+    }
+    stream.assembling = false;
+    stream.stats.received++;
+
+    uint32_t start = stream.dirty_start;
+    uint32_t end = stream.dirty_end;
+    if (start == end)
+    {
+        return;
+    }
+
+    xSemaphoreTake(stream.lock, portMAX_DELAY);
+    if (stream.ready_start != stream.ready_end)
+    {
+        // The previous frame was not shown yet, this one is merged into it
+        stream.stats.late++;
+        stream.ready_start = start < stream.ready_start ? start : stream.ready_start;
+        stream.ready_end = end > stream.ready_end ? end : stream.ready_end;
+    }
+    else
+    {
+        stream.ready_start = start;
+        stream.ready_end = end;
+    }
+
+    // Only the pixels this frame wrote are handed over, the gaps between its fragments keep what the
+    // matrix shows
+    uint32_t run_end;
+    while (mask_take_run(stream.written, &start, end, &run_end))
+    {
+        copy_pixels(stream.shadow, stream.frame, start, run_end);
+        copy_pixels(stream.ready, stream.frame, start, run_end);
+        mask_set(stream.pending, start, run_end);
+        start = run_end;
+    }
+#if CONFIG_WLED_LATENCY_TRACE
+    stream.ready_received = latency_now();
+#endif
+    xSemaphoreGive(stream.lock);
+
+    led_matrix_wake();
+}
+
+void led_stream_abort(void)
+{
+    if (!stream.assembling)
+    {
+        return;
+    }
+    stream.assembling = false;
+    stream.stats.dropped++;
+
+    // Roll the written pixels back, so the next delta frame builds on the last complete one
+    uint32_t start = stream.dirty_start;
+    uint32_t run_end;
+    while (mask_take_run(stream.written, &start, stream.dirty_end, &run_end))
+    {
+        copy_pixels(stream.frame, stream.shadow, start, run_end);
+        start = run_end;
+    }
+}
+
+void led_stream_reset(uint8_t source)
+{
+    source %= LED_COMMAND_SOURCES;
+    if (stream.assembling && stream.source == source)
+    {
+        led_stream_abort();
+    }
+
+    // The next frame of this source starts a new session, whatever sequence number it carries
+    stream.has_sequence[source] = false;
+}
+
+static void copy_ready(uint8_t *rgb, uint32_t count, void *ctx)
+{
+    uint32_t start = *(const uint32_t *)ctx;
+    memcpy(rgb, &stream.ready[start * LED_STREAM_BYTES_PER_PIXEL], count * LED_STREAM_BYTES_PER_PIXEL);
+}
+
+bool led_stream_apply(void)
+{
+    if (stream.lock == NULL)
+    {
+        return false;
+    }
+
+    bool applied = false;
+    xSemaphoreTake(stream.lock, portMAX_DELAY);
+    if (stream.ready_start != stream.ready_end)
+    {
+        uint32_t start = stream.ready_start;
+        uint32_t run_end;
+        while (mask_take_run(stream.pending, &start, stream.ready_end, &run_end))
+        {
+            led_matrix_draw(start, run_end - start, copy_ready, &start);
+            start = run_end;
+        }
+        stream.ready_start = 0;
+        stream.ready_end = 0;
+        stream.stats.applied++;
+        applied = true;
+#if CONFIG_WLED_LATENCY_TRACE
+        latency_frame_input(stream.ready_received);
+#endif
+    }
+    xSemaphoreGive(stream.lock);
+    return applied;
+}
+
+void led_stream_get_stats(led_stream_stats_t *stats)
+{
+    *stats = stream.stats;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Simulated led_strip driver for the linux target
+///
+/// Mirrors the part of the espressif/led_strip 3.x API the firmware uses. Each transmitted frame is
+/// appended as one line "<gpio> <count> <RRGGBB...>" to the file named by the environment variable
+/// LED_STRIP_SIM_OUTPUT (default frames.log), shared by all strips. The lines only depend on what
+/// was sent, so two runs can be diffed; setting LED_STRIP_SIM_TIMESTAMPS prefixes each line with the
+/// transmit time in microseconds.
+
+typedef struct led_strip_t *led_strip_handle_t;
+
+typedef enum
+{
+    LED_MODEL_WS2812,
+    LED_MODEL_SK6812,
+    LED_MODEL_WS2811,
+} led_model_t;
+
+typedef union
+{
+    struct
+    {
+        uint32_t r_pos : 2;
+        uint32_t g_pos : 2;
+        uint32_t b_pos : 2;
+        uint32_t w_pos : 2;
+        uint32_t reserved : 21;
+        uint32_t num_components : 3;
+    } format;
+    uint32_t format_id;
+} led_color_component_format_t;
+
+#define LED_STRIP_COLOR_COMPONENT_FMT_GRB                                                                              \
+    (led_color_component_format_t){.format = {.r_pos = 1, .g_pos = 0, .b_pos = 2, .w_pos = 3, .num_components = 3}}
+#define LED_STRIP_COLOR_COMPONENT_FMT_RGB                                                                              \
+    (led_color_component_format_t){.format = {.r_pos = 0, .g_pos = 1, .b_pos = 2, .w_pos = 3, .num_components = 3}}
+
+typedef struct
+{
+    int strip_gpio_num;
+    uint32_t max_leds;
+    led_model_t led_model;
+    led_color_component_format_t color_component_format;
+    struct
+    {
+        uint32_t invert_out : 1;
+    } flags;
+} led_strip_config_t;
+
+typedef int rmt_clock_source_t;
+#define RMT_CLK_SRC_DEFAULT 0
+
+typedef struct
+{
+    rmt_clock_source_t clk_src;
+    uint32_t resolution_hz;
+    size_t mem_block_symbols;
+    struct
+    {
+        uint32_t with_dma : 1;
+    } flags;
+} led_strip_rmt_config_t;
+
+esp_err_t led_strip_new_rmt_device(const led_strip_config_t *led_config, const led_strip_rmt_config_t *rmt_config,
+                                   led_strip_handle_t *ret_strip);
+esp_err_t led_strip_set_pixel(led_strip_handle_t strip, uint32_t index, uint32_t red, uint32_t green, uint32_t blue);
+esp_err_t led_strip_refresh(led_strip_handle_t strip);
+esp_err_t led_strip_refresh_async(led_strip_handle_t strip);
+esp_err_t led_strip_refresh_wait_done(led_strip_handle_t strip);
+esp_err_t led_strip_clear(led_strip_handle_t strip);
+esp_err_t led_strip_del(led_strip_handle_t strip);
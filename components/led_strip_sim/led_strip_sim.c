@@ -0,0 +1,148 @@
+#include "led_strip.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "led_strip_sim";
+
+#define LED_STRIP_SIM_DEFAULT_OUTPUT "frames.log"
+
+struct led_strip_t
+{
+    int gpio;
+    uint32_t size;
+    uint8_t *pixels; // RGB
+    bool busy;
+};
+
+static FILE *s_output;
+static bool s_timestamps;
+
+static FILE *led_strip_sim_output(void)
+{
+    if (s_output == NULL)
+    {
+        const char *path = getenv("LED_STRIP_SIM_OUTPUT");
+        if (path == NULL)
+        {
+            path = LED_STRIP_SIM_DEFAULT_OUTPUT;
+        }
+        s_timestamps = getenv("LED_STRIP_SIM_TIMESTAMPS") != NULL;
+        s_output = fopen(path, "w");
+        if (s_output == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to open %s, frames are dropped", path);
+        }
+    }
+    return s_output;
+}
+
+esp_err_t led_strip_new_rmt_device(const led_strip_config_t *led_config, const led_strip_rmt_config_t *rmt_config,
+                                   led_strip_handle_t *ret_strip)
+{
+    if (led_config == NULL || rmt_config == NULL || ret_strip == NULL || led_config->max_leds == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    led_strip_handle_t strip = calloc(1, sizeof(*strip));
+    uint8_t *pixels = calloc(led_config->max_leds, 3);
+    if (strip == NULL || pixels == NULL)
+    {
+        free(strip);
+        free(pixels);
+        return ESP_ERR_NO_MEM;
+    }
+    strip->gpio = led_config->strip_gpio_num;
+    strip->size = led_config->max_leds;
+    strip->pixels = pixels;
+    *ret_strip = strip;
+    return ESP_OK;
+}
+
+esp_err_t led_strip_set_pixel(led_strip_handle_t strip, uint32_t index, uint32_t red, uint32_t green, uint32_t blue)
+{
+    if (strip == NULL || index >= strip->size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strip->pixels[index * 3 + 0] = red;
+    strip->pixels[index * 3 + 1] = green;
+    strip->pixels[index * 3 + 2] = blue;
+    return ESP_OK;
+}
+
+esp_err_t led_strip_refresh_async(led_strip_handle_t strip)
+{
+    if (strip == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (strip->busy)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The transfer completes instantly, busy only enforces the wait_done pairing of the real driver
+    strip->busy = true;
+    FILE *output = led_strip_sim_output();
+    if (output != NULL)
+    {
+        if (s_timestamps)
+        {
+            fprintf(output, "%lld ", (long long)esp_timer_get_time());
+        }
+        fprintf(output, "%d %lu ", strip->gpio, (unsigned long)strip->size);
+        for (uint32_t i = 0; i < strip->size * 3; i++)
+        {
+            fprintf(output, "%02x", strip->pixels[i]);
+        }
+        fputc('\n', output);
+        fflush(output);
+    }
+    return ESP_OK;
+}
+
+esp_err_t led_strip_refresh_wait_done(led_strip_handle_t strip)
+{
+    if (strip == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strip->busy = false;
+    return ESP_OK;
+}
+
+esp_err_t led_strip_refresh(led_strip_handle_t strip)
+{
+    esp_err_t ret = led_strip_refresh_async(strip);
+    if (ret == ESP_OK)
+    {
+        ret = led_strip_refresh_wait_done(strip);
+    }
+    return ret;
+}
+
+esp_err_t led_strip_clear(led_strip_handle_t strip)
+{
+    if (strip == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(strip->pixels, 0, strip->size * 3);
+    return led_strip_refresh(strip);
+}
+
+esp_err_t led_strip_del(led_strip_handle_t strip)
+{
+    if (strip == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    free(strip->pixels);
+    free(strip);
+    return ESP_OK;
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include "host/ble_uuid.h"
+#include "nimble/nimble_port.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/// Simulated NimBLE host for the linux target
+///
+/// Declares the part of the NimBLE host API the firmware uses, with the same names, types and
+/// semantics, so the services build unchanged. There is no controller: centrals are simulated through
+/// nimble_sim.h, which connects them and drives the registered access callbacks from the host task.
+
+#ifndef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+#endif
+
+// Host error codes
+#define BLE_HS_EALREADY 2
+#define BLE_HS_EINVAL 3
+#define BLE_HS_EMSGSIZE 4
+#define BLE_HS_ENOENT 5
+#define BLE_HS_ENOMEM 6
+#define BLE_HS_ENOTCONN 7
+#define BLE_HS_EBUSY 15
+
+// ATT error codes
+#define BLE_ATT_ERR_INVALID_HANDLE 0x01
+#define BLE_ATT_ERR_READ_NOT_PERMITTED 0x02
+#define BLE_ATT_ERR_WRITE_NOT_PERMITTED 0x03
+#define BLE_ATT_ERR_INVALID_OFFSET 0x07
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN 0x0d
+#define BLE_ATT_ERR_UNLIKELY 0x0e
+#define BLE_ATT_ERR_INSUFFICIENT_RES 0x11
+#define BLE_ATT_ERR_VALUE_NOT_ALLOWED 0x13
+
+#define BLE_ATT_MTU_DFLT 23
+#define BLE_ATT_MTU_MAX 527
+#define BLE_ATT_ATTR_MAX_LEN 512
+
+#define BLE_ATT_F_READ 0x01
+#define BLE_ATT_F_WRITE 0x02
+
+#define BLE_HS_FOREVER INT32_MAX
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+
+#define BLE_ADDR_PUBLIC 0x00
+#define BLE_ADDR_RANDOM 0x01
+
+#define BLE_HCI_LE_PHY_1M 1
+#define BLE_HCI_LE_PHY_2M 2
+#define BLE_HCI_LE_PHY_CODED 3
+
+#define BLE_GAP_LE_PHY_1M_MASK 0x01
+#define BLE_GAP_LE_PHY_2M_MASK 0x02
+#define BLE_GAP_LE_PHY_CODED_MASK 0x04
+#define BLE_GAP_LE_PHY_CODED_ANY 0
+
+/// Packet buffer. The simulation keeps every value in one contiguous, growing buffer, so om_data and
+/// om_len always describe the whole value.
+struct os_mbuf
+{
+    uint8_t *om_data;
+    uint16_t om_len;
+    uint16_t om_size;
+};
+
+#define OS_MBUF_PKTLEN(om) ((om)->om_len)
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len);
+void os_mbuf_free_chain(struct os_mbuf *om);
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len);
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len);
+
+// GATT server
+
+#define BLE_GATT_ACCESS_OP_READ_CHR 0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR 1
+#define BLE_GATT_ACCESS_OP_READ_DSC 2
+#define BLE_GATT_ACCESS_OP_WRITE_DSC 3
+
+#define BLE_GATT_SVC_TYPE_END 0
+#define BLE_GATT_SVC_TYPE_PRIMARY 1
+#define BLE_GATT_SVC_TYPE_SECONDARY 2
+
+#define BLE_GATT_CHR_F_BROADCAST 0x0001
+#define BLE_GATT_CHR_F_READ 0x0002
+#define BLE_GATT_CHR_F_WRITE_NO_RSP 0x0004
+#define BLE_GATT_CHR_F_WRITE 0x0008
+#define BLE_GATT_CHR_F_NOTIFY 0x0010
+#define BLE_GATT_CHR_F_INDICATE 0x0020
+
+struct ble_gatt_chr_def;
+struct ble_gatt_dsc_def;
+
+struct ble_gatt_access_ctxt
+{
+    uint8_t op;
+    struct os_mbuf *om;
+    union
+    {
+        const struct ble_gatt_chr_def *chr;
+        const struct ble_gatt_dsc_def *dsc;
+    };
+};
+
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt,
+                               void *arg);
+
+struct ble_gatt_dsc_def
+{
+    const ble_uuid_t *uuid;
+    uint8_t att_flags;
+    uint8_t min_key_size;
+    ble_gatt_access_fn *access_cb;
+    void *arg;
+};
+
+struct ble_gatt_chr_def
+{
+    const ble_uuid_t *uuid;
+    ble_gatt_access_fn *access_cb;
+    void *arg;
+    struct ble_gatt_dsc_def *descriptors;
+    uint16_t flags;
+    uint8_t min_key_size;
+    uint16_t *val_handle;
+};
+
+struct ble_gatt_svc_def
+{
+    uint8_t type;
+    const ble_uuid_t *uuid;
+    const struct ble_gatt_svc_def **includes;
+    const struct ble_gatt_chr_def *characteristics;
+};
+
+struct ble_gatt_error
+{
+    uint16_t status;
+    uint16_t att_handle;
+};
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs);
+
+/// Registers the services and assigns the attribute handles. The definitions must stay valid.
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs);
+
+/// Delivers a notification to the simulated central and consumes `om`.
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om);
+
+// GATT client
+
+typedef int ble_gatt_mtu_fn(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t mtu, void *arg);
+
+int ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn *cb, void *cb_arg);
+
+// ATT
+
+uint16_t ble_att_mtu(uint16_t conn_handle);
+int ble_att_set_preferred_mtu(uint16_t mtu);
+
+// GAP
+
+#define BLE_GAP_CONN_MODE_NON 0
+#define BLE_GAP_CONN_MODE_DIR 1
+#define BLE_GAP_CONN_MODE_UND 2
+
+#define BLE_GAP_DISC_MODE_NON 0
+#define BLE_GAP_DISC_MODE_LTD 1
+#define BLE_GAP_DISC_MODE_GEN 2
+
+#define BLE_GAP_EVENT_CONNECT 0
+#define BLE_GAP_EVENT_DISCONNECT 1
+#define BLE_GAP_EVENT_CONN_UPDATE 3
+#define BLE_GAP_EVENT_ADV_COMPLETE 9
+#define BLE_GAP_EVENT_NOTIFY_TX 13
+#define BLE_GAP_EVENT_SUBSCRIBE 14
+#define BLE_GAP_EVENT_MTU 15
+#define BLE_GAP_EVENT_PHY_UPDATE_COMPLETE 27
+#define BLE_GAP_EVENT_DATA_LEN_CHG 34
+
+#define BLE_GAP_SUBSCRIBE_REASON_WRITE 1
+#define BLE_GAP_SUBSCRIBE_REASON_TERM 2
+
+#define BLE_HS_ADV_F_DISC_LTD 0x01
+#define BLE_HS_ADV_F_DISC_GEN 0x02
+#define BLE_HS_ADV_F_BREDR_UNSUP 0x04
+#define BLE_HS_ADV_TX_PWR_LVL_AUTO (-128)
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+struct ble_gap_conn_desc
+{
+    uint16_t conn_handle;
+    uint16_t conn_itvl;
+    uint16_t conn_latency;
+    uint16_t supervision_timeout;
+    ble_addr_t peer_id_addr;
+};
+
+struct ble_gap_upd_params
+{
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t latency;
+    uint16_t supervision_timeout;
+    uint16_t min_ce_len;
+    uint16_t max_ce_len;
+};
+
+struct ble_gap_adv_params
+{
+    uint8_t conn_mode;
+    uint8_t disc_mode;
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint8_t channel_map;
+    uint8_t filter_policy;
+    uint8_t high_duty_cycle : 1;
+};
+
+struct ble_hs_adv_fields
+{
+    uint8_t flags;
+    const ble_uuid128_t *uuids128;
+    uint8_t num_uuids128;
+    unsigned uuids128_is_complete : 1;
+    const uint8_t *name;
+    uint8_t name_len;
+    unsigned name_is_complete : 1;
+    int8_t tx_pwr_lvl;
+    unsigned tx_pwr_lvl_is_present : 1;
+};
+
+struct ble_gap_event
+{
+    uint8_t type;
+    union
+    {
+        struct
+        {
+            int status;
+            uint16_t conn_handle;
+        } connect;
+
+        struct
+        {
+            int reason;
+            struct ble_gap_conn_desc conn;
+        } disconnect;
+
+        struct
+        {
+            int status;
+            uint16_t conn_handle;
+        } conn_update;
+
+        struct
+        {
+            int reason;
+        } adv_complete;
+
+        struct
+        {
+            int status;
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t indication : 1;
+        } notify_tx;
+
+        struct
+        {
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t reason;
+            uint8_t prev_notify : 1;
+            uint8_t cur_notify : 1;
+            uint8_t prev_indicate : 1;
+            uint8_t cur_indicate : 1;
+        } subscribe;
+
+        struct
+        {
+            uint16_t conn_handle;
+            uint16_t channel_id;
+            uint16_t value;
+        } mtu;
+
+        struct
+        {
+            int status;
+            uint16_t conn_handle;
+            uint8_t tx_phy;
+            uint8_t rx_phy;
+        } phy_updated;
+
+        struct
+        {
+            uint16_t conn_handle;
+            uint16_t max_tx_octets;
+            uint16_t max_tx_time;
+            uint16_t max_rx_octets;
+            uint16_t max_rx_time;
+        } data_len_chg;
+    };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event *event, void *arg);
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *adv_fields);
+int ble_gap_adv_rsp_set_fields(const struct ble_hs_adv_fields *rsp_fields);
+int ble_gap_adv_start(uint8_t own_addr_type, const ble_addr_t *direct_addr, int32_t duration_ms,
+                      const struct ble_gap_adv_params *adv_params, ble_gap_event_fn *cb, void *cb_arg);
+int ble_gap_adv_stop(void);
+int ble_gap_adv_active(void);
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc);
+int ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params *params);
+int ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time);
+int ble_gap_set_prefered_le_phy(uint16_t conn_handle, uint8_t tx_phys_mask, uint8_t rx_phys_mask, uint16_t phy_opts);
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason);
+
+// Identity and host configuration
+
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa);
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type);
+
+typedef void ble_hs_sync_fn(void);
+typedef void ble_hs_reset_fn(int reason);
+
+struct ble_hs_cfg
+{
+    ble_hs_sync_fn *sync_cb;
+    ble_hs_reset_fn *reset_cb;
+};
+
+extern struct ble_hs_cfg ble_hs_cfg;
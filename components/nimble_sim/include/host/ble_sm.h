@@ -0,0 +1,3 @@
+#pragma once
+
+// The simulated host has no security manager, pairing always stays off
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+/// UUID types of the NimBLE host, as far as the firmware uses them
+
+#define BLE_UUID_TYPE_16 16
+#define BLE_UUID_TYPE_32 32
+#define BLE_UUID_TYPE_128 128
+
+typedef struct
+{
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct
+{
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct
+{
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+#define BLE_UUID16_INIT(uuid16)                                                                                       \
+    {                                                                                                                  \
+        .u = {.type = BLE_UUID_TYPE_16}, .value = (uuid16),                                                            \
+    }
+
+#define BLE_UUID128_INIT(uuid128...)                                                                                   \
+    {                                                                                                                  \
+        .u = {.type = BLE_UUID_TYPE_128}, .value = {uuid128},                                                          \
+    }
+
+#define BLE_UUID16_DECLARE(uuid16) ((ble_uuid_t *)(&(ble_uuid16_t)BLE_UUID16_INIT(uuid16)))
+
+/// Returns the 16 bit value of a 16 bit UUID, 0 for any other type.
+static inline uint16_t ble_uuid_u16(const ble_uuid_t *uuid)
+{
+    return uuid->type == BLE_UUID_TYPE_16 ? ((const ble_uuid16_t *)uuid)->value : 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Porting layer of the simulated host: events run one after another in the host task started by
+/// nimble_port_freertos_init(), callouts post their event there when they expire.
+
+struct ble_npl_event;
+typedef void ble_npl_event_fn(struct ble_npl_event *ev);
+
+struct ble_npl_event
+{
+    ble_npl_event_fn *fn;
+    void *arg;
+};
+
+struct ble_npl_eventq
+{
+    QueueHandle_t queue;
+};
+
+struct ble_npl_callout
+{
+    TimerHandle_t timer;
+    struct ble_npl_event ev;
+    struct ble_npl_eventq *evq;
+};
+
+typedef TickType_t ble_npl_time_t;
+
+esp_err_t nimble_port_init(void);
+
+/// Runs the host: reports sync, then handles events until nimble_port_stop().
+void nimble_port_run(void);
+
+int nimble_port_stop(void);
+
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void);
+
+void ble_npl_eventq_put(struct ble_npl_eventq *evq, struct ble_npl_event *ev);
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq, ble_npl_event_fn *fn, void *arg);
+int ble_npl_callout_reset(struct ble_npl_callout *co, ble_npl_time_t ticks);
+void ble_npl_callout_stop(struct ble_npl_callout *co);
+bool ble_npl_callout_is_active(struct ble_npl_callout *co);
+
+static inline void *ble_npl_event_get_arg(struct ble_npl_event *ev)
+{
+    return ev->arg;
+}
+
+static inline ble_npl_time_t ble_npl_time_get(void)
+{
+    return xTaskGetTickCount();
+}
+
+static inline ble_npl_time_t ble_npl_time_ms_to_ticks32(uint32_t ms)
+{
+    return pdMS_TO_TICKS(ms);
+}
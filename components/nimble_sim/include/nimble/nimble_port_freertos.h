@@ -0,0 +1,7 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/// Starts the host task, which calls `host_task_fn` (usually running nimble_port_run()).
+void nimble_port_freertos_init(TaskFunction_t host_task_fn);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "host/ble_hs.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Simulated centrals for host builds
+///
+/// Every function runs its work in the host task, the same as the real stack, and waits for it, so
+/// the services see the usual ordering and the caller gets the result. Characteristics are addressed
+/// by their 16 bit UUID.
+
+/// Connects a central that offers `mtu` in the MTU exchange. Fails with BLE_HS_CONN_HANDLE_NONE unless
+/// the device is advertising, so the connection limit of the firmware is honoured.
+uint16_t nimble_sim_connect(uint16_t mtu);
+
+void nimble_sim_disconnect(uint16_t conn_handle);
+
+/// Writes a characteristic value. Returns 0 or the BLE_ATT_ERR_* code of the access callback.
+int nimble_sim_write(uint16_t conn_handle, uint16_t uuid16, const void *data, size_t len);
+
+/// Reads a whole characteristic value into `buf`. `len` holds its size on entry and the length of the
+/// value on return, which may exceed the size if the value was cut. Returns 0 or a BLE_ATT_ERR_* code.
+int nimble_sim_read(uint16_t conn_handle, uint16_t uuid16, void *buf, size_t *len);
+
+/// Writes the CCCD of a characteristic.
+int nimble_sim_subscribe(uint16_t conn_handle, uint16_t uuid16, bool notify);
+
+typedef void (*nimble_sim_notify_fn_t)(uint16_t conn_handle, uint16_t attr_handle, const uint8_t *data, size_t len,
+                                       void *ctx);
+
+/// Receives every notification the firmware sends. Called in the host task, from inside
+/// ble_gatts_notify_custom(), which then reports BLE_GAP_EVENT_NOTIFY_TX before it returns, the
+/// same as the real stack.
+void nimble_sim_set_notify_handler(nimble_sim_notify_fn_t handler, void *ctx);
+
+/// Lets the next `after` calls of ble_hs_mbuf_from_flat() succeed and makes the `count` calls after
+/// them return NULL, as when the msys pool of the real host is exhausted. Writes of the simulated
+/// centrals are not affected.
+void nimble_sim_fail_mbufs(uint32_t after, uint32_t count);
+
+/// Returns true once the host has synced and the device is advertising.
+bool nimble_sim_advertising(void);
@@ -0,0 +1,5 @@
+#pragma once
+
+void ble_svc_gap_init(void);
+const char *ble_svc_gap_device_name(void);
+int ble_svc_gap_device_name_set(const char *name);
@@ -0,0 +1,816 @@
+#include "nimble_sim.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *TAG = "nimble_sim";
+
+#define SIM_EVENTQ_LEN 64
+#define SIM_MAX_CHARACTERISTICS 32
+#define SIM_HOST_TASK_STACK 8192
+
+// Parameters a central gets until the firmware asks for others
+#define SIM_CONN_ITVL 24     // 30 ms
+#define SIM_SUPERVISION_TIMEOUT 400
+
+typedef struct
+{
+    bool used;
+    uint16_t central_mtu;
+    uint16_t mtu;
+    struct ble_gap_conn_desc desc;
+    ble_gap_event_fn *cb;
+    void *cb_arg;
+} sim_conn_t;
+
+typedef struct
+{
+    const struct ble_gatt_chr_def *chr;
+    uint16_t val_handle;
+} sim_chr_t;
+
+struct ble_hs_cfg ble_hs_cfg;
+
+static struct ble_npl_eventq s_eventq;
+static volatile bool s_stopped;
+
+static sim_conn_t s_conns[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static uint16_t s_next_conn_handle = 1;
+static uint16_t s_preferred_mtu = 256;
+
+static sim_chr_t s_chrs[SIM_MAX_CHARACTERISTICS];
+static int s_chr_count;
+static uint16_t s_next_attr_handle = 1;
+
+static volatile bool s_adv_active;
+static ble_gap_event_fn *s_adv_cb;
+static void *s_adv_cb_arg;
+
+static char s_device_name[32] = "nimble_sim";
+
+static nimble_sim_notify_fn_t s_notify_handler;
+static void *s_notify_ctx;
+
+static uint32_t s_mbuf_successes;
+static uint32_t s_mbuf_failures;
+
+// Packet buffers
+
+static bool sim_mbuf_reserve(struct os_mbuf *om, size_t size)
+{
+    if (size > UINT16_MAX)
+    {
+        return false;
+    }
+    if (size <= om->om_size)
+    {
+        return true;
+    }
+
+    size_t capacity = om->om_size > 0 ? om->om_size : 64;
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+    capacity = capacity < UINT16_MAX ? capacity : UINT16_MAX;
+
+    uint8_t *data = realloc(om->om_data, capacity);
+    if (data == NULL)
+    {
+        return false;
+    }
+    om->om_data = data;
+    om->om_size = capacity;
+    return true;
+}
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len)
+{
+    if (!sim_mbuf_reserve(om, (size_t)om->om_len + len))
+    {
+        return BLE_HS_ENOMEM;
+    }
+    memcpy(&om->om_data[om->om_len], data, len);
+    om->om_len += len;
+    return 0;
+}
+
+void os_mbuf_free_chain(struct os_mbuf *om)
+{
+    if (om != NULL)
+    {
+        free(om->om_data);
+        free(om);
+    }
+}
+
+static struct os_mbuf *sim_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    struct os_mbuf *om = calloc(1, sizeof(*om));
+    if (om != NULL && os_mbuf_append(om, buf, len) != 0)
+    {
+        os_mbuf_free_chain(om);
+        om = NULL;
+    }
+    return om;
+}
+
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    // An exhausted msys pool, as nimble_sim_fail_mbufs() asked for
+    if (s_mbuf_successes > 0)
+    {
+        s_mbuf_successes--;
+    }
+    else if (s_mbuf_failures > 0)
+    {
+        s_mbuf_failures--;
+        return NULL;
+    }
+    return sim_mbuf_from_flat(buf, len);
+}
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len)
+{
+    uint16_t len = om->om_len < max_len ? om->om_len : max_len;
+    memcpy(flat, om->om_data, len);
+    if (out_copy_len != NULL)
+    {
+        *out_copy_len = len;
+    }
+    return len < om->om_len ? BLE_HS_EMSGSIZE : 0;
+}
+
+// Porting layer
+
+esp_err_t nimble_port_init(void)
+{
+    if (s_eventq.queue == NULL)
+    {
+        s_eventq.queue = xQueueCreate(SIM_EVENTQ_LEN, sizeof(struct ble_npl_event *));
+        if (s_eventq.queue == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    s_stopped = false;
+    return ESP_OK;
+}
+
+void nimble_port_run(void)
+{
+    if (ble_hs_cfg.sync_cb != NULL)
+    {
+        ble_hs_cfg.sync_cb();
+    }
+
+    while (!s_stopped)
+    {
+        struct ble_npl_event *ev;
+        if (xQueueReceive(s_eventq.queue, &ev, portMAX_DELAY) == pdTRUE && ev->fn != NULL)
+        {
+            ev->fn(ev);
+        }
+    }
+}
+
+static struct ble_npl_event s_stop_event;
+
+int nimble_port_stop(void)
+{
+    s_stopped = true;
+    ble_npl_eventq_put(&s_eventq, &s_stop_event);
+    return 0;
+}
+
+void nimble_port_freertos_init(TaskFunction_t host_task_fn)
+{
+    xTaskCreate(host_task_fn, "nimble_host", SIM_HOST_TASK_STACK, NULL, 5, NULL);
+}
+
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void)
+{
+    return &s_eventq;
+}
+
+void ble_npl_eventq_put(struct ble_npl_eventq *evq, struct ble_npl_event *ev)
+{
+    xQueueSend(evq->queue, &ev, portMAX_DELAY);
+}
+
+static void sim_callout_expired(TimerHandle_t timer)
+{
+    struct ble_npl_callout *co = pvTimerGetTimerID(timer);
+    ble_npl_eventq_put(co->evq, &co->ev);
+}
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq, ble_npl_event_fn *fn, void *arg)
+{
+    // Callouts in static slots are initialised again whenever a slot is reused
+    if (co->timer == NULL)
+    {
+        co->timer = xTimerCreate("callout", 1, pdFALSE, co, sim_callout_expired);
+    }
+    else
+    {
+        xTimerStop(co->timer, portMAX_DELAY);
+    }
+    co->evq = evq;
+    co->ev.fn = fn;
+    co->ev.arg = arg;
+}
+
+int ble_npl_callout_reset(struct ble_npl_callout *co, ble_npl_time_t ticks)
+{
+    return xTimerChangePeriod(co->timer, ticks > 0 ? ticks : 1, portMAX_DELAY) == pdPASS ? 0 : BLE_HS_EINVAL;
+}
+
+void ble_npl_callout_stop(struct ble_npl_callout *co)
+{
+    if (co->timer != NULL)
+    {
+        xTimerStop(co->timer, portMAX_DELAY);
+    }
+}
+
+bool ble_npl_callout_is_active(struct ble_npl_callout *co)
+{
+    return co->timer != NULL && xTimerIsTimerActive(co->timer) != pdFALSE;
+}
+
+// Connections and GAP
+
+static sim_conn_t *sim_conn_find(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (s_conns[i].used && s_conns[i].desc.conn_handle == conn_handle)
+        {
+            return &s_conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void sim_gap_dispatch(sim_conn_t *conn, struct ble_gap_event *event)
+{
+    if (conn->cb != NULL)
+    {
+        conn->cb(event, conn->cb_arg);
+    }
+}
+
+/// GAP event the controller would report some time after the request that caused it
+typedef struct
+{
+    struct ble_npl_event ev;
+    uint16_t conn_handle;
+    struct ble_gap_event event;
+    ble_gatt_mtu_fn *mtu_cb;
+    void *mtu_cb_arg;
+} sim_deferred_t;
+
+static void sim_deferred_run(struct ble_npl_event *ev)
+{
+    sim_deferred_t *deferred = ble_npl_event_get_arg(ev);
+    sim_conn_t *conn = sim_conn_find(deferred->conn_handle);
+    if (conn != NULL)
+    {
+        if (deferred->event.type == BLE_GAP_EVENT_MTU)
+        {
+            conn->mtu = deferred->event.mtu.value;
+            if (deferred->mtu_cb != NULL)
+            {
+                struct ble_gatt_error error = {.status = 0};
+                deferred->mtu_cb(conn->desc.conn_handle, &error, conn->mtu, deferred->mtu_cb_arg);
+            }
+        }
+        sim_gap_dispatch(conn, &deferred->event);
+    }
+    free(deferred);
+}
+
+static int sim_defer(uint16_t conn_handle, const struct ble_gap_event *event)
+{
+    sim_deferred_t *deferred = calloc(1, sizeof(*deferred));
+    if (deferred == NULL)
+    {
+        return BLE_HS_ENOMEM;
+    }
+    deferred->ev.fn = sim_deferred_run;
+    deferred->ev.arg = deferred;
+    deferred->conn_handle = conn_handle;
+    deferred->event = *event;
+    ble_npl_eventq_put(&s_eventq, &deferred->ev);
+    return 0;
+}
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *adv_fields)
+{
+    return s_adv_active ? BLE_HS_EBUSY : 0;
+}
+
+int ble_gap_adv_rsp_set_fields(const struct ble_hs_adv_fields *rsp_fields)
+{
+    return 0;
+}
+
+int ble_gap_adv_start(uint8_t own_addr_type, const ble_addr_t *direct_addr, int32_t duration_ms,
+                      const struct ble_gap_adv_params *adv_params, ble_gap_event_fn *cb, void *cb_arg)
+{
+    if (s_adv_active)
+    {
+        return BLE_HS_EALREADY;
+    }
+    s_adv_cb = cb;
+    s_adv_cb_arg = cb_arg;
+    s_adv_active = true;
+    return 0;
+}
+
+int ble_gap_adv_stop(void)
+{
+    if (!s_adv_active)
+    {
+        return BLE_HS_EALREADY;
+    }
+    s_adv_active = false;
+    return 0;
+}
+
+int ble_gap_adv_active(void)
+{
+    return s_adv_active;
+}
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc)
+{
+    sim_conn_t *conn = sim_conn_find(handle);
+    if (conn == NULL)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    if (out_desc != NULL)
+    {
+        *out_desc = conn->desc;
+    }
+    return 0;
+}
+
+int ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params *params)
+{
+    sim_conn_t *conn = sim_conn_find(conn_handle);
+    if (conn == NULL)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+
+    // The simulated central accepts everything, the slowest interval allowed
+    conn->desc.conn_itvl = params->itvl_max;
+    conn->desc.conn_latency = params->latency;
+    conn->desc.supervision_timeout = params->supervision_timeout;
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_CONN_UPDATE,
+                                  .conn_update = {.status = 0, .conn_handle = conn_handle}};
+    return sim_defer(conn_handle, &event);
+}
+
+int ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time)
+{
+    if (sim_conn_find(conn_handle) == NULL)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_DATA_LEN_CHG,
+                                  .data_len_chg = {.conn_handle = conn_handle,
+                                                   .max_tx_octets = tx_octets,
+                                                   .max_tx_time = tx_time,
+                                                   .max_rx_octets = tx_octets,
+                                                   .max_rx_time = tx_time}};
+    return sim_defer(conn_handle, &event);
+}
+
+int ble_gap_set_prefered_le_phy(uint16_t conn_handle, uint8_t tx_phys_mask, uint8_t rx_phys_mask, uint16_t phy_opts)
+{
+    if (sim_conn_find(conn_handle) == NULL)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    struct ble_gap_event event = {
+        .type = BLE_GAP_EVENT_PHY_UPDATE_COMPLETE,
+        .phy_updated = {.status = 0,
+                        .conn_handle = conn_handle,
+                        .tx_phy = (tx_phys_mask & BLE_GAP_LE_PHY_2M_MASK) ? BLE_HCI_LE_PHY_2M : BLE_HCI_LE_PHY_1M,
+                        .rx_phy = (rx_phys_mask & BLE_GAP_LE_PHY_2M_MASK) ? BLE_HCI_LE_PHY_2M : BLE_HCI_LE_PHY_1M}};
+    return sim_defer(conn_handle, &event);
+}
+
+static void sim_disconnect(sim_conn_t *conn, int reason)
+{
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_DISCONNECT, .disconnect = {.reason = reason, .conn = conn->desc}};
+    conn->used = false;
+    sim_gap_dispatch(conn, &event);
+}
+
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason)
+{
+    sim_conn_t *conn = sim_conn_find(conn_handle);
+    if (conn == NULL)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    sim_disconnect(conn, hci_reason);
+    return 0;
+}
+
+// ATT and GATT
+
+uint16_t ble_att_mtu(uint16_t conn_handle)
+{
+    sim_conn_t *conn = sim_conn_find(conn_handle);
+    return conn != NULL ? conn->mtu : 0;
+}
+
+int ble_att_set_preferred_mtu(uint16_t mtu)
+{
+    if (mtu < BLE_ATT_MTU_DFLT || mtu > BLE_ATT_MTU_MAX)
+    {
+        return BLE_HS_EINVAL;
+    }
+    s_preferred_mtu = mtu;
+    return 0;
+}
+
+int ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn *cb, void *cb_arg)
+{
+    sim_conn_t *conn = sim_conn_find(conn_handle);
+    if (conn == NULL)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+
+    sim_deferred_t *deferred = calloc(1, sizeof(*deferred));
+    if (deferred == NULL)
+    {
+        return BLE_HS_ENOMEM;
+    }
+    deferred->ev.fn = sim_deferred_run;
+    deferred->ev.arg = deferred;
+    deferred->conn_handle = conn_handle;
+    deferred->event.type = BLE_GAP_EVENT_MTU;
+    deferred->event.mtu.conn_handle = conn_handle;
+    deferred->event.mtu.value = conn->central_mtu < s_preferred_mtu ? conn->central_mtu : s_preferred_mtu;
+    deferred->mtu_cb = cb;
+    deferred->mtu_cb_arg = cb_arg;
+    ble_npl_eventq_put(&s_eventq, &deferred->ev);
+    return 0;
+}
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs)
+{
+    return 0;
+}
+
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs)
+{
+    // Handles are assigned in the same order as NimBLE does: service, then per characteristic its
+    // declaration, value, CCCD if it notifies and its descriptors
+    for (const struct ble_gatt_svc_def *svc = svcs; svc->type != BLE_GATT_SVC_TYPE_END; svc++)
+    {
+        s_next_attr_handle++;
+        for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr != NULL && chr->uuid != NULL; chr++)
+        {
+            if (s_chr_count == SIM_MAX_CHARACTERISTICS)
+            {
+                ESP_LOGE(TAG, "Too many characteristics");
+                return BLE_HS_ENOMEM;
+            }
+
+            uint16_t val_handle = s_next_attr_handle + 1;
+            s_next_attr_handle += 2;
+            if (chr->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE))
+            {
+                s_next_attr_handle++;
+            }
+            for (const struct ble_gatt_dsc_def *dsc = chr->descriptors; dsc != NULL && dsc->uuid != NULL; dsc++)
+            {
+                s_next_attr_handle++;
+            }
+
+            s_chrs[s_chr_count].chr = chr;
+            s_chrs[s_chr_count].val_handle = val_handle;
+            s_chr_count++;
+            if (chr->val_handle != NULL)
+            {
+                *chr->val_handle = val_handle;
+            }
+        }
+    }
+    return 0;
+}
+
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om)
+{
+    sim_conn_t *conn = sim_conn_find(conn_handle);
+    if (conn == NULL)
+    {
+        os_mbuf_free_chain(om);
+        return BLE_HS_ENOTCONN;
+    }
+
+    if (s_notify_handler != NULL)
+    {
+        s_notify_handler(conn_handle, att_handle, om->om_data, om->om_len, s_notify_ctx);
+    }
+    os_mbuf_free_chain(om);
+
+    // Like the real host, the outcome is reported from inside the call, not when the PDU is sent
+    struct ble_gap_event event = {
+        .type = BLE_GAP_EVENT_NOTIFY_TX,
+        .notify_tx = {.status = 0, .conn_handle = conn_handle, .attr_handle = att_handle, .indication = 0}};
+    sim_gap_dispatch(conn, &event);
+    return 0;
+}
+
+// Identity and services
+
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa)
+{
+    static const uint8_t addr[6] = {0x01, 0x00, 0x00, 0x5e, 0x10, 0xc0};
+    memcpy(out_id_addr, addr, sizeof(addr));
+    if (out_is_nrpa != NULL)
+    {
+        *out_is_nrpa = 0;
+    }
+    return 0;
+}
+
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type)
+{
+    *out_addr_type = BLE_ADDR_PUBLIC;
+    return 0;
+}
+
+void ble_svc_gap_init(void)
+{
+}
+
+void ble_svc_gatt_init(void)
+{
+}
+
+const char *ble_svc_gap_device_name(void)
+{
+    return s_device_name;
+}
+
+int ble_svc_gap_device_name_set(const char *name)
+{
+    snprintf(s_device_name, sizeof(s_device_name), "%s", name);
+    return 0;
+}
+
+// Simulated centrals
+
+/// A call from the driving task, run in the host task while the caller waits
+typedef struct
+{
+    struct ble_npl_event ev;
+    SemaphoreHandle_t done;
+    uint16_t conn_handle;
+    uint16_t uuid16;
+    uint16_t mtu;
+    bool notify;
+    const void *data;
+    void *buf;
+    size_t len;
+    uint32_t after;
+    int rc;
+} sim_call_t;
+
+static void sim_call(sim_call_t *call, ble_npl_event_fn *fn)
+{
+    call->ev.fn = fn;
+    call->ev.arg = call;
+    call->done = xSemaphoreCreateBinary();
+    ble_npl_eventq_put(&s_eventq, &call->ev);
+    xSemaphoreTake(call->done, portMAX_DELAY);
+    vSemaphoreDelete(call->done);
+}
+
+static void sim_call_done(sim_call_t *call)
+{
+    xSemaphoreGive(call->done);
+}
+
+static const sim_chr_t *sim_chr_find(uint16_t uuid16)
+{
+    for (int i = 0; i < s_chr_count; i++)
+    {
+        if (ble_uuid_u16(s_chrs[i].chr->uuid) == uuid16)
+        {
+            return &s_chrs[i];
+        }
+    }
+    return NULL;
+}
+
+static void sim_connect_run(struct ble_npl_event *ev)
+{
+    sim_call_t *call = ble_npl_event_get_arg(ev);
+    call->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+
+    sim_conn_t *conn = NULL;
+    for (int i = 0; s_adv_active && conn == NULL && i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!s_conns[i].used)
+        {
+            conn = &s_conns[i];
+        }
+    }
+    if (conn != NULL)
+    {
+        // Like a legacy advertiser, the connection ends the advertising
+        s_adv_active = false;
+
+        memset(conn, 0, sizeof(*conn));
+        conn->used = true;
+        conn->central_mtu = call->mtu;
+        conn->mtu = BLE_ATT_MTU_DFLT;
+        conn->desc.conn_handle = s_next_conn_handle++;
+        conn->desc.conn_itvl = SIM_CONN_ITVL;
+        conn->desc.supervision_timeout = SIM_SUPERVISION_TIMEOUT;
+        conn->cb = s_adv_cb;
+        conn->cb_arg = s_adv_cb_arg;
+        call->conn_handle = conn->desc.conn_handle;
+
+        struct ble_gap_event event = {.type = BLE_GAP_EVENT_CONNECT,
+                                      .connect = {.status = 0, .conn_handle = conn->desc.conn_handle}};
+        sim_gap_dispatch(conn, &event);
+    }
+    sim_call_done(call);
+}
+
+uint16_t nimble_sim_connect(uint16_t mtu)
+{
+    sim_call_t call = {.mtu = mtu};
+    sim_call(&call, sim_connect_run);
+    return call.conn_handle;
+}
+
+static void sim_disconnect_run(struct ble_npl_event *ev)
+{
+    sim_call_t *call = ble_npl_event_get_arg(ev);
+    sim_conn_t *conn = sim_conn_find(call->conn_handle);
+    if (conn != NULL)
+    {
+        sim_disconnect(conn, 0x13); // Remote user terminated connection
+    }
+    sim_call_done(call);
+}
+
+void nimble_sim_disconnect(uint16_t conn_handle)
+{
+    sim_call_t call = {.conn_handle = conn_handle};
+    sim_call(&call, sim_disconnect_run);
+}
+
+static void sim_write_run(struct ble_npl_event *ev)
+{
+    sim_call_t *call = ble_npl_event_get_arg(ev);
+    const sim_chr_t *chr = sim_chr_find(call->uuid16);
+    if (sim_conn_find(call->conn_handle) == NULL)
+    {
+        call->rc = BLE_HS_ENOTCONN;
+    }
+    else if (chr == NULL)
+    {
+        call->rc = BLE_ATT_ERR_INVALID_HANDLE;
+    }
+    else if (!(chr->chr->flags & (BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP)))
+    {
+        call->rc = BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+    else if (call->len > BLE_ATT_ATTR_MAX_LEN)
+    {
+        call->rc = BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    else
+    {
+        struct ble_gatt_access_ctxt ctxt = {.op = BLE_GATT_ACCESS_OP_WRITE_CHR,
+                                            .om = sim_mbuf_from_flat(call->data, call->len),
+                                            .chr = chr->chr};
+        call->rc = ctxt.om != NULL ? chr->chr->access_cb(call->conn_handle, chr->val_handle, &ctxt, chr->chr->arg)
+                                   : BLE_ATT_ERR_INSUFFICIENT_RES;
+        os_mbuf_free_chain(ctxt.om);
+    }
+    sim_call_done(call);
+}
+
+int nimble_sim_write(uint16_t conn_handle, uint16_t uuid16, const void *data, size_t len)
+{
+    sim_call_t call = {.conn_handle = conn_handle, .uuid16 = uuid16, .data = data, .len = len};
+    sim_call(&call, sim_write_run);
+    return call.rc;
+}
+
+static void sim_read_run(struct ble_npl_event *ev)
+{
+    sim_call_t *call = ble_npl_event_get_arg(ev);
+    const sim_chr_t *chr = sim_chr_find(call->uuid16);
+    if (sim_conn_find(call->conn_handle) == NULL)
+    {
+        call->rc = BLE_HS_ENOTCONN;
+    }
+    else if (chr == NULL)
+    {
+        call->rc = BLE_ATT_ERR_INVALID_HANDLE;
+    }
+    else if (!(chr->chr->flags & BLE_GATT_CHR_F_READ))
+    {
+        call->rc = BLE_ATT_ERR_READ_NOT_PERMITTED;
+    }
+    else
+    {
+        struct os_mbuf om = {0};
+        struct ble_gatt_access_ctxt ctxt = {.op = BLE_GATT_ACCESS_OP_READ_CHR, .om = &om, .chr = chr->chr};
+        call->rc = chr->chr->access_cb(call->conn_handle, chr->val_handle, &ctxt, chr->chr->arg);
+        memcpy(call->buf, om.om_data, om.om_len < call->len ? om.om_len : call->len);
+        call->len = om.om_len;
+        free(om.om_data);
+    }
+    sim_call_done(call);
+}
+
+int nimble_sim_read(uint16_t conn_handle, uint16_t uuid16, void *buf, size_t *len)
+{
+    sim_call_t call = {.conn_handle = conn_handle, .uuid16 = uuid16, .buf = buf, .len = *len};
+    sim_call(&call, sim_read_run);
+    *len = call.len;
+    return call.rc;
+}
+
+static void sim_subscribe_run(struct ble_npl_event *ev)
+{
+    sim_call_t *call = ble_npl_event_get_arg(ev);
+    const sim_chr_t *chr = sim_chr_find(call->uuid16);
+    sim_conn_t *conn = sim_conn_find(call->conn_handle);
+    if (conn == NULL)
+    {
+        call->rc = BLE_HS_ENOTCONN;
+    }
+    else if (chr == NULL || !(chr->chr->flags & BLE_GATT_CHR_F_NOTIFY))
+    {
+        call->rc = BLE_ATT_ERR_INVALID_HANDLE;
+    }
+    else
+    {
+        struct ble_gap_event event = {.type = BLE_GAP_EVENT_SUBSCRIBE,
+                                      .subscribe = {.conn_handle = call->conn_handle,
+                                                    .attr_handle = chr->val_handle,
+                                                    .reason = BLE_GAP_SUBSCRIBE_REASON_WRITE,
+                                                    .prev_notify = !call->notify,
+                                                    .cur_notify = call->notify}};
+        sim_gap_dispatch(conn, &event);
+        call->rc = 0;
+    }
+    sim_call_done(call);
+}
+
+int nimble_sim_subscribe(uint16_t conn_handle, uint16_t uuid16, bool notify)
+{
+    sim_call_t call = {.conn_handle = conn_handle, .uuid16 = uuid16, .notify = notify};
+    sim_call(&call, sim_subscribe_run);
+    return call.rc;
+}
+
+void nimble_sim_set_notify_handler(nimble_sim_notify_fn_t handler, void *ctx)
+{
+    s_notify_ctx = ctx;
+    s_notify_handler = handler;
+}
+
+static void sim_fail_mbufs_run(struct ble_npl_event *ev)
+{
+    sim_call_t *call = ble_npl_event_get_arg(ev);
+    s_mbuf_successes = call->after;
+    s_mbuf_failures = (uint32_t)call->len;
+    sim_call_done(call);
+}
+
+void nimble_sim_fail_mbufs(uint32_t after, uint32_t count)
+{
+    sim_call_t call = {.after = after, .len = count};
+    sim_call(&call, sim_fail_mbufs_run);
+}
+
+bool nimble_sim_advertising(void)
+{
+    return s_adv_active;
+}
@@ -1,12 +1,80 @@
 #pragma once
 
+#include "esp_err.h"
+#include <stddef.h>
+
 typedef enum
 {
     VALUE_TYPE_STRING,
     VALUE_TYPE_INT32,
+    VALUE_TYPE_UINT8,
+    VALUE_TYPE_UINT16,
+    VALUE_TYPE_UINT32,
+    VALUE_TYPE_INT64,
+    VALUE_TYPE_FLOAT, ///< Stored as the uint32_t bit pattern of the float
+    VALUE_TYPE_BLOB,
 } persistence_value_type_t;
 
+/// One value restored by persistence_load_many()
+typedef struct
+{
+    const char *key;
+    persistence_value_type_t type;
+    void *out;     ///< Destination, e.g. a field of a settings struct
+    size_t size;   ///< Capacity of `out`, receives the stored size for strings and blobs
+    esp_err_t err; ///< Result of this item
+} persistence_item_t;
+
+/// Initializer of a persistence_item_t that loads `key` into `field`.
+#define PERSISTENCE_ITEM(key_, type_, field) {.key = (key_), .type = (type_), .out = &(field), .size = sizeof(field)}
+
 void persistence_init(const char *namespace_name);
+
+/**
+ * @brief Stores a value in the RAM write-back cache and returns immediately.
+ * Repeated writes to the same key are coalesced. Pending values are committed to NVS in one batch
+ * CONFIG_WLED_PERSISTENCE_COMMIT_DELAY_MS after the first uncommitted write, on persistence_flush()
+ * and before a controlled reboot through esp_restart().
+ * Strings are NUL terminated, blobs have to be saved with persistence_save_blob().
+ */
 void persistence_save(persistence_value_type_t value_type, const char *key, const void *value);
+
+/**
+ * @brief Stores a blob of `len` bytes, see persistence_save().
+ */
+esp_err_t persistence_save_blob(const char *key, const void *data, size_t len);
+
+/**
+ * @brief Loads a fixed size value, pending writes included. `out` is left untouched on error.
+ * Strings and blobs need a buffer size, use persistence_load_value() for them.
+ */
 void *persistence_load(persistence_value_type_t value_type, const char *key, void *out);
+
+/**
+ * @brief Loads a value through the RAM cache; only the first access of a key reads NVS.
+ *
+ * @param value_type Type the key was saved with.
+ * @param key        NVS key.
+ * @param out        Destination, may be NULL to query the size of a string or blob.
+ * @param len        Capacity of `out` in bytes, receives the stored size (strings include the
+ *                   terminator). Required for strings and blobs, may be NULL for other types.
+ * @return ESP_OK on success.
+ *         ESP_ERR_NVS_NOT_FOUND if the key does not exist.
+ *         ESP_ERR_NVS_TYPE_MISMATCH if the key was saved with another type.
+ *         ESP_ERR_NVS_INVALID_LENGTH if `out` is too small, `*len` holds the required size.
+ */
+esp_err_t persistence_load_value(persistence_value_type_t value_type, const char *key, void *out, size_t *len);
+
+/**
+ * @brief Loads several values under a single lock, e.g. to restore a settings struct at boot.
+ * Every item records its own result, missing keys leave their destination untouched.
+ * @return The number of items loaded successfully.
+ */
+size_t persistence_load_many(persistence_item_t *items, size_t count);
+
+/**
+ * @brief Writes all pending values to NVS and commits them. Blocks until done.
+ */
+void persistence_flush(void);
+
 void persistence_deinit();
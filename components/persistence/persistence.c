@@ -2,14 +2,213 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_mac.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "latency.h"
 #include "nvs_flash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "persistence";
 
+#define PERSISTENCE_CACHE_SIZE 32 // Keys kept in RAM, clean ones are evicted least recently used first
+
+/// Cached key. Dirty entries hold a value written by persistence_save() and not yet committed to NVS,
+/// clean entries mirror NVS, including keys known to be missing.
+typedef struct
+{
+    bool used;
+    bool dirty;
+    bool found;
+    persistence_value_type_t type;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    size_t len; ///< Size of the value, strings include the terminator
+    uint32_t last_used;
+    union
+    {
+        uint8_t bytes[8]; ///< Fixed size types
+        void *data;       ///< Strings and blobs, heap allocated
+    } value;
+} persistence_entry_t;
+
 static nvs_handle_t persistence_handle;
 static SemaphoreHandle_t persistence_mutex;
+static esp_timer_handle_t persistence_timer;
+static TaskHandle_t persistence_task;
+static persistence_entry_t persistence_cache[PERSISTENCE_CACHE_SIZE];
+static uint32_t persistence_use_clock;
+
+/// Size of a fixed size type, 0 for strings and blobs.
+static size_t persistence_type_size(persistence_value_type_t type)
+{
+    switch (type)
+    {
+    case VALUE_TYPE_UINT8:
+        return sizeof(uint8_t);
+    case VALUE_TYPE_UINT16:
+        return sizeof(uint16_t);
+    case VALUE_TYPE_INT32:
+    case VALUE_TYPE_UINT32:
+    case VALUE_TYPE_FLOAT:
+        return sizeof(uint32_t);
+    case VALUE_TYPE_INT64:
+        return sizeof(int64_t);
+    default:
+        return 0;
+    }
+}
+
+static bool persistence_type_is_variable(persistence_value_type_t type)
+{
+    return type == VALUE_TYPE_STRING || type == VALUE_TYPE_BLOB;
+}
+
+static const void *persistence_entry_value(const persistence_entry_t *entry)
+{
+    return persistence_type_is_variable(entry->type) ? entry->value.data : entry->value.bytes;
+}
+
+static void persistence_entry_clear(persistence_entry_t *entry)
+{
+    if (persistence_type_is_variable(entry->type))
+    {
+        free(entry->value.data);
+    }
+    memset(entry, 0, sizeof(*entry));
+}
+
+static esp_err_t persistence_nvs_write(const persistence_entry_t *entry)
+{
+    const void *value = persistence_entry_value(entry);
+    switch (entry->type)
+    {
+    case VALUE_TYPE_STRING:
+        return nvs_set_str(persistence_handle, entry->key, value);
+    case VALUE_TYPE_BLOB:
+        return nvs_set_blob(persistence_handle, entry->key, value, entry->len);
+    case VALUE_TYPE_UINT8:
+        return nvs_set_u8(persistence_handle, entry->key, *(const uint8_t *)value);
+    case VALUE_TYPE_UINT16:
+        return nvs_set_u16(persistence_handle, entry->key, *(const uint16_t *)value);
+    case VALUE_TYPE_INT32:
+        return nvs_set_i32(persistence_handle, entry->key, *(const int32_t *)value);
+    case VALUE_TYPE_UINT32:
+    case VALUE_TYPE_FLOAT:
+        return nvs_set_u32(persistence_handle, entry->key, *(const uint32_t *)value);
+    case VALUE_TYPE_INT64:
+        return nvs_set_i64(persistence_handle, entry->key, *(const int64_t *)value);
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+}
+
+/// Reads the key into a cleared entry of the given type.
+static esp_err_t persistence_nvs_read(persistence_entry_t *entry)
+{
+    void *value = entry->value.bytes;
+    entry->len = persistence_type_size(entry->type);
+
+    switch (entry->type)
+    {
+    case VALUE_TYPE_STRING:
+    case VALUE_TYPE_BLOB: {
+        bool is_string = entry->type == VALUE_TYPE_STRING;
+        esp_err_t err = is_string ? nvs_get_str(persistence_handle, entry->key, NULL, &entry->len)
+                                  : nvs_get_blob(persistence_handle, entry->key, NULL, &entry->len);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        entry->value.data = malloc(entry->len > 0 ? entry->len : 1);
+        if (entry->value.data == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        return is_string ? nvs_get_str(persistence_handle, entry->key, entry->value.data, &entry->len)
+                         : nvs_get_blob(persistence_handle, entry->key, entry->value.data, &entry->len);
+    }
+    case VALUE_TYPE_UINT8:
+        return nvs_get_u8(persistence_handle, entry->key, value);
+    case VALUE_TYPE_UINT16:
+        return nvs_get_u16(persistence_handle, entry->key, value);
+    case VALUE_TYPE_INT32:
+        return nvs_get_i32(persistence_handle, entry->key, value);
+    case VALUE_TYPE_UINT32:
+    case VALUE_TYPE_FLOAT:
+        return nvs_get_u32(persistence_handle, entry->key, value);
+    case VALUE_TYPE_INT64:
+        return nvs_get_i64(persistence_handle, entry->key, value);
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+}
+
+/// Writes every dirty entry and commits them at once. The entries stay cached. Called with
+/// persistence_mutex held.
+static void persistence_flush_locked(void)
+{
+    uint32_t started = latency_now();
+    int written = 0;
+
+    for (int i = 0; i < PERSISTENCE_CACHE_SIZE; i++)
+    {
+        persistence_entry_t *entry = &persistence_cache[i];
+        if (!entry->dirty)
+        {
+            continue;
+        }
+
+        esp_err_t err = persistence_nvs_write(entry);
+        if (err != ESP_OK)
+        {
+            // Drop it, the cache must not claim a value NVS does not have
+            ESP_LOGE(TAG, "Error saving key %s: %s", entry->key, esp_err_to_name(err));
+            persistence_entry_clear(entry);
+        }
+        else
+        {
+            entry->dirty = false;
+            written++;
+        }
+    }
+
+    if (written > 0)
+    {
+        esp_err_t err = nvs_commit(persistence_handle);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error committing %d keys: %s", written, esp_err_to_name(err));
+        }
+        latency_since(LATENCY_PERSIST_COMMIT, started);
+    }
+}
+
+/// Commits in its own task, NVS writes must not hold up the other esp_timer callbacks.
+static void persistence_task_fn(void *args)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (xSemaphoreTake(persistence_mutex, portMAX_DELAY) == pdTRUE)
+        {
+            persistence_flush_locked();
+            xSemaphoreGive(persistence_mutex);
+        }
+    }
+}
+
+static void persistence_timer_cb(void *arg)
+{
+    if (persistence_task != NULL)
+    {
+        xTaskNotifyGive(persistence_task);
+    }
+}
 
 void persistence_init(const char *namespace_name)
 {
@@ -28,87 +227,320 @@ void persistence_init(const char *namespace_name)
     {
         ESP_LOGE(TAG, "Failed to create mutex");
     }
+    if (xTaskCreate(persistence_task_fn, "persistence", configMINIMAL_STACK_SIZE * 3, NULL, 1, &persistence_task) !=
+        pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start persistence task");
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = persistence_timer_cb,
+        .name = "persistence",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &persistence_timer));
+    ESP_ERROR_CHECK(esp_register_shutdown_handler(persistence_flush));
 }
 
-void persistence_save(persistence_value_type_t value_type, const char *key, const void *value)
+/// Returns the cache entry of the key, or if `allocate` is set a free or evicted one. Dirty entries
+/// are never evicted; if every entry is dirty they are committed first. Called with persistence_mutex held.
+static persistence_entry_t *persistence_cache_get(const char *key, bool allocate)
+{
+    persistence_entry_t *victim = NULL;
+    for (int i = 0; i < PERSISTENCE_CACHE_SIZE; i++)
+    {
+        persistence_entry_t *entry = &persistence_cache[i];
+        if (entry->used && strcmp(entry->key, key) == 0)
+        {
+            entry->last_used = ++persistence_use_clock;
+            return entry;
+        }
+        if (!entry->dirty && (victim == NULL || !entry->used ||
+                              (victim->used && entry->last_used < victim->last_used)))
+        {
+            victim = entry;
+        }
+    }
+
+    if (!allocate)
+    {
+        return NULL;
+    }
+    if (victim == NULL)
+    {
+        // Too many distinct keys in one burst, commit them to make room
+        persistence_flush_locked();
+        victim = &persistence_cache[0];
+    }
+
+    persistence_entry_clear(victim);
+    victim->used = true;
+    strcpy(victim->key, key);
+    victim->last_used = ++persistence_use_clock;
+    return victim;
+}
+
+/// Stores a value in the cache and arms the commit timer. Called with persistence_mutex held.
+static esp_err_t persistence_save_locked(persistence_value_type_t value_type, const char *key, const void *value,
+                                         size_t len)
+{
+    void *data = NULL;
+    if (persistence_type_is_variable(value_type))
+    {
+        data = malloc(len > 0 ? len : 1);
+        if (data == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(data, value, len);
+    }
+
+    persistence_entry_t *entry = persistence_cache_get(key, true);
+    if (persistence_type_is_variable(entry->type))
+    {
+        free(entry->value.data);
+    }
+    entry->dirty = true;
+    entry->found = true;
+    entry->type = value_type;
+    entry->len = len;
+    if (data != NULL)
+    {
+        entry->value.data = data;
+    }
+    else
+    {
+        memcpy(entry->value.bytes, value, len);
+    }
+
+    if (CONFIG_WLED_PERSISTENCE_COMMIT_DELAY_MS == 0)
+    {
+        persistence_flush_locked();
+    }
+    else if (!esp_timer_is_active(persistence_timer))
+    {
+        // Armed by the first uncommitted write only, so a steady stream still commits regularly
+        esp_timer_start_once(persistence_timer, CONFIG_WLED_PERSISTENCE_COMMIT_DELAY_MS * 1000ULL);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t persistence_save_value(persistence_value_type_t value_type, const char *key, const void *value,
+                                        size_t len)
 {
+    if (key == NULL || value == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+    {
+        ESP_LOGE(TAG, "Invalid key");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t started = latency_now();
+    esp_err_t err = ESP_ERR_INVALID_STATE;
     if (persistence_mutex != NULL)
     {
         if (xSemaphoreTake(persistence_mutex, portMAX_DELAY) == pdTRUE)
         {
-            esp_err_t err = ESP_ERR_INVALID_ARG;
+            err = persistence_save_locked(value_type, key, value, len);
+            xSemaphoreGive(persistence_mutex);
+        }
+    }
+    latency_since(LATENCY_PERSIST_SAVE, started);
 
-            switch (value_type)
-            {
-            case VALUE_TYPE_STRING:
-                err = nvs_set_str(persistence_handle, key, (char *)value);
-                break;
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving key %s: %s", key, esp_err_to_name(err));
+    }
+    return err;
+}
 
-            case VALUE_TYPE_INT32:
-                err = nvs_set_i32(persistence_handle, key, *(int32_t *)value);
-                break;
+void persistence_save(persistence_value_type_t value_type, const char *key, const void *value)
+{
+    size_t len = persistence_type_size(value_type);
+    if (value_type == VALUE_TYPE_STRING && value != NULL)
+    {
+        len = strlen((const char *)value) + 1;
+    }
+    else if (len == 0)
+    {
+        ESP_LOGE(TAG, "Unsupported value type");
+        return;
+    }
+    persistence_save_value(value_type, key, value, len);
+}
 
-            default:
-                ESP_LOGE(TAG, "Unsupported value type");
-                break;
-            }
+esp_err_t persistence_save_blob(const char *key, const void *data, size_t len)
+{
+    return persistence_save_value(VALUE_TYPE_BLOB, key, data, len);
+}
 
-            if (err == ESP_OK)
-            {
-                ESP_ERROR_CHECK(nvs_commit(persistence_handle));
-            }
-            else
-            {
-                ESP_LOGE(TAG, "Error saving key %s: %s", key, esp_err_to_name(err));
-            }
+/// Serves a load from the cache, reading NVS on a miss. Called with persistence_mutex held.
+static esp_err_t persistence_load_locked(persistence_value_type_t value_type, const char *key, void *out, size_t *len)
+{
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE || (persistence_type_is_variable(value_type) && len == NULL))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-            xSemaphoreGive(persistence_mutex);
+    persistence_entry_t *entry = persistence_cache_get(key, false);
+    if (entry != NULL && entry->type != value_type && !entry->dirty)
+    {
+        // Cached under another type, ask NVS again
+        persistence_entry_clear(entry);
+        entry = NULL;
+    }
+    if (entry == NULL)
+    {
+        entry = persistence_cache_get(key, true);
+        entry->type = value_type;
+        esp_err_t err = persistence_nvs_read(entry);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            entry->found = false;
+        }
+        else if (err != ESP_OK)
+        {
+            persistence_entry_clear(entry);
+            return err;
+        }
+        else
+        {
+            entry->found = true;
+        }
+    }
+
+    if (!entry->found)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (entry->type != value_type)
+    {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+
+    if (len != NULL)
+    {
+        size_t capacity = *len;
+        *len = entry->len;
+        if (out == NULL)
+        {
+            return ESP_OK;
+        }
+        if (capacity < entry->len)
+        {
+            return ESP_ERR_NVS_INVALID_LENGTH;
         }
     }
+    memcpy(out, persistence_entry_value(entry), entry->len);
+    return ESP_OK;
 }
 
-void *persistence_load(persistence_value_type_t value_type, const char *key, void *out)
+esp_err_t persistence_load_value(persistence_value_type_t value_type, const char *key, void *out, size_t *len)
 {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
     if (persistence_mutex != NULL)
     {
         if (xSemaphoreTake(persistence_mutex, portMAX_DELAY) == pdTRUE)
         {
-            esp_err_t err = ESP_ERR_INVALID_ARG;
-
-            switch (value_type)
-            {
-            case VALUE_TYPE_STRING:
-                err = nvs_get_str(persistence_handle, key, (char *)out, NULL);
-                break;
+            err = persistence_load_locked(value_type, key, out, len);
+            xSemaphoreGive(persistence_mutex);
+        }
+    }
+    return err;
+}
 
-            case VALUE_TYPE_INT32:
-                err = nvs_get_i32(persistence_handle, key, (int32_t *)out);
-                break;
+void *persistence_load(persistence_value_type_t value_type, const char *key, void *out)
+{
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    if (persistence_type_is_variable(value_type))
+    {
+        ESP_LOGE(TAG, "Strings and blobs need persistence_load_value");
+    }
+    else
+    {
+        err = persistence_load_value(value_type, key, out, NULL);
+    }
 
-            default:
-                ESP_LOGE(TAG, "Unsupported value type");
-                break;
-            }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error loading key %s: %s", key, esp_err_to_name(err));
+    }
+    return out;
+}
 
-            if (err != ESP_OK)
+size_t persistence_load_many(persistence_item_t *items, size_t count)
+{
+    size_t loaded = 0;
+    if (persistence_mutex != NULL)
+    {
+        if (xSemaphoreTake(persistence_mutex, portMAX_DELAY) == pdTRUE)
+        {
+            for (size_t i = 0; i < count; i++)
             {
-                ESP_LOGE(TAG, "Error loading key %s: %s", key, esp_err_to_name(err));
+                persistence_item_t *item = &items[i];
+                size_t fixed_size = persistence_type_size(item->type);
+                if (fixed_size != 0 && item->size != fixed_size)
+                {
+                    item->err = ESP_ERR_INVALID_SIZE;
+                }
+                else
+                {
+                    item->err = persistence_load_locked(item->type, item->key, item->out,
+                                                        fixed_size != 0 ? NULL : &item->size);
+                }
+                if (item->err == ESP_OK)
+                {
+                    loaded++;
+                }
             }
-
             xSemaphoreGive(persistence_mutex);
         }
     }
+    return loaded;
+}
 
-    return out;
+void persistence_flush(void)
+{
+    if (persistence_mutex == NULL)
+    {
+        return;
+    }
+
+    esp_timer_stop(persistence_timer);
+    if (xSemaphoreTake(persistence_mutex, portMAX_DELAY) == pdTRUE)
+    {
+        persistence_flush_locked();
+        xSemaphoreGive(persistence_mutex);
+    }
 }
 
 void persistence_deinit()
 {
+    persistence_flush();
+    esp_unregister_shutdown_handler(persistence_flush);
+
+    if (persistence_timer != NULL)
+    {
+        esp_timer_delete(persistence_timer);
+        persistence_timer = NULL;
+    }
+
     if (persistence_mutex != NULL)
     {
+        // Holding the mutex, the task can only be waiting for a notification
+        xSemaphoreTake(persistence_mutex, portMAX_DELAY);
+        if (persistence_task != NULL)
+        {
+            vTaskDelete(persistence_task);
+            persistence_task = NULL;
+        }
+        xSemaphoreGive(persistence_mutex);
         vSemaphoreDelete(persistence_mutex);
         persistence_mutex = NULL;
     }
 
+    for (int i = 0; i < PERSISTENCE_CACHE_SIZE; i++)
+    {
+        persistence_entry_clear(&persistence_cache[i]);
+    }
+
     nvs_close(persistence_handle);
 }
@@ -0,0 +1,285 @@
+#include "ble_link.h"
+
+#include "esp_log.h"
+#include "nimble/nimble_port.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+static const char *TAG = "ble_link";
+
+// Fast parameters while a client sends, 7.5..15 ms interval
+#define LINK_FAST_ITVL_MIN 6
+#define LINK_FAST_ITVL_MAX 12
+#define LINK_FAST_LATENCY 0
+
+// Relaxed parameters when idle, 100..200 ms interval and up to 4 skipped events
+#define LINK_IDLE_ITVL_MIN 80
+#define LINK_IDLE_ITVL_MAX 160
+#define LINK_IDLE_LATENCY 4
+
+#define LINK_SUPERVISION_TIMEOUT 400 // 4 s, must exceed (1 + latency) * interval * 2
+
+// Largest link layer payload and the time it takes on the 1M PHY
+#define LINK_TX_OCTETS 251
+#define LINK_TX_TIME 2120
+
+typedef struct
+{
+    bool used;
+    uint16_t conn_handle;
+    ble_link_info_t info;
+    struct ble_npl_callout idle;
+} ble_link_t;
+
+static ble_link_t s_links[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+static ble_link_t *ble_link_find(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (s_links[i].used && s_links[i].conn_handle == conn_handle)
+        {
+            return &s_links[i];
+        }
+    }
+    return NULL;
+}
+
+static void ble_link_request_params(ble_link_t *link, bool fast)
+{
+    struct ble_gap_upd_params params = {
+        .itvl_min = fast ? LINK_FAST_ITVL_MIN : LINK_IDLE_ITVL_MIN,
+        .itvl_max = fast ? LINK_FAST_ITVL_MAX : LINK_IDLE_ITVL_MAX,
+        .latency = fast ? LINK_FAST_LATENCY : LINK_IDLE_LATENCY,
+        .supervision_timeout = LINK_SUPERVISION_TIMEOUT,
+    };
+    int rc = ble_gap_update_params(link->conn_handle, &params);
+    if (rc != 0 && rc != BLE_HS_EALREADY)
+    {
+        ESP_LOGW(TAG, "conn %u: %s parameter request failed (%d)", link->conn_handle, fast ? "fast" : "idle", rc);
+        return;
+    }
+    link->info.fast = fast;
+}
+
+static void ble_link_idle(struct ble_npl_event *ev)
+{
+    ble_link_t *link = ble_npl_event_get_arg(ev);
+    if (link->used && link->info.fast)
+    {
+        ESP_LOGI(TAG, "conn %u: idle, relaxing connection parameters", link->conn_handle);
+        ble_link_request_params(link, false);
+    }
+}
+
+static int ble_link_mtu_exchanged(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t mtu, void *arg)
+{
+    if (error->status != 0)
+    {
+        ESP_LOGW(TAG, "conn %u: MTU exchange failed (%d)", conn_handle, error->status);
+    }
+    return 0;
+}
+
+/// Refreshes interval, latency and timeout from the host.
+static void ble_link_update_params(ble_link_t *link)
+{
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(link->conn_handle, &desc) == 0)
+    {
+        link->info.interval = desc.conn_itvl;
+        link->info.latency = desc.conn_latency;
+        link->info.timeout = desc.supervision_timeout;
+        ESP_LOGI(TAG, "conn %u: interval %u.%02u ms, latency %u, timeout %u ms", link->conn_handle,
+                 desc.conn_itvl * 125 / 100, desc.conn_itvl * 125 % 100, desc.conn_latency,
+                 desc.supervision_timeout * 10);
+    }
+}
+
+int ble_link_slot(uint16_t conn_handle)
+{
+    ble_link_t *link = ble_link_find(conn_handle);
+    return link != NULL ? link - s_links : -1;
+}
+
+int ble_link_count(void)
+{
+    int count = 0;
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        count += s_links[i].used;
+    }
+    return count;
+}
+
+void ble_link_init(void)
+{
+    int rc = ble_att_set_preferred_mtu(CONFIG_WLED_BLE_PREFERRED_MTU);
+    if (rc != 0)
+    {
+        ESP_LOGE(TAG, "Failed to set preferred MTU %u (%d)", CONFIG_WLED_BLE_PREFERRED_MTU, rc);
+    }
+}
+
+void ble_link_connected(uint16_t conn_handle)
+{
+    ble_link_t *link = ble_link_find(conn_handle);
+    for (int i = 0; link == NULL && i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!s_links[i].used)
+        {
+            link = &s_links[i];
+            ble_npl_callout_init(&link->idle, nimble_port_get_dflt_eventq(), ble_link_idle, link);
+        }
+    }
+    if (link == NULL)
+    {
+        return;
+    }
+
+    link->used = true;
+    link->conn_handle = conn_handle;
+    memset(&link->info, 0, sizeof(link->info));
+    link->info.mtu = ble_att_mtu(conn_handle);
+    link->info.tx_octets = 27;
+    link->info.tx_phy = link->info.rx_phy = BLE_HCI_LE_PHY_1M;
+    ble_link_update_params(link);
+
+    // Every request is a hint, the central may refuse any of them and the link keeps working
+    int rc = ble_gattc_exchange_mtu(conn_handle, ble_link_mtu_exchanged, NULL);
+    if (rc != 0)
+    {
+        ESP_LOGW(TAG, "conn %u: MTU exchange not started (%d)", conn_handle, rc);
+    }
+    rc = ble_gap_set_data_len(conn_handle, LINK_TX_OCTETS, LINK_TX_TIME);
+    if (rc != 0)
+    {
+        ESP_LOGW(TAG, "conn %u: data length extension not requested (%d)", conn_handle, rc);
+    }
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc != 0)
+    {
+        ESP_LOGW(TAG, "conn %u: 2M PHY not requested (%d)", conn_handle, rc);
+    }
+#endif
+    ble_link_activity(conn_handle);
+}
+
+void ble_link_disconnected(uint16_t conn_handle)
+{
+    ble_link_t *link = ble_link_find(conn_handle);
+    if (link != NULL)
+    {
+        ble_npl_callout_stop(&link->idle);
+        link->used = false;
+    }
+}
+
+bool ble_link_gap_event(struct ble_gap_event *event)
+{
+    ble_link_t *link;
+    switch (event->type)
+    {
+    case BLE_GAP_EVENT_MTU:
+        link = ble_link_find(event->mtu.conn_handle);
+        ESP_LOGI(TAG, "conn %u: MTU %u", event->mtu.conn_handle, event->mtu.value);
+        if (link != NULL)
+        {
+            link->info.mtu = event->mtu.value;
+        }
+        return true;
+
+    case BLE_GAP_EVENT_CONN_UPDATE:
+        link = ble_link_find(event->conn_update.conn_handle);
+        if (link != NULL && event->conn_update.status == 0)
+        {
+            ble_link_update_params(link);
+        }
+        return true;
+
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        link = ble_link_find(event->phy_updated.conn_handle);
+        ESP_LOGI(TAG, "conn %u: PHY tx %u rx %u (status %d)", event->phy_updated.conn_handle,
+                 event->phy_updated.tx_phy, event->phy_updated.rx_phy, event->phy_updated.status);
+        if (link != NULL && event->phy_updated.status == 0)
+        {
+            link->info.tx_phy = event->phy_updated.tx_phy;
+            link->info.rx_phy = event->phy_updated.rx_phy;
+        }
+        return true;
+
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        link = ble_link_find(event->data_len_chg.conn_handle);
+        ESP_LOGI(TAG, "conn %u: data length tx %u rx %u octets", event->data_len_chg.conn_handle,
+                 event->data_len_chg.max_tx_octets, event->data_len_chg.max_rx_octets);
+        if (link != NULL)
+        {
+            link->info.tx_octets = event->data_len_chg.max_tx_octets;
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void ble_link_activity(uint16_t conn_handle)
+{
+    ble_link_t *link = ble_link_find(conn_handle);
+    if (link == NULL)
+    {
+        return;
+    }
+
+    if (!link->info.fast)
+    {
+        ble_link_request_params(link, true);
+    }
+    ble_npl_callout_reset(&link->idle, ble_npl_time_ms_to_ticks32(CONFIG_WLED_BLE_IDLE_TIMEOUT_MS));
+}
+
+bool ble_link_get_info(uint16_t conn_handle, ble_link_info_t *info)
+{
+    ble_link_t *link = ble_link_find(conn_handle);
+    if (link == NULL)
+    {
+        return false;
+    }
+    *info = link->info;
+    return true;
+}
+
+static inline void put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+int ble_link_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    ble_link_info_t info;
+    if (!ble_link_get_info(conn_handle, &info))
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    uint8_t data[12];
+    put_u16(&data[0], info.mtu);
+    put_u16(&data[2], info.interval);
+    put_u16(&data[4], info.latency);
+    put_u16(&data[6], info.timeout);
+    put_u16(&data[8], info.tx_octets);
+    data[10] = info.tx_phy;
+    data[11] = info.rx_phy;
+    return os_mbuf_append(ctxt->om, data, sizeof(data)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+int ble_link_char_a003_user_desc(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt,
+                                 void *arg)
+{
+    const char *desc = "Link Parameters";
+    os_mbuf_append(ctxt->om, desc, strlen(desc));
+    return 0;
+}
@@ -1,73 +1,144 @@
+#include "assets.h"
+#include "ble_link.h"
 #include "capability_service.h"
+#include "capability_table.h"
 #include "esp_log.h"
 #include "storage.h"
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>           // For malloc, free
 #include "host/ble_hs.h"      // For ble_hs_mbuf_from_flat, ble_att_mtu
 #include "host/ble_uuid.h"    // For BLE_ATT_MTU_DFLT (often included via ble_hs.h)
-#include "nimble/nimble_port.h" // For os_mbuf related functions
+#include "nimble/nimble_port.h" // For os_mbuf related functions, nimble_port_get_dflt_eventq
+#include "sdkconfig.h"
 
 static const char *TAG_CS = "capability_service";
 
-#define CAPA_READ_CHUNK_SIZE 200 // Maximale Bytes pro Lesevorgang aus dem Storage
+#define CAPA_NOTIFY_RETRY_MS 20 // Wartezeit, wenn der Host keine Puffer frei hat
+#define CAPA_FILENAME "/storage/capability.json"
+#define CAPA_ASSET_NAME "capability.json"
 
-int capa_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+/// Capability document, either mapped from the asset image or loaded once from storage. The buffer is
+/// never modified; invalidation only drops the reference and the next access loads a new one with a
+/// new version.
+typedef struct
+{
+    const char *data;
+    size_t len;
+    uint32_t version;
+    bool mapped; ///< Points into the asset image and must not be freed
+} capa_document_t;
+
+static capa_document_t s_document;
+static uint32_t s_document_version;
+
+static esp_err_t capa_document_load(void)
 {
-    esp_err_t storage_status = storage_init();
-    if (storage_status != ESP_OK)
+    // Zero copy: the asset image is mapped through the flash cache and stays mapped
+    const void *asset;
+    size_t asset_size;
+    if (assets_init() == ESP_OK && assets_find(CAPA_ASSET_NAME, &asset, &asset_size) == ESP_OK)
     {
-        ESP_LOGE(TAG_CS, "Failed to initialize storage: %s", esp_err_to_name(storage_status));
-        const char *err_msg = "Error: Storage init failed";
-        os_mbuf_append(ctxt->om, err_msg, strlen(err_msg));
-        // storage_uninit() sollte hier nicht aufgerufen werden, da die Initialisierung fehlschlug.
-        return 0;
+        s_document.data = asset;
+        s_document.len = asset_size;
+        s_document.mapped = true;
+        s_document.version = ++s_document_version;
+        ESP_LOGI(TAG_CS, "Mapped %s (%zu bytes, version %lu)", CAPA_ASSET_NAME, s_document.len,
+                 (unsigned long)s_document.version);
+        return ESP_OK;
     }
 
-    char *content = "";
-    os_mbuf_append(ctxt->om, content, strlen(content));
-    const char *filename = "/storage/capability.json"; // Die zu lesende Datei
-    char read_buffer[CAPA_READ_CHUNK_SIZE];
-    ssize_t bytes_read;
-    int os_err;
+    storage_handle_t handle;
+    esp_err_t ret = storage_open(CAPA_FILENAME, &handle);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG_CS, "Failed to open %s: %s", CAPA_FILENAME, esp_err_to_name(ret));
+        return ret;
+    }
+
+    // One sequential pass over the file, every later read is served from RAM
+    ssize_t size = storage_size(handle);
+    char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL)
+    {
+        ESP_LOGE(TAG_CS, "Failed to allocate %ld bytes for %s", (long)size, CAPA_FILENAME);
+        ret = ESP_ERR_NO_MEM;
+    }
+    else if (size > 0 && storage_pread(handle, data, size, 0) != size)
+    {
+        ESP_LOGE(TAG_CS, "Failed to read %s", CAPA_FILENAME);
+        free(data);
+        ret = ESP_FAIL;
+    }
+    storage_close(handle);
 
-    ESP_LOGI(TAG_CS, "Reading capabilities from %s", filename);
+    if (ret == ESP_OK)
+    {
+        s_document.data = data;
+        s_document.len = size;
+        s_document.mapped = false;
+        s_document.version = ++s_document_version;
+        ESP_LOGI(TAG_CS, "Cached %s (%zu bytes, version %lu)", CAPA_FILENAME, s_document.len,
+                 (unsigned long)s_document.version);
+    }
+    return ret;
+}
 
-    // Schleife, um die Datei in Chunks zu lesen und an den mbuf anzuhängen
-    while ((bytes_read = storage_read(filename, read_buffer, sizeof(read_buffer))) > 0)
+/// Returns the cached capability document, loading it on first use. Only called from the host task.
+static const capa_document_t *capa_document_get(void)
+{
+    if (s_document.data == NULL && capa_document_load() != ESP_OK)
     {
-        ESP_LOGD(TAG_CS, "Read %zd bytes from storage", bytes_read);
-        // Den gelesenen Chunk an den BLE-Antwortpuffer anhängen
-        os_err = os_mbuf_append(ctxt->om, read_buffer, bytes_read);
-        if (os_err != 0)
-        {
-            ESP_LOGE(TAG_CS, "Failed to append to mbuf (error %d). May be out of space.", os_err);
-            // Der mbuf könnte voll sein. Stoppe das Anhängen.
-            // Bereits angehängte Daten werden gesendet.
-            break;
-        }
+        return NULL;
     }
+    return &s_document;
+}
 
-    // Fehlerbehandlung oder EOF
-    if (bytes_read < 0)
+void capa_document_invalidate(void)
+{
+    if (!s_document.mapped)
     {
-        ESP_LOGE(TAG_CS, "Error reading from storage (file: %s, error_code: %zd)", filename, bytes_read);
-        // Wenn noch nichts angehängt wurde, sende eine Fehlermeldung.
-        if (ctxt->om->om_len == 0)
-        {
-            const char *err_msg = "Error: Failed to read capability data";
-            // Hier könnten spezifischere Fehlermeldungen basierend auf bytes_read eingefügt werden
-            os_mbuf_append(ctxt->om, err_msg, strlen(err_msg));
-        }
+        free((char *)s_document.data);
     }
-    else
-    { // bytes_read == 0, bedeutet EOF (Ende der Datei)
-        ESP_LOGI(TAG_CS, "Successfully read and appended all data from %s to mbuf.", filename);
+    s_document.data = NULL;
+    s_document.len = 0;
+}
+
+int capa_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const capa_document_t *document = capa_document_get();
+    if (document == NULL)
+    {
+        const char *err_msg = "Error: Failed to read capability data";
+        os_mbuf_append(ctxt->om, err_msg, strlen(err_msg));
+        return 0;
     }
 
-    storage_uninit();
+    // The access callback always supplies the complete value. For a Read Blob request NimBLE
+    // copies the window starting at the requested offset out of it (ble_gatts_val_access), so every
+    // part of a long read comes from the same RAM snapshot and none of them touches the flash.
+    int os_err = os_mbuf_append(ctxt->om, document->data, document->len);
+    if (os_err != 0)
+    {
+        ESP_LOGE(TAG_CS, "Failed to append to mbuf (error %d). May be out of space.", os_err);
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
     return 0;
 }
 
+const capa_entry_t *capa_table_get(size_t *count)
+{
+    *count = CAPA_COUNT;
+    return capa_table;
+}
+
+int capa_binary_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    // Compiled into flash at build time, served without storage access
+    int os_err = os_mbuf_append(ctxt->om, capa_binary, sizeof(capa_binary));
+    return os_err == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
 int capa_char_1979_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     const char *desc = "Capabilities of the device";
@@ -75,82 +146,156 @@ int capa_char_1979_user_desc(uint16_t con_handle, uint16_t attr_handle, struct b
     return 0;
 }
 
-void capa_notify_data(uint16_t conn_handle, uint16_t char_val_handle)
+int capa_char_197a_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    esp_err_t storage_status = storage_init();
-    if (storage_status != ESP_OK)
-    {
-        ESP_LOGE(TAG_CS, "Notify: Failed to initialize storage: %s", esp_err_to_name(storage_status));
-        return;
-    }
+    const char *desc = "Capabilities of the device (binary)";
+    os_mbuf_append(ctxt->om, desc, strlen(desc));
+    return 0;
+}
+
+/// Per connection state of a notification transfer of the capability document
+typedef struct
+{
+    bool active;
+    uint16_t conn_handle;
+    uint16_t val_handle;
+    uint32_t version;
+    size_t offset;
+    struct ble_npl_callout retry;
+} capa_transfer_t;
 
-    const char *filename = "/storage/capability.json";
+static capa_transfer_t s_transfers[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
 
-    uint16_t mtu = ble_att_mtu(conn_handle);
-    if (mtu == 0) { // Should not happen for an active connection, fallback
-        ESP_LOGW(TAG_CS, "Notify: ble_att_mtu returned 0, using default MTU %d.", BLE_ATT_MTU_DFLT);
-        mtu = BLE_ATT_MTU_DFLT;
+static capa_transfer_t *capa_transfer_find(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (s_transfers[i].active && s_transfers[i].conn_handle == conn_handle)
+        {
+            return &s_transfers[i];
+        }
     }
+    return NULL;
+}
 
-    // Max payload for notification is MTU - 3 (1 byte opcode for Notification, 2 bytes attribute handle)
-    size_t notify_chunk_size = (mtu > 3) ? (mtu - 3) : (BLE_ATT_MTU_DFLT - 3); // Ensure mtu > 3
+static void capa_transfer_finish(capa_transfer_t *transfer)
+{
+    ble_npl_callout_stop(&transfer->retry);
+    transfer->active = false;
+}
 
-    // Further cap by CAPA_READ_CHUNK_SIZE if it's smaller and meant as an upper limit for any single read op
-    if (notify_chunk_size > CAPA_READ_CHUNK_SIZE) {
-        notify_chunk_size = CAPA_READ_CHUNK_SIZE;
+/// Sends as many chunks as the host will take and returns. Once the host runs out of buffers the
+/// transfer resumes from the retry callout. NimBLE reports BLE_GAP_EVENT_NOTIFY_TX from inside
+/// ble_gatts_notify_custom(), for a failed notification as well, so that event never signals that
+/// a buffer was freed later and cannot drive the transfer.
+static void capa_transfer_pump(capa_transfer_t *transfer)
+{
+    const capa_document_t *document = capa_document_get();
+    if (document == NULL)
+    {
+        ESP_LOGE(TAG_CS, "Notify: No capability data available");
+        capa_transfer_finish(transfer);
+        return;
     }
 
-    if (notify_chunk_size == 0) { // Safety check
-        ESP_LOGE(TAG_CS, "Notify: Calculated notify_chunk_size is 0. Aborting.");
-        storage_uninit();
-        return;
+    // A document replaced mid-transfer is sent again from the start so the client never mixes versions
+    if (transfer->version != document->version)
+    {
+        transfer->version = document->version;
+        transfer->offset = 0;
     }
 
-    char *read_buffer = malloc(notify_chunk_size);
-    if (!read_buffer)
+    uint16_t mtu = ble_att_mtu(transfer->conn_handle);
+    if (mtu == 0)
     {
-        ESP_LOGE(TAG_CS, "Notify: Failed to allocate read_buffer (%zu bytes)", notify_chunk_size);
-        storage_uninit();
+        // Connection is gone, the disconnect event cleans up
+        capa_transfer_finish(transfer);
         return;
     }
 
-    ESP_LOGI(TAG_CS, "Notify: Reading capabilities from %s to notify conn %u, attr %u (chunk size %zu, MTU %u)",
-             filename, conn_handle, char_val_handle, notify_chunk_size, mtu);
+    // Max payload for notification is MTU - 3 (1 byte opcode for Notification, 2 bytes attribute handle)
+    size_t notify_chunk_size = (mtu > 3) ? (mtu - 3) : (BLE_ATT_MTU_DFLT - 3);
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
+    while (transfer->offset < document->len)
     {
-        ESP_LOGE(TAG_CS, "Notify: Failed to open %s for reading.", filename);
-        free(read_buffer);
-        storage_uninit();
-        return;
+        size_t chunk = document->len - transfer->offset;
+        if (chunk > notify_chunk_size)
+        {
+            chunk = notify_chunk_size;
+        }
+
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(document->data + transfer->offset, chunk);
+        int rc = om != NULL ? ble_gatts_notify_custom(transfer->conn_handle, transfer->val_handle, om) : BLE_HS_ENOMEM;
+        if (rc == BLE_HS_ENOMEM)
+        {
+            // Host buffers are full, try again once the controller had time to send some
+            ble_npl_callout_reset(&transfer->retry, ble_npl_time_ms_to_ticks32(CAPA_NOTIFY_RETRY_MS));
+            break;
+        }
+        if (rc != 0)
+        {
+            ESP_LOGE(TAG_CS, "Notify: Error sending notification (rc=%d). Stopping.", rc);
+            capa_transfer_finish(transfer);
+            break;
+        }
+
+        transfer->offset += chunk;
     }
 
-    ssize_t bytes_read;
-    while ((bytes_read = fread(read_buffer, 1, notify_chunk_size, fp)) > 0)
+    if (transfer->active && transfer->offset >= document->len)
     {
-        ESP_LOGD(TAG_CS, "Notify: Read %zd bytes from storage for notification", bytes_read);
+        ESP_LOGI(TAG_CS, "Notify: Finished sending %zu bytes of capability data to conn %u.", document->len,
+                 transfer->conn_handle);
+        capa_transfer_finish(transfer);
+    }
+}
 
-        struct os_mbuf *om = ble_hs_mbuf_from_flat(read_buffer, bytes_read);
-        if (!om) {
-            ESP_LOGE(TAG_CS, "Notify: Failed to allocate mbuf for notification. Stopping.");
-            break; // Stop sending if mbuf allocation fails
-        }
+static void capa_transfer_retry(struct ble_npl_event *ev)
+{
+    capa_transfer_t *transfer = ble_npl_event_get_arg(ev);
+    if (transfer->active)
+    {
+        capa_transfer_pump(transfer);
+    }
+}
 
-        int rc = ble_gatts_notify_custom(conn_handle, char_val_handle, om);
-        if (rc != 0) {
-            ESP_LOGE(TAG_CS, "Notify: Error sending notification (rc=%d). Stopping.", rc);
-            // ble_gatts_notify_custom frees 'om' on success or if it takes ownership even on some errors.
-            // If it returns an error where 'om' is not freed, we might need os_mbuf_free_chain(om);
-            // For now, assume NimBLE handles 'om' correctly in error cases like BLE_HS_ENOMEM.
-            break; // Stop if notification fails
+void capa_notify_data(uint16_t conn_handle, uint16_t char_val_handle)
+{
+    capa_transfer_t *transfer = capa_transfer_find(conn_handle);
+    for (int i = 0; transfer == NULL && i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!s_transfers[i].active)
+        {
+            transfer = &s_transfers[i];
+            ble_npl_callout_init(&transfer->retry, nimble_port_get_dflt_eventq(), capa_transfer_retry, transfer);
         }
-        ESP_LOGD(TAG_CS, "Notify: Sent %zd bytes successfully.", bytes_read);
     }
+    if (transfer == NULL)
+    {
+        ESP_LOGE(TAG_CS, "Notify: No free transfer slot for conn %u", conn_handle);
+        return;
+    }
+
+    // A new subscription restarts a transfer that is still running
+    transfer->active = true;
+    transfer->conn_handle = conn_handle;
+    transfer->val_handle = char_val_handle;
+    transfer->version = 0;
+    transfer->offset = 0;
 
-    if (ferror(fp)) { ESP_LOGE(TAG_CS, "Notify: File read error from %s.", filename); }
-    fclose(fp);
-    free(read_buffer);
-    storage_uninit();
-    ESP_LOGI(TAG_CS, "Notify: Finished sending capability data for conn %u.", conn_handle);
+    // Bulk transfer, ask for the fast connection parameters while it runs
+    ble_link_activity(conn_handle);
+    ESP_LOGI(TAG_CS, "Notify: Streaming capabilities to conn %u, attr %u (MTU %u)", conn_handle, char_val_handle,
+             ble_att_mtu(conn_handle));
+    capa_transfer_pump(transfer);
+}
+
+void capa_notify_cancel(uint16_t conn_handle)
+{
+    capa_transfer_t *transfer = capa_transfer_find(conn_handle);
+    if (transfer != NULL)
+    {
+        ESP_LOGI(TAG_CS, "Notify: Cancelled transfer to conn %u at offset %zu.", conn_handle, transfer->offset);
+        capa_transfer_finish(transfer);
+    }
 }
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "host/ble_hs.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Negotiated parameters of a connection
+typedef struct
+{
+    uint16_t mtu;
+    uint16_t interval;   ///< Connection interval in 1.25 ms units
+    uint16_t latency;    ///< Peripheral latency in connection events
+    uint16_t timeout;    ///< Supervision timeout in 10 ms units
+    uint16_t tx_octets;  ///< Link layer payload per packet, 27 without data length extension
+    uint8_t tx_phy;      ///< BLE_HCI_LE_PHY_1M / _2M / _CODED
+    uint8_t rx_phy;
+    bool fast;           ///< Fast parameters requested, relaxed again after CONFIG_WLED_BLE_IDLE_TIMEOUT_MS
+} ble_link_info_t;
+
+/// Sets the preferred MTU and PHYs. Called once before the host starts.
+void ble_link_init(void);
+
+/// Requests a large MTU, data length extension, 2M PHY and fast connection parameters for a new connection.
+void ble_link_connected(uint16_t conn_handle);
+
+void ble_link_disconnected(uint16_t conn_handle);
+
+/// Tracks MTU, PHY, data length and connection parameter updates. Returns true if the event was one of them.
+bool ble_link_gap_event(struct ble_gap_event *event);
+
+/// Marks traffic on a connection. Switches back to fast parameters if the link had relaxed.
+void ble_link_activity(uint16_t conn_handle);
+
+/// Returns the slot of the connection, a small index below CONFIG_BT_NIMBLE_MAX_CONNECTIONS that stays
+/// the same while it is connected, or -1 if the connection is unknown.
+int ble_link_slot(uint16_t conn_handle);
+
+/// Returns the number of open connections.
+int ble_link_count(void);
+
+/// Returns false if the connection is unknown.
+bool ble_link_get_info(uint16_t conn_handle, ble_link_info_t *info);
+
+/// Link parameters of the reading connection: mtu u16, interval u16, latency u16, timeout u16,
+/// tx_octets u16, tx_phy u8, rx_phy u8
+int ble_link_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int ble_link_char_a003_user_desc(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt,
+                                 void *arg);
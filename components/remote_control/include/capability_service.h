@@ -3,9 +3,42 @@
 #include "host/ble_hs.h"
 #include <stdio.h>
 
+typedef enum
+{
+    CAPA_TYPE_TOGGLE = 0,
+    CAPA_TYPE_SLIDER = 1,
+    CAPA_TYPE_COLOR = 2,
+} capa_type_t;
+
+/// One entry of the capability table compiled from data/capability.json at build time
+typedef struct
+{
+    uint16_t id;
+    capa_type_t type;
+    int32_t default_value;
+    const char *label;
+} capa_entry_t;
+
+/// Returns the compiled capability table, no JSON is parsed at runtime.
+const capa_entry_t *capa_table_get(size_t *count);
+
 /// Service Characteristics Callback
 int capa_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+/// Starts streaming the capability document as notifications. Returns immediately, a transfer that
+/// runs out of host buffers continues from a callout on the host task and never blocks it.
 void capa_notify_data(uint16_t conn_handle, uint16_t char_val_handle);
 
+/// Stops a transfer, on unsubscribe or disconnect.
+void capa_notify_cancel(uint16_t conn_handle);
+
+/// Drops the cached capability document, call after capability.json was replaced on storage.
+/// The next read or subscription loads it again under a new version.
+void capa_document_invalidate(void);
+
+/// Compact binary capability document (TLV, see tools/gen_capability.py)
+int capa_binary_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
 /// Service Characteristics User Description
 int capa_char_1979_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int capa_char_197a_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
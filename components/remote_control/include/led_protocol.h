@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Binary command frames on the 0xDEAD characteristic
+///
+/// A frame starts with a header byte of LS_PROTOCOL_HEADER | version. The high bit is never set in
+/// the first byte of a text command, which keeps "LIGHT ON" and friends working next to it. The header
+/// is followed by any number of operations, each an opcode byte and an opcode specific payload of
+/// fixed length. Multi-byte values are little endian, colors are R, G, B.
+///
+/// | Opcode | Name        | Payload                                                                 |
+/// | ------ | ----------- | ----------------------------------------------------------------------- |
+/// | 0x00   | NOP         | -                                                                       |
+/// | 0x01   | FILL        | color[3]                                                                |
+/// | 0x02   | SET_RANGE   | start u16, count u16, color[3]                                          |
+/// | 0x03   | SET_PIXEL   | index u16, color[3]                                                     |
+/// | 0x04   | FADE_RANGE  | start u16, count u16, color[3], transition_ms u16                       |
+/// | 0x05   | EFFECT      | effect u8, start u16, count u16, color[3], color2[3], period_ms u16     |
+/// | 0x06   | STOP_EFFECT | start u16, count u16                                                    |
+/// | 0x07   | SCENE_SAVE  | scene u8, name[16] (NUL padded)                                         |
+/// | 0x08   | SCENE_RECALL| scene u8                                                                |
+/// | 0x09   | SET_STATE   | capability id u16, value i32                                            |
+///
+/// The whole frame is validated before anything is applied and committed as one LED frame. SET_STATE
+/// does not draw anything, it changes the capability state that is notified on 0xA000.
+
+#define LS_PROTOCOL_HEADER 0x80
+#define LS_PROTOCOL_VERSION 1
+
+typedef enum
+{
+    LS_OP_NOP = 0x00,
+    LS_OP_FILL = 0x01,
+    LS_OP_SET_RANGE = 0x02,
+    LS_OP_SET_PIXEL = 0x03,
+    LS_OP_FADE_RANGE = 0x04,
+    LS_OP_EFFECT = 0x05,
+    LS_OP_STOP_EFFECT = 0x06,
+    LS_OP_SCENE_SAVE = 0x07,
+    LS_OP_SCENE_RECALL = 0x08,
+    LS_OP_SET_STATE = 0x09,
+    LS_OP_COUNT,
+} ls_opcode_t;
+
+/// Returns true if the payload is a binary frame rather than a text command.
+static inline bool ls_protocol_is_binary(const uint8_t *data, size_t len)
+{
+    return len > 0 && (data[0] & LS_PROTOCOL_HEADER) != 0;
+}
+
+/// Validates a binary frame and queues it on the command queue of `source`, the slot of the writing
+/// connection. Returns 0 on success or a BLE_ATT_ERR_* code.
+int ls_protocol_dispatch(uint8_t source, const uint8_t *data, size_t len);
+
+/// Streamed frames on the 0xA002 characteristic (write without response)
+///
+/// A frame is split into fragments that each fit one write. Every fragment starts with
+///
+/// | Field    | Type | Meaning                                                         |
+/// | -------- | ---- | --------------------------------------------------------------- |
+/// | sequence | u16  | Frame number, increases by one per frame and wraps              |
+/// | fragment | u8   | Index of the fragment within the frame, starting at 0           |
+/// | flags    | u8   | LS_STREAM_FLAG_LAST on the final fragment, encoding in bits 1-2 |
+/// | start    | u16  | Index of the first pixel carried by this fragment               |
+///
+/// followed by the pixels in one of these encodings:
+///
+/// | Encoding | Payload                                                                             |
+/// | -------- | ----------------------------------------------------------------------------------- |
+/// | RAW      | Packed RGB pixels                                                                   |
+/// | RLE      | Runs of count u8, color[3]                                                          |
+/// | DELTA    | Entries of skip u8, count u8, color[3] * count: keep `skip` pixels of the previous  |
+/// |          | frame, then replace `count` pixels                                                  |
+/// | PALETTE  | colors u8 (0 = 256), pixels u16, palette color[3] * colors, then one index per      |
+/// |          | pixel packed MSB first with 1, 2, 4 or 8 bits, the fewest that fit `colors`         |
+///
+/// The frame is shown once its last fragment arrives; a missing, repeated or malformed fragment drops
+/// the frame, an old sequence number is ignored as late. DELTA refers to the last frame the device
+/// assembled, so senders should send a full RAW, RLE or PALETTE frame now and then to recover from
+/// a dropped one.
+///
+/// Several connections may stream, but only one frame is assembled at a time: the first fragment of
+/// a frame abandons an incomplete frame of another connection. Sequence numbers are per connection.
+
+#define LS_STREAM_HEADER_LEN 6
+#define LS_STREAM_FLAG_LAST 0x01
+#define LS_STREAM_ENCODING(flags) (((flags) >> 1) & 0x03)
+
+typedef enum
+{
+    LS_STREAM_RAW = 0,
+    LS_STREAM_RLE = 1,
+    LS_STREAM_DELTA = 2,
+    LS_STREAM_PALETTE = 3,
+} ls_stream_encoding_t;
+
+/// Handles one stream fragment written by `source`. Returns 0 or a BLE_ATT_ERR_* code.
+int ls_stream_dispatch(uint8_t source, const uint8_t *data, size_t len);
+
+/// Drops the stream state of `source`: its half assembled frame and its last sequence number. Called
+/// when its connection closes, so the next client in that slot starts a new session.
+void ls_stream_reset(uint8_t source);
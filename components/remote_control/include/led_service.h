@@ -1,12 +1,42 @@
 #pragma once
 
 #include "host/ble_hs.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
 #include <stdio.h>
 
 /// LED Service Characteristic Callbacks
 int ls_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 int ls_capabilities_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int ls_stream_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int ls_scenes_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+#if CONFIG_WLED_LATENCY_TRACE
+int ls_diagnostics_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int ls_char_a004_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+#endif
+
+/// Capability states on the 0xA000 characteristic
+///
+/// Every capability of the compiled capability table has an i32 state that starts at its default.
+/// A read returns all of them as entries of id u16, value i32. Subscribers are notified with the same
+/// entries for the states that changed only, at most once per CONFIG_WLED_STATE_NOTIFY_INTERVAL_MS
+/// and split to fit the MTU of each connection.
+
+/// Sets every state to its default. Called once before the host starts.
+void ls_state_init(void);
+
+/// Changes a state from the host task and schedules the notification. Returns false for an unknown
+/// capability id.
+bool ls_state_set(uint16_t id, int32_t value);
+
+/// Returns false for an unknown capability id.
+bool ls_state_get(uint16_t id, int32_t *value);
+
+/// Forward subscription changes of 0xA000 here, and an unsubscribe before a connection goes away.
+void ls_state_subscribe(uint16_t conn_handle, uint16_t val_handle, bool subscribed);
 
 /// LED Service Characteristic User Description
 int ls_char_a000_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int ls_char_a001_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int ls_char_a002_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 int ls_char_dead_user_desc(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
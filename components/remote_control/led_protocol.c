@@ -0,0 +1,369 @@
+#include "led_protocol.h"
+
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "led_command.h"
+#include "led_service.h"
+#include "led_scene.h"
+#include "led_stream.h"
+#include <string.h>
+
+static const char *TAG = "led_protocol";
+
+/// Decodes an operation payload into a command record for the LED task.
+typedef void (*ls_op_decoder_t)(const uint8_t *payload, led_command_t *cmd);
+
+/// Applies an operation on service state, once the rest of the frame is queued.
+typedef void (*ls_op_update_t)(const uint8_t *payload);
+
+typedef struct
+{
+    uint8_t payload_len;
+    ls_op_decoder_t decode; ///< NULL for operations that do not produce a command
+    ls_op_update_t update;  ///< NULL for operations that only produce a command
+} ls_op_t;
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline void get_color(const uint8_t *p, uint8_t color[3])
+{
+    color[0] = p[0];
+    color[1] = p[1];
+    color[2] = p[2];
+}
+
+static void op_fill(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_FILL;
+    get_color(&payload[0], cmd->color);
+}
+
+static void op_set_range(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_SET_RANGE;
+    cmd->start = get_u16(&payload[0]);
+    cmd->count = get_u16(&payload[2]);
+    get_color(&payload[4], cmd->color);
+}
+
+static void op_set_pixel(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_SET_RANGE;
+    cmd->start = get_u16(&payload[0]);
+    cmd->count = 1;
+    get_color(&payload[2], cmd->color);
+}
+
+static void op_fade_range(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_FADE_RANGE;
+    cmd->start = get_u16(&payload[0]);
+    cmd->count = get_u16(&payload[2]);
+    get_color(&payload[4], cmd->color);
+    cmd->period_ms = get_u16(&payload[7]);
+}
+
+static void op_effect(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_EFFECT;
+    cmd->effect = payload[0];
+    cmd->start = get_u16(&payload[1]);
+    cmd->count = get_u16(&payload[3]);
+    get_color(&payload[5], cmd->color);
+    get_color(&payload[8], cmd->color2);
+    cmd->period_ms = get_u16(&payload[11]);
+}
+
+static void op_stop_effect(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_STOP_EFFECT;
+    cmd->start = get_u16(&payload[0]);
+    cmd->count = get_u16(&payload[2]);
+}
+
+static void op_scene_save(const uint8_t *payload, led_command_t *cmd)
+{
+    // A command record has no room for the name, it waits in a staging slot of its own that the
+    // command refers to, so two queued saves of the same scene each keep their name. Decoding only
+    // runs once the frame is queued, so every staged name reaches the LED task and is freed there.
+    char name[LED_SCENE_NAME_LEN];
+    memcpy(name, &payload[1], LED_SCENE_NAME_LEN);
+    name[LED_SCENE_NAME_LEN - 1] = '\0';
+
+    cmd->op = LED_CMD_SCENE_SAVE;
+    cmd->effect = payload[0];
+    cmd->start = led_scene_stage_name(name);
+}
+
+static void op_scene_recall(const uint8_t *payload, led_command_t *cmd)
+{
+    cmd->op = LED_CMD_SCENE_RECALL;
+    cmd->effect = payload[0];
+}
+
+static void op_set_state(const uint8_t *payload)
+{
+    uint16_t id = get_u16(&payload[0]);
+    int32_t value = (int32_t)(get_u16(&payload[2]) | ((uint32_t)get_u16(&payload[4]) << 16));
+    if (!ls_state_set(id, value))
+    {
+        ESP_LOGW(TAG, "Unknown capability %u", id);
+    }
+}
+
+static const ls_op_t ops[LS_OP_COUNT] = {
+    [LS_OP_NOP] = {0, NULL},
+    [LS_OP_FILL] = {3, op_fill},
+    [LS_OP_SET_RANGE] = {7, op_set_range},
+    [LS_OP_SET_PIXEL] = {5, op_set_pixel},
+    [LS_OP_FADE_RANGE] = {9, op_fade_range},
+    [LS_OP_EFFECT] = {13, op_effect},
+    [LS_OP_STOP_EFFECT] = {4, op_stop_effect},
+    [LS_OP_SCENE_SAVE] = {1 + LED_SCENE_NAME_LEN, op_scene_save},
+    [LS_OP_SCENE_RECALL] = {1, op_scene_recall},
+    [LS_OP_SET_STATE] = {6, NULL, op_set_state},
+};
+
+int ls_protocol_dispatch(uint8_t source, const uint8_t *data, size_t len)
+{
+    if (!ls_protocol_is_binary(data, len) || (data[0] & ~LS_PROTOCOL_HEADER) != LS_PROTOCOL_VERSION)
+    {
+        ESP_LOGW(TAG, "Unsupported protocol header 0x%02x", len > 0 ? data[0] : 0);
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+
+    // First pass only validates and counts, so a malformed frame never leaves a half applied scene behind
+    uint32_t count = 0;
+    size_t pos = 1;
+    while (pos < len)
+    {
+        uint8_t opcode = data[pos];
+        if (opcode >= LS_OP_COUNT)
+        {
+            ESP_LOGW(TAG, "Unknown opcode 0x%02x at offset %u", opcode, (unsigned)pos);
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+        if (ops[opcode].decode != NULL)
+        {
+            count++;
+        }
+        pos += 1 + ops[opcode].payload_len;
+    }
+    if (pos != len)
+    {
+        ESP_LOGW(TAG, "Truncated operation at end of frame (%u bytes)", (unsigned)len);
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    // The records are decoded straight into the command queue and published as one batch
+    if (!led_command_reserve(source, count))
+    {
+        ESP_LOGW(TAG, "Command queue full, dropping frame with %lu operations", (unsigned long)count);
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
+    uint32_t index = 0;
+    for (pos = 1; pos < len; pos += 1 + ops[data[pos]].payload_len)
+    {
+        const ls_op_t *op = &ops[data[pos]];
+        if (op->decode != NULL)
+        {
+            led_command_t *cmd = led_command_at(source, index++);
+            memset(cmd, 0, sizeof(*cmd));
+            op->decode(&data[pos + 1], cmd);
+        }
+    }
+
+    led_command_publish(source, count);
+
+    for (pos = 1; pos < len; pos += 1 + ops[data[pos]].payload_len)
+    {
+        if (ops[data[pos]].update != NULL)
+        {
+            ops[data[pos]].update(&data[pos + 1]);
+        }
+    }
+    return 0;
+}
+
+/// Decodes a stream fragment payload. With `rgb` NULL it only validates the payload and sets `count`
+/// to the number of pixels it covers; otherwise it writes those pixels to `rgb`.
+typedef bool (*ls_stream_decoder_t)(const uint8_t *payload, size_t len, uint8_t *rgb, uint32_t *count);
+
+static bool decode_raw(const uint8_t *payload, size_t len, uint8_t *rgb, uint32_t *count)
+{
+    if (rgb != NULL)
+    {
+        memcpy(rgb, payload, len);
+    }
+    *count = len / 3;
+    return len % 3 == 0;
+}
+
+static bool decode_rle(const uint8_t *payload, size_t len, uint8_t *rgb, uint32_t *count)
+{
+    uint32_t pixels = 0;
+    for (size_t pos = 0; pos + 4 <= len; pos += 4)
+    {
+        uint8_t run = payload[pos];
+        for (uint8_t i = 0; rgb != NULL && i < run; i++)
+        {
+            memcpy(&rgb[(pixels + i) * 3], &payload[pos + 1], 3);
+        }
+        pixels += run;
+    }
+    *count = pixels;
+    return len % 4 == 0;
+}
+
+static bool decode_delta(const uint8_t *payload, size_t len, uint8_t *rgb, uint32_t *count)
+{
+    uint32_t pixels = 0;
+    size_t pos = 0;
+    while (pos + 2 <= len)
+    {
+        uint8_t skip = payload[pos];
+        uint8_t changed = payload[pos + 1];
+        pos += 2;
+        if (pos + changed * 3 > len)
+        {
+            return false;
+        }
+
+        // Skipped pixels keep what the previous frame left in the stream buffer
+        pixels += skip;
+        if (rgb != NULL)
+        {
+            memcpy(&rgb[pixels * 3], &payload[pos], changed * 3);
+        }
+        pixels += changed;
+        pos += changed * 3;
+    }
+    *count = pixels;
+    return pos == len;
+}
+
+static bool decode_palette(const uint8_t *payload, size_t len, uint8_t *rgb, uint32_t *count)
+{
+    if (len < 3)
+    {
+        return false;
+    }
+    uint32_t colors = payload[0] != 0 ? payload[0] : 256;
+    uint32_t pixels = get_u16(&payload[1]);
+    uint8_t bits = colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+    const uint8_t *palette = &payload[3];
+    const uint8_t *indices = &palette[colors * 3];
+    if (len != 3 + colors * 3 + (pixels * bits + 7) / 8)
+    {
+        return false;
+    }
+
+    uint8_t mask = (1 << bits) - 1;
+    for (uint32_t i = 0; i < pixels; i++)
+    {
+        uint32_t bit = i * bits;
+        uint8_t index = (indices[bit / 8] >> (8 - bits - bit % 8)) & mask;
+        if (index >= colors)
+        {
+            return false;
+        }
+        if (rgb != NULL)
+        {
+            memcpy(&rgb[i * 3], &palette[index * 3], 3);
+        }
+    }
+    *count = pixels;
+    return true;
+}
+
+static const ls_stream_decoder_t stream_decoders[] = {
+    [LS_STREAM_RAW] = decode_raw,
+    [LS_STREAM_RLE] = decode_rle,
+    [LS_STREAM_DELTA] = decode_delta,
+    [LS_STREAM_PALETTE] = decode_palette,
+};
+
+/// Per source: fragment index the next stream fragment must carry, -1 while it assembles no frame
+static int stream_next_fragment[LED_COMMAND_SOURCES] = {[0 ... LED_COMMAND_SOURCES - 1] = -1};
+static uint16_t stream_sequence[LED_COMMAND_SOURCES];
+
+/// Validates a fragment payload, then decodes it straight into the stream frame.
+static bool ls_stream_decode(ls_stream_decoder_t decode, uint16_t start, const uint8_t *payload, size_t len)
+{
+    uint32_t count;
+    if (!decode(payload, len, NULL, &count))
+    {
+        return false;
+    }
+    if (count == 0)
+    {
+        return true;
+    }
+
+    uint8_t *span = led_stream_span(start, count);
+    return span != NULL && decode(payload, len, span, &count);
+}
+
+void ls_stream_reset(uint8_t source)
+{
+    source %= LED_COMMAND_SOURCES;
+    stream_next_fragment[source] = -1;
+    led_stream_reset(source);
+}
+
+int ls_stream_dispatch(uint8_t source, const uint8_t *data, size_t len)
+{
+    source %= LED_COMMAND_SOURCES;
+    if (len < LS_STREAM_HEADER_LEN)
+    {
+        if (stream_next_fragment[source] >= 0)
+        {
+            led_stream_abort();
+            stream_next_fragment[source] = -1;
+        }
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    uint16_t sequence = get_u16(&data[0]);
+    uint8_t fragment = data[2];
+    uint8_t flags = data[3];
+    uint16_t start = get_u16(&data[4]);
+
+    if (fragment == 0)
+    {
+        // There is a single frame in assembly, a new frame from one controller abandons the other's
+        for (int i = 0; i < LED_COMMAND_SOURCES; i++)
+        {
+            stream_next_fragment[i] = -1;
+        }
+        stream_next_fragment[source] = led_stream_begin(source, sequence) ? 0 : -1;
+        stream_sequence[source] = sequence;
+    }
+    if (stream_next_fragment[source] < 0)
+    {
+        return 0; // Rest of a late or dropped frame
+    }
+    if (sequence != stream_sequence[source] || fragment != stream_next_fragment[source] ||
+        !ls_stream_decode(stream_decoders[LS_STREAM_ENCODING(flags)], start, &data[LS_STREAM_HEADER_LEN],
+                          len - LS_STREAM_HEADER_LEN))
+    {
+        led_stream_abort();
+        stream_next_fragment[source] = -1;
+        return 0;
+    }
+
+    if (flags & LS_STREAM_FLAG_LAST)
+    {
+        led_stream_submit();
+        stream_next_fragment[source] = -1;
+    }
+    else
+    {
+        stream_next_fragment[source]++;
+    }
+    return 0;
+}
@@ -1,20 +1,143 @@
 #include "include/led_service.h"
 
-#include "led_matrix.h"
+#include "ble_link.h"
+#include "esp_log.h"
+#include "latency.h"
+#include "led_command.h"
+#include "led_protocol.h"
+#include "led_scene.h"
+#include "led_stream.h"
+
+// Largest attribute value ATT allows, long writes of binary frames are reassembled up to this size
+#define LS_WRITE_MAX_LEN 512
 
 static const char *TAG = "led_service";
 
-/// Capabilities of Device
-int ls_capabilities_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+/// Stream fragments, written without response so a show controller is never throttled by round trips
+int ls_stream_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    ble_link_activity(conn_handle);
+    int source = ble_link_slot(conn_handle);
+    if (source < 0)
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    uint8_t fragment[LS_WRITE_MAX_LEN];
+    uint16_t fragment_len;
+    if (ble_hs_mbuf_to_flat(ctxt->om, fragment, sizeof(fragment), &fragment_len) != 0)
+    {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    return ls_stream_dispatch(source, fragment, fragment_len);
+}
+
+/// Saved scenes: count u8, then per scene id u8, name length u8 and the name
+int ls_scenes_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    led_scene_info_t scenes[LED_SCENE_MAX];
+    uint32_t count = led_scene_list(scenes, LED_SCENE_MAX);
+
+    uint8_t data[1 + LED_SCENE_MAX * (2 + LED_SCENE_NAME_LEN)];
+    size_t len = 0;
+    data[len++] = count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        size_t name_len = strlen(scenes[i].name);
+        data[len++] = scenes[i].id;
+        data[len++] = name_len;
+        memcpy(&data[len], scenes[i].name, name_len);
+        len += name_len;
+    }
+
+    return os_mbuf_append(ctxt->om, data, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+#if CONFIG_WLED_LATENCY_TRACE
+#define LS_DIAGNOSTICS_VERSION 1
+
+static size_t put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+    return 4;
+}
+
+/// Diagnostics: version u8, metric count u8, then per metric count u32, mean u32, max u32 and
+/// LATENCY_BUCKETS u16 bucket counts (saturating), followed by the command queue (published, applied,
+/// dropped, high watermark) and stream (received, applied, dropped, late) counters as u32
+int ls_diagnostics_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t data[2 + LATENCY_METRIC_COUNT * (12 + 2 * LATENCY_BUCKETS) + 8 * 4];
+    size_t len = 0;
+    data[len++] = LS_DIAGNOSTICS_VERSION;
+    data[len++] = LATENCY_METRIC_COUNT;
+    for (int i = 0; i < LATENCY_METRIC_COUNT; i++)
+    {
+        latency_histogram_t histogram;
+        latency_get(i, &histogram);
+        len += put_u32(&data[len], histogram.count);
+        len += put_u32(&data[len], histogram.count > 0 ? histogram.sum / histogram.count : 0);
+        len += put_u32(&data[len], histogram.max);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            uint16_t bucket = histogram.buckets[b] < UINT16_MAX ? histogram.buckets[b] : UINT16_MAX;
+            data[len++] = bucket & 0xFF;
+            data[len++] = bucket >> 8;
+        }
+    }
+
+    led_command_stats_t commands;
+    led_command_get_stats(&commands);
+    len += put_u32(&data[len], commands.published);
+    len += put_u32(&data[len], commands.applied);
+    len += put_u32(&data[len], commands.dropped);
+    len += put_u32(&data[len], commands.high_watermark);
+
+    led_stream_stats_t stream;
+    led_stream_get_stats(&stream);
+    len += put_u32(&data[len], stream.received);
+    len += put_u32(&data[len], stream.applied);
+    len += put_u32(&data[len], stream.dropped);
+    len += put_u32(&data[len], stream.late);
+
+    return os_mbuf_append(ctxt->om, data, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+int ls_char_a004_user_desc(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    char *data = "To be implemented later";
-    os_mbuf_append(ctxt->om, data, strlen(data));
+    const char *desc = "Diagnostics";
+    os_mbuf_append(ctxt->om, desc, strlen(desc));
     return 0;
 }
+#endif
 
 // Write data to ESP32 defined as server
 int ls_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
+    ble_link_activity(conn_handle);
+
+    // Every connection queues into its own ring, the LED task takes turns between them
+    int source = ble_link_slot(conn_handle);
+    if (source < 0)
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    if (ls_protocol_is_binary(ctxt->om->om_data, ctxt->om->om_len))
+    {
+        uint8_t frame[LS_WRITE_MAX_LEN];
+        uint16_t frame_len;
+        if (ble_hs_mbuf_to_flat(ctxt->om, frame, sizeof(frame), &frame_len) != 0)
+        {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        return ls_protocol_dispatch(source, frame, frame_len);
+    }
+
+    // Text commands, kept for older clients
     const char *received_payload = (const char *)ctxt->om->om_data;
     uint16_t payload_len = ctxt->om->om_len;
 
@@ -27,18 +150,12 @@ int ls_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_
     if (payload_len == (sizeof(CMD_LIGHT_ON) - 1) && strncmp(received_payload, CMD_LIGHT_ON, payload_len) == 0)
     {
         ESP_LOGI(TAG, "LIGHT ON");
-        for (int i = 0; i < led_matrix_get_size(); i++)
-        {
-            led_matrix_set_pixel(i, 10, 10, 0);
-        }
+        led_command_push(source, &(led_command_t){.op = LED_CMD_FILL, .color = {10, 10, 0}});
     }
     else if (payload_len == (sizeof(CMD_LIGHT_OFF) - 1) && strncmp(received_payload, CMD_LIGHT_OFF, payload_len) == 0)
     {
         ESP_LOGI(TAG, "LIGHT OFF");
-        for (int i = 0; i < led_matrix_get_size(); i++)
-        {
-            led_matrix_set_pixel(i, 0, 0, 0);
-        }
+        led_command_push(source, &(led_command_t){.op = LED_CMD_FILL, .color = {0, 0, 0}});
     }
     else if (payload_len == (sizeof(CMD_FAN_ON) - 1) && strncmp(received_payload, CMD_FAN_ON, payload_len) == 0)
     {
@@ -64,7 +181,21 @@ int ls_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_
 
 int ls_char_a000_user_desc(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    const char *desc = "Capabilities of Device";
+    const char *desc = "Capability States";
+    os_mbuf_append(ctxt->om, desc, strlen(desc));
+    return 0;
+}
+
+int ls_char_a001_user_desc(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const char *desc = "Saved Scenes";
+    os_mbuf_append(ctxt->om, desc, strlen(desc));
+    return 0;
+}
+
+int ls_char_a002_user_desc(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const char *desc = "Pixel Stream";
     os_mbuf_append(ctxt->om, desc, strlen(desc));
     return 0;
 }
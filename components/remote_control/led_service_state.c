@@ -0,0 +1,250 @@
+#include "include/led_service.h"
+
+#include "ble_link.h"
+#include "capability_service.h"
+#include "esp_log.h"
+#include "nimble/nimble_port.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "led_service_state";
+
+#define LS_STATE_ENTRY_LEN 6 // id u16, value i32
+#define LS_STATE_NOTIFY_MAX_LEN (CONFIG_WLED_BLE_PREFERRED_MTU - 3)
+
+typedef struct
+{
+    bool subscribed;
+    uint16_t conn_handle;
+    uint16_t val_handle;
+    uint32_t *changed; ///< One bit per capability, set until the change went out to this connection
+} ls_subscriber_t;
+
+static const capa_entry_t *s_table;
+static size_t s_count;
+static size_t s_words;
+static int32_t *s_values;
+
+// Indexed by the slot of the connection
+static ls_subscriber_t s_subscribers[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+static struct ble_npl_callout s_flush;
+static ble_npl_time_t s_last_flush;
+
+static inline void put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t value)
+{
+    put_u16(&p[0], value & 0xFFFF);
+    put_u16(&p[2], value >> 16);
+}
+
+static inline void ls_state_put_entry(uint8_t *p, size_t index)
+{
+    put_u16(&p[0], s_table[index].id);
+    put_u32(&p[2], (uint32_t)s_values[index]);
+}
+
+static int ls_state_index(uint16_t id)
+{
+    for (size_t i = 0; i < s_count; i++)
+    {
+        if (s_table[i].id == id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/// Sends the changed states of one subscriber, as many notifications as its MTU requires. Returns
+/// false if the host ran out of buffers, the states not sent yet stay marked.
+static bool ls_state_send(ls_subscriber_t *subscriber)
+{
+    uint16_t mtu = ble_att_mtu(subscriber->conn_handle);
+    size_t capacity = (mtu > 3 ? mtu : BLE_ATT_MTU_DFLT) - 3;
+    if (capacity > LS_STATE_NOTIFY_MAX_LEN)
+    {
+        capacity = LS_STATE_NOTIFY_MAX_LEN;
+    }
+
+    uint8_t data[LS_STATE_NOTIFY_MAX_LEN];
+    size_t len = 0;
+    size_t from = 0;
+    for (size_t i = 0; i <= s_count; i++)
+    {
+        bool last = i == s_count;
+        if (!last && (subscriber->changed[i / 32] & (1u << (i % 32))))
+        {
+            ls_state_put_entry(&data[len], i);
+            len += LS_STATE_ENTRY_LEN;
+        }
+        if (len == 0 || (!last && len + LS_STATE_ENTRY_LEN <= capacity))
+        {
+            continue;
+        }
+
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(data, len);
+        int rc = om != NULL ? ble_gatts_notify_custom(subscriber->conn_handle, subscriber->val_handle, om)
+                            : BLE_HS_ENOMEM;
+        if (rc == BLE_HS_ENOMEM)
+        {
+            return false;
+        }
+        if (rc != 0)
+        {
+            // Connection is going away, the disconnect event drops the subscriber
+            ESP_LOGW(TAG, "conn %u: state notification failed (%d)", subscriber->conn_handle, rc);
+        }
+
+        size_t to = last ? s_count : i + 1;
+        for (size_t j = from; j < to; j++)
+        {
+            subscriber->changed[j / 32] &= ~(1u << (j % 32));
+        }
+        from = to;
+        len = 0;
+    }
+    return true;
+}
+
+static void ls_state_flush(struct ble_npl_event *ev)
+{
+    s_last_flush = ble_npl_time_get();
+
+    bool pending = false;
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (s_subscribers[i].subscribed && !ls_state_send(&s_subscribers[i]))
+        {
+            pending = true;
+        }
+    }
+    if (pending)
+    {
+        ble_npl_callout_reset(&s_flush, ble_npl_time_ms_to_ticks32(CONFIG_WLED_STATE_NOTIFY_INTERVAL_MS));
+    }
+}
+
+/// Arms the flush for the end of the current interval. A change after a quiet period goes out at
+/// once, a burst of changes within the interval leaves in a single notification.
+static void ls_state_schedule(void)
+{
+    if (ble_npl_callout_is_active(&s_flush))
+    {
+        return;
+    }
+
+    ble_npl_time_t interval = ble_npl_time_ms_to_ticks32(CONFIG_WLED_STATE_NOTIFY_INTERVAL_MS);
+    ble_npl_time_t elapsed = ble_npl_time_get() - s_last_flush;
+    ble_npl_callout_reset(&s_flush, elapsed < interval ? interval - elapsed : 1);
+}
+
+void ls_state_init(void)
+{
+    if (s_values != NULL)
+    {
+        return;
+    }
+
+    const capa_entry_t *table = capa_table_get(&s_count);
+    s_words = (s_count + 31) / 32;
+    s_values = calloc(s_count > 0 ? s_count : 1, sizeof(*s_values));
+    uint32_t *changed = calloc(s_words > 0 ? s_words * CONFIG_BT_NIMBLE_MAX_CONNECTIONS : 1, sizeof(*changed));
+    if (s_values == NULL || changed == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate the state of %u capabilities", (unsigned)s_count);
+        free(s_values);
+        free(changed);
+        s_values = NULL;
+        s_count = 0;
+        return;
+    }
+
+    s_table = table;
+    for (size_t i = 0; i < s_count; i++)
+    {
+        s_values[i] = s_table[i].default_value;
+    }
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        s_subscribers[i].changed = &changed[i * s_words];
+    }
+    ble_npl_callout_init(&s_flush, nimble_port_get_dflt_eventq(), ls_state_flush, NULL);
+}
+
+bool ls_state_set(uint16_t id, int32_t value)
+{
+    int index = s_values != NULL ? ls_state_index(id) : -1;
+    if (index < 0)
+    {
+        return false;
+    }
+    if (s_values[index] == value)
+    {
+        return true;
+    }
+
+    s_values[index] = value;
+    bool subscribed = false;
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (s_subscribers[i].subscribed)
+        {
+            s_subscribers[i].changed[index / 32] |= 1u << (index % 32);
+            subscribed = true;
+        }
+    }
+    if (subscribed)
+    {
+        ls_state_schedule();
+    }
+    return true;
+}
+
+bool ls_state_get(uint16_t id, int32_t *value)
+{
+    int index = s_values != NULL ? ls_state_index(id) : -1;
+    if (index < 0)
+    {
+        return false;
+    }
+    *value = s_values[index];
+    return true;
+}
+
+void ls_state_subscribe(uint16_t conn_handle, uint16_t val_handle, bool subscribed)
+{
+    int slot = ble_link_slot(conn_handle);
+    if (slot < 0 || s_values == NULL)
+    {
+        return;
+    }
+
+    // A new subscriber reads the full state once, only changes after that are notified
+    ls_subscriber_t *subscriber = &s_subscribers[slot];
+    subscriber->subscribed = subscribed;
+    subscriber->conn_handle = conn_handle;
+    subscriber->val_handle = val_handle;
+    memset(subscriber->changed, 0, s_words * sizeof(*subscriber->changed));
+}
+
+/// Capability states: id u16, value i32 per capability
+int ls_capabilities_read(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t entry[LS_STATE_ENTRY_LEN];
+    for (size_t i = 0; i < s_count; i++)
+    {
+        ls_state_put_entry(entry, i);
+        if (os_mbuf_append(ctxt->om, entry, sizeof(entry)) != 0)
+        {
+            return BLE_ATT_ERR_INSUFFICIENT_RES;
+        }
+    }
+    return 0;
+}
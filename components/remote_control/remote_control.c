@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "ble_link.h"
 #include "capability_service.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -13,6 +14,7 @@
 #include "include/device_service.h"
 #include "include/led_service.h"
 #include "led_matrix.h"
+#include "led_protocol.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
 #include "sdkconfig.h"
@@ -26,11 +28,14 @@ static const ble_uuid128_t capability_service_uuid =
     BLE_UUID128_INIT(0x91, 0xB6, 0xCA, 0x95, 0xB2, 0xC6, 0x7B, 0x90, 0x31, 0x45, 0x77, 0xE6, 0x67, 0x10, 0x68, 0xB9);
 static const ble_uuid16_t led_service_uuid = BLE_UUID16_INIT(0x1007);
 
-uint8_t ble_addr_type;
+static uint8_t ble_addr_type;
 
 // Handle for the capability characteristic value
 static uint16_t g_capa_char_val_handle;
 
+// Handle for the capability state characteristic value
+static uint16_t g_ls_state_val_handle;
+
 static void ble_app_advertise(void);
 
 static struct ble_gatt_dsc_def char_0xA000_descs[] = {{
@@ -40,6 +45,36 @@ static struct ble_gatt_dsc_def char_0xA000_descs[] = {{
                                                       },
                                                       {0}};
 
+static struct ble_gatt_dsc_def char_0xA001_descs[] = {{
+                                                          .uuid = BLE_UUID16_DECLARE(0x2901),
+                                                          .att_flags = BLE_ATT_F_READ,
+                                                          .access_cb = ls_char_a001_user_desc,
+                                                      },
+                                                      {0}};
+
+static struct ble_gatt_dsc_def char_0xA002_descs[] = {{
+                                                          .uuid = BLE_UUID16_DECLARE(0x2901),
+                                                          .att_flags = BLE_ATT_F_READ,
+                                                          .access_cb = ls_char_a002_user_desc,
+                                                      },
+                                                      {0}};
+
+static struct ble_gatt_dsc_def char_0xA003_descs[] = {{
+                                                          .uuid = BLE_UUID16_DECLARE(0x2901),
+                                                          .att_flags = BLE_ATT_F_READ,
+                                                          .access_cb = ble_link_char_a003_user_desc,
+                                                      },
+                                                      {0}};
+
+#if CONFIG_WLED_LATENCY_TRACE
+static struct ble_gatt_dsc_def char_0xA004_descs[] = {{
+                                                          .uuid = BLE_UUID16_DECLARE(0x2901),
+                                                          .att_flags = BLE_ATT_F_READ,
+                                                          .access_cb = ls_char_a004_user_desc,
+                                                      },
+                                                      {0}};
+#endif
+
 static struct ble_gatt_dsc_def char_0xDEAD_descs[] = {{
                                                           .uuid = BLE_UUID16_DECLARE(0x2901),
                                                           .att_flags = BLE_ATT_F_WRITE,
@@ -54,6 +89,13 @@ static struct ble_gatt_dsc_def char_0x1979_desc[] = {{
                                                      },
                                                      {0}};
 
+static struct ble_gatt_dsc_def char_0x197A_desc[] = {{
+                                                         .uuid = BLE_UUID16_DECLARE(0x2901),
+                                                         .att_flags = BLE_ATT_F_READ,
+                                                         .access_cb = capa_char_197a_user_desc,
+                                                     },
+                                                     {0}};
+
 // Array of pointers to other service definitions
 static const struct ble_gatt_svc_def gatt_svcs[] = {
     {
@@ -75,6 +117,12 @@ static const struct ble_gatt_svc_def gatt_svcs[] = {
                                                            .val_handle = &g_capa_char_val_handle,
                                                            .descriptors = char_0x1979_desc,
                                                        },
+                                                       {
+                                                           .uuid = BLE_UUID16_DECLARE(0x197A),
+                                                           .flags = BLE_GATT_CHR_F_READ,
+                                                           .access_cb = capa_binary_read,
+                                                           .descriptors = char_0x197A_desc,
+                                                       },
                                                        {0}},
     },
     {
@@ -84,8 +132,35 @@ static const struct ble_gatt_svc_def gatt_svcs[] = {
                                                            .uuid = BLE_UUID16_DECLARE(0xA000),
                                                            .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
                                                            .access_cb = ls_capabilities_read,
+                                                           .val_handle = &g_ls_state_val_handle,
                                                            .descriptors = char_0xA000_descs,
                                                        },
+                                                       {
+                                                           .uuid = BLE_UUID16_DECLARE(0xA001),
+                                                           .flags = BLE_GATT_CHR_F_READ,
+                                                           .access_cb = ls_scenes_read,
+                                                           .descriptors = char_0xA001_descs,
+                                                       },
+                                                       {
+                                                           .uuid = BLE_UUID16_DECLARE(0xA002),
+                                                           .flags = BLE_GATT_CHR_F_WRITE_NO_RSP,
+                                                           .access_cb = ls_stream_write,
+                                                           .descriptors = char_0xA002_descs,
+                                                       },
+                                                       {
+                                                           .uuid = BLE_UUID16_DECLARE(0xA003),
+                                                           .flags = BLE_GATT_CHR_F_READ,
+                                                           .access_cb = ble_link_read,
+                                                           .descriptors = char_0xA003_descs,
+                                                       },
+#if CONFIG_WLED_LATENCY_TRACE
+                                                       {
+                                                           .uuid = BLE_UUID16_DECLARE(0xA004),
+                                                           .flags = BLE_GATT_CHR_F_READ,
+                                                           .access_cb = ls_diagnostics_read,
+                                                           .descriptors = char_0xA004_descs,
+                                                       },
+#endif
                                                        {
                                                            .uuid = BLE_UUID16_DECLARE(0xDEAD),
                                                            .flags = BLE_GATT_CHR_F_WRITE,
@@ -103,18 +178,29 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
     {
     case BLE_GAP_EVENT_CONNECT:
         ESP_LOGI(TAG, "BLE GAP EVENT CONNECT %s", event->connect.status == 0 ? "OK!" : "FAILED!");
-        if (event->connect.status != 0)
+        if (event->connect.status == 0)
         {
-            // Re-advertise if connection failed
-            ble_app_advertise();
+            ble_link_connected(event->connect.conn_handle);
         }
+        // Advertising stops with every connection, keep accepting clients up to the limit
+        ble_app_advertise();
         break;
 
-    case BLE_GAP_EVENT_DISCONNECT:
+    case BLE_GAP_EVENT_DISCONNECT: {
         ESP_LOGI(TAG, "BLE GAP EVENT DISCONNECTED");
-        // Re-advertise after disconnection
+        capa_notify_cancel(event->disconnect.conn.conn_handle);
+        ls_state_subscribe(event->disconnect.conn.conn_handle, g_ls_state_val_handle, false);
+        // The slot is freed below and may go to the next client, which must not inherit the stream
+        int slot = ble_link_slot(event->disconnect.conn.conn_handle);
+        if (slot >= 0)
+        {
+            ls_stream_reset(slot);
+        }
+        ble_link_disconnected(event->disconnect.conn.conn_handle);
+        // Re-advertise if the connection limit had stopped it
         ble_app_advertise();
         break;
+    }
 
     case BLE_GAP_EVENT_ADV_COMPLETE:
         ESP_LOGI(TAG, "BLE GAP EVENT ADV COMPLETE");
@@ -130,10 +216,8 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
                  event->subscribe.prev_notify, event->subscribe.cur_notify, event->subscribe.prev_indicate,
                  event->subscribe.cur_indicate);
 
-        // Check if subscription is for the capability characteristic's CCCD.
-        // The CCCD handle is typically the characteristic value handle + 1.
-        // g_capa_char_val_handle stores the handle of the characteristic value itself.
-        if (event->subscribe.attr_handle == g_capa_char_val_handle + 1)
+        // NimBLE reports the value handle of the characteristic, not the handle of its CCCD
+        if (event->subscribe.attr_handle == g_capa_char_val_handle)
         {
             if (event->subscribe.cur_notify)
             {
@@ -144,11 +228,18 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
             else
             {
                 ESP_LOGI(TAG, "Client unsubscribed from capability notifications.");
+                capa_notify_cancel(event->subscribe.conn_handle);
             }
         }
+        else if (event->subscribe.attr_handle == g_ls_state_val_handle)
+        {
+            ls_state_subscribe(event->subscribe.conn_handle, g_ls_state_val_handle, event->subscribe.cur_notify);
+        }
         break;
 
     default:
+        // MTU, PHY, data length and connection parameter updates
+        ble_link_gap_event(event);
         break;
     }
     return 0;
@@ -159,6 +250,16 @@ static void ble_app_advertise(void)
 {
     int ret;
 
+    if (ble_gap_adv_active())
+    {
+        return;
+    }
+    if (ble_link_count() >= CONFIG_BT_NIMBLE_MAX_CONNECTIONS)
+    {
+        ESP_LOGI(TAG, "All %d connections in use, advertising paused", CONFIG_BT_NIMBLE_MAX_CONNECTIONS);
+        return;
+    }
+
     // GAP - advertising definition
     struct ble_hs_adv_fields fields;
     memset(&fields, 0, sizeof(fields));
@@ -240,6 +341,8 @@ void ble_init(void)
     nimble_port_init();
     ble_svc_gap_init();
     ble_svc_gatt_init();
+    ble_link_init();
+    ls_state_init();
     ble_gatts_count_cfg(gatt_svcs);
     ble_gatts_add_svcs(gatt_svcs);
 
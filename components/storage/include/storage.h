@@ -1,55 +1,88 @@
 #pragma once
 
 #include "esp_err.h"
-#include <sys/types.h> // For ssize_t
+#include <sys/types.h> // For ssize_t, off_t
 
 /**
- * @brief Initializes the SPIFFS filesystem.
- * This function should be called once before any file operations.
+ * @brief Opaque handle of a file opened with storage_open().
+ * Every handle has its own read position, so several readers can use the same file at once.
+ */
+typedef struct storage_file *storage_handle_t;
+
+/**
+ * @brief Mounts the SPIFFS filesystem.
+ * The filesystem stays mounted until storage_uninit(). Calling it again while mounted is a no-op,
+ * so every user may call it before its first access.
  * @return ESP_OK on success, error code otherwise.
  */
 esp_err_t storage_init(void);
 
 /**
- * @brief Unregisters the SPIFFS filesystem.
- * This function should be called once when file operations are finished.
+ * @brief Closes all handles and unregisters the SPIFFS filesystem.
+ * Only meant for a controlled shutdown, regular readers never unmount.
  */
 void storage_uninit(void);
 
 /**
- * @brief Reads a chunk of data from a file on SPIFFS.
- * This function maintains internal state (file pointer) to allow reading
- * the same file chunk by chunk across multiple calls.
+ * @brief Opens a file for reading.
+ * Handles are cheap: the underlying file descriptors are shared through a small LRU pool and
+ * reopened on demand, so a handle may stay open for as long as it is needed.
  *
  * @param filename The path to the file to read (e.g., "/storage/my_file.txt").
- *                 Must be the same filename for consecutive calls to read the same file.
- * @param buffer   Buffer to store the read data. Must be large enough for max_bytes.
+ * @param handle   Receives the handle on success.
+ * @return ESP_OK on success.
+ *         ESP_ERR_INVALID_ARG if filename or handle is NULL or the filename is too long.
+ *         ESP_ERR_NOT_FOUND if the file does not exist.
+ *         ESP_ERR_NO_MEM if all handles are in use.
+ */
+esp_err_t storage_open(const char *filename, storage_handle_t *handle);
+
+/**
+ * @brief Closes a handle. Passing NULL is allowed.
+ */
+void storage_close(storage_handle_t handle);
+
+/**
+ * @brief Returns the size of the file in bytes, or a negative value for an invalid handle.
+ */
+ssize_t storage_size(storage_handle_t handle);
+
+/**
+ * @brief Reads the next chunk of data and advances the read position of the handle.
+ *
+ * @param handle    Handle returned by storage_open().
+ * @param buffer    Buffer to store the read data. Must be large enough for max_bytes.
  * @param max_bytes The maximum number of bytes to read in this call. Must be > 0.
  * @return The number of bytes read on success (>= 0).
  *         Returns 0 when the end of the file is reached.
  *         Returns a negative value on error:
- *         -1: Invalid input parameters (filename, buffer is NULL, or max_bytes is 0).
- *         -2: Failed to open the file (first call for this filename).
- *         -3: Filename mismatch with the currently open file (subsequent call).
+ *         -1: Invalid input parameters (handle or buffer is NULL, or max_bytes is 0).
+ *         -2: Failed to open the file.
  *         -4: Read error occurred.
+ *         -5: Seek error occurred.
+ */
+ssize_t storage_read(storage_handle_t handle, void *buffer, size_t max_bytes);
+
+/**
+ * @brief Reads a chunk of data starting at a specific offset.
+ * The read position of the handle is not changed.
+ *
+ * @param handle Handle returned by storage_open().
+ * @param buffer Buffer to store the read data. Must be large enough for nbytes.
+ * @param nbytes The maximum number of bytes to read in this call. Must be > 0.
+ * @param offset The offset in the file to start reading from.
+ * @return Same as storage_read(), -1 also covers a negative offset.
  */
-ssize_t storage_read(const char *filename, char *buffer, size_t max_bytes);
+ssize_t storage_pread(storage_handle_t handle, void *buffer, size_t nbytes, off_t offset);
 
 /**
- * @brief Reads a chunk of data from a file on SPIFFS, starting at a specific offset.
- * This function is stateless regarding an internally managed file pointer for sequential reads;
- * it opens, seeks, reads, and closes the file on each call.
+ * @brief Reads a chunk of data from a file, starting at a specific offset.
+ * Convenience wrapper that opens, reads and closes a handle.
  *
  * @param filename The path to the file to read (e.g., "/storage/my_file.txt").
  * @param buffer   Buffer to store the read data. Must be large enough for nbytes.
  * @param offset   The offset in the file to start reading from.
  * @param nbytes   The maximum number of bytes to read in this call. Must be > 0.
- * @return The number of bytes read on success (>= 0).
- *         Returns 0 when the end of the file is reached from the given offset.
- *         Returns a negative value on error:
- *         -1: Invalid input parameters (filename, buffer is NULL, nbytes is 0, or offset is negative).
- *         -2: Failed to open the file.
- *         -5: Seek error occurred.
- *         -4: Read error occurred.
+ * @return Same as storage_pread(), -2 if the file cannot be opened.
  */
 ssize_t storage_read_at(const char *filename, char *buffer, off_t offset, size_t nbytes);
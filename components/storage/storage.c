@@ -1,139 +1,292 @@
 #include "storage.h"
+#include "storage_fs.h"
 
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-
-#include "esp_spiffs.h"
+#include <sys/stat.h>
 
 static const char *TAG = "storage";
 
-static FILE *s_current_file = NULL;
-static char s_current_filename[256] = {0}; // Buffer to store the current filename
+#define STORAGE_MAX_FILES 5       // Files SPIFFS may have open at the same time
+#define STORAGE_MAX_HANDLES 16    // Logical handles, independent of open descriptors
 
-esp_err_t storage_init(void)
+/// Open descriptor, shared by all handles in least recently used order
+typedef struct
 {
-    ESP_LOGI(TAG, "Initializing SPIFFS");
+    FILE *file;
+    char path[STORAGE_MAX_PATH];
+    struct storage_file *owner;
+    uint32_t last_used;
+} storage_descriptor_t;
 
-    esp_vfs_spiffs_conf_t conf = {
-        .base_path = "/storage",       // Path where the filesystem will be mounted
-        .partition_label = "storage",  // Partition label (must match partitions.csv)
-        .max_files = 5,                // Maximum number of files that can be open at the same time
-        .format_if_mount_failed = true // Format partition if mount fails
-    };
+struct storage_file
+{
+    bool in_use;
+    char path[STORAGE_MAX_PATH];
+    off_t position;
+    off_t size;
+    storage_descriptor_t *descriptor;
+};
 
-    // Initialize and mount SPIFFS
-    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+static struct storage_file s_handles[STORAGE_MAX_HANDLES];
+static storage_descriptor_t s_descriptors[STORAGE_MAX_FILES];
+static uint32_t s_use_clock;
+static SemaphoreHandle_t s_mutex;
+static bool s_mounted;
 
+esp_err_t storage_init(void)
+{
+    if (s_mounted)
+    {
+        return ESP_OK;
+    }
+
+    esp_err_t ret = storage_fs_mount(STORAGE_MAX_FILES);
     if (ret != ESP_OK)
     {
-        if (ret == ESP_FAIL)
-        {
-            ESP_LOGE(TAG, "Failed to mount or format filesystem");
-        }
-        else if (ret == ESP_ERR_NOT_FOUND)
-        {
-            ESP_LOGE(TAG, "Failed to find SPIFFS partition");
-        }
-        else
-        {
-            ESP_LOGE(TAG, "Failed to initialize SPIFFS (%s)", esp_err_to_name(ret));
-        }
         return ret;
     }
 
-    ESP_LOGI(TAG, "SPIFFS mounted");
+    if (s_mutex == NULL)
+    {
+        s_mutex = xSemaphoreCreateMutex();
+    }
+
+    s_mounted = true;
     return ESP_OK;
 }
 
 void storage_uninit(void)
 {
-    if (s_current_file != NULL)
+    if (!s_mounted)
+    {
+        return;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    for (int i = 0; i < STORAGE_MAX_FILES; i++)
     {
-        // Log before clearing s_current_filename, using its value.
-        ESP_LOGW(TAG, "File '%s' was still open during uninit. Closing it.", s_current_filename);
-        fclose(s_current_file); // Close the file
-        s_current_file = NULL;
-        s_current_filename[0] = '\0';
+        if (s_descriptors[i].file != NULL)
+        {
+            fclose(s_descriptors[i].file);
+        }
+    }
+    memset(s_descriptors, 0, sizeof(s_descriptors));
+    for (int i = 0; i < STORAGE_MAX_HANDLES; i++)
+    {
+        if (s_handles[i].in_use)
+        {
+            ESP_LOGW(TAG, "File '%s' was still open during uninit. Closing it.", s_handles[i].path);
+        }
     }
-    esp_vfs_spiffs_unregister("storage");
-    ESP_LOGI(TAG, "SPIFFS unmounted");
+    memset(s_handles, 0, sizeof(s_handles));
+    s_mounted = false;
+    xSemaphoreGive(s_mutex);
+
+    storage_fs_unmount();
 }
 
-ssize_t storage_read(const char *filename, char *buffer, size_t max_bytes)
+esp_err_t storage_open(const char *filename, storage_handle_t *handle)
 {
-    // Input validation
-    if (filename == NULL || filename[0] == '\0' || buffer == NULL || max_bytes == 0)
+    if (filename == NULL || handle == NULL)
     {
-        ESP_LOGE(TAG, "Invalid input parameters for storage_read");
-        return -1;
+        ESP_LOGE(TAG, "Invalid input parameters for storage_open");
+        return ESP_ERR_INVALID_ARG;
     }
 
-    // If no file is currently open, open the requested one
-    if (s_current_file == NULL)
+    esp_err_t ret = storage_init();
+    if (ret != ESP_OK)
     {
-        s_current_file = fopen(filename, "r");
-        if (s_current_file == NULL)
-        {
-            ESP_LOGE(TAG, "Failed to open file for reading: %s", filename);
-            s_current_filename[0] = '\0'; // Clear filename as open failed
-            return -2;                    // Failed to open file
-        }
-        // Store the filename for subsequent calls
-        strncpy(s_current_filename, filename, sizeof(s_current_filename) - 1);
-        s_current_filename[sizeof(s_current_filename) - 1] = '\0';
-        ESP_LOGI(TAG, "Opened file: %s", s_current_filename);
+        return ret;
+    }
+
+    char path[STORAGE_MAX_PATH];
+    if (!storage_fs_path(filename, path, sizeof(path)))
+    {
+        ESP_LOGE(TAG, "Invalid input parameters for storage_open");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to open file for reading: %s", filename);
+        return ESP_ERR_NOT_FOUND;
     }
-    else
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    struct storage_file *file = NULL;
+    for (int i = 0; i < STORAGE_MAX_HANDLES && file == NULL; i++)
     {
-        // If a file is open, ensure it's the same file requested
-        if (strcmp(filename, s_current_filename) != 0)
+        if (!s_handles[i].in_use)
         {
-            ESP_LOGE(TAG, "Filename mismatch. Expected '%s', got '%s'. Close the current file first.",
-                     s_current_filename, filename);
-            // Note: File remains open. Caller might need a separate close function
-            // or ensure read loop finishes (returns 0 or error) before changing filename.
-            return -3; // Filename mismatch
+            file = &s_handles[i];
+            file->in_use = true;
         }
     }
+    xSemaphoreGive(s_mutex);
+
+    if (file == NULL)
+    {
+        ESP_LOGE(TAG, "No free handle to open %s", filename);
+        return ESP_ERR_NO_MEM;
+    }
+
+    strcpy(file->path, path);
+    file->position = 0;
+    file->size = st.st_size;
+    file->descriptor = NULL;
+    *handle = file;
+    return ESP_OK;
+}
+
+void storage_close(storage_handle_t handle)
+{
+    if (handle == NULL)
+    {
+        return;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    // The descriptor stays open for whoever opens this file next, until the LRU evicts it
+    if (handle->descriptor != NULL && handle->descriptor->owner == handle)
+    {
+        handle->descriptor->owner = NULL;
+    }
+    handle->descriptor = NULL;
+    handle->in_use = false;
+    xSemaphoreGive(s_mutex);
+}
 
-    // Read a chunk
-    size_t bytes_read = fread(buffer, 1, max_bytes, s_current_file);
+ssize_t storage_size(storage_handle_t handle)
+{
+    return handle != NULL && handle->in_use ? (ssize_t)handle->size : -1;
+}
 
-    // Check for read errors
-    if (ferror(s_current_file))
+/// Returns an open descriptor for the handle, reusing its own, an idle one on the same path or the
+/// least recently used one. Called with s_mutex held.
+static FILE *storage_descriptor_get(struct storage_file *handle)
+{
+    storage_descriptor_t *descriptor = handle->descriptor;
+    if (descriptor == NULL || descriptor->owner != handle)
     {
-        ESP_LOGE(TAG, "Error reading file: %s", s_current_filename);
-        fclose(s_current_file);
-        s_current_file = NULL;
-        s_current_filename[0] = '\0';
-        return -4; // Read error
+        descriptor = NULL;
+        for (int i = 0; i < STORAGE_MAX_FILES && descriptor == NULL; i++)
+        {
+            storage_descriptor_t *candidate = &s_descriptors[i];
+            if (candidate->file != NULL && candidate->owner == NULL && strcmp(candidate->path, handle->path) == 0)
+            {
+                descriptor = candidate;
+            }
+        }
     }
 
-    // If fread returns 0 and it's not an error, it means EOF or an empty file.
-    // The file should be closed only when no more bytes can be read (i.e., bytes_read == 0).
-    if (bytes_read == 0) // Indicates EOF or empty file (and no ferror)
+    if (descriptor == NULL)
     {
-        // Log before clearing s_current_filename.
-        // feof(s_current_file) should be true if end of file was actually reached.
-        if (feof(s_current_file))
+        // Evict the least recently used descriptor, a free one counts as oldest
+        descriptor = &s_descriptors[0];
+        for (int i = 0; i < STORAGE_MAX_FILES && descriptor->file != NULL; i++)
         {
-            ESP_LOGI(TAG, "EOF reached for file: %s. Closing file.", s_current_filename);
+            if (s_descriptors[i].file == NULL || s_descriptors[i].last_used < descriptor->last_used)
+            {
+                descriptor = &s_descriptors[i];
+            }
         }
-        else
+
+        if (descriptor->owner != NULL)
+        {
+            descriptor->owner->descriptor = NULL;
+        }
+        if (descriptor->file != NULL)
+        {
+            fclose(descriptor->file);
+        }
+
+        descriptor->owner = NULL;
+        descriptor->file = fopen(handle->path, "r");
+        if (descriptor->file == NULL)
         {
-            ESP_LOGI(TAG, "Read 0 bytes from file: %s (possibly empty or already at EOF). Closing file.",
-                     s_current_filename);
+            ESP_LOGE(TAG, "Failed to open file for reading: %s", handle->path);
+            return NULL;
         }
-        fclose(s_current_file);
-        s_current_file = NULL;
-        s_current_filename[0] = '\0';
-        // Return 0 as per contract: "Returns 0 when the end of the file is reached."
-    }
-    // If bytes_read > 0, return the number of bytes read.
-    // The file remains open (even if EOF was hit during this read and bytes_read < max_bytes).
-    // The next call to storage_read for this file will then result in fread returning 0,
-    // which will then hit the (bytes_read == 0) condition above and close the file.
+        strcpy(descriptor->path, handle->path);
+    }
+
+    descriptor->owner = handle;
+    descriptor->last_used = ++s_use_clock;
+    handle->descriptor = descriptor;
+    return descriptor->file;
+}
+
+static ssize_t storage_read_locked(struct storage_file *handle, void *buffer, size_t nbytes, off_t offset)
+{
+    FILE *file = storage_descriptor_get(handle);
+    if (file == NULL)
+    {
+        return -2;
+    }
+
+    if (fseek(file, offset, SEEK_SET) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to seek to %ld in file: %s", (long)offset, handle->path);
+        return -5;
+    }
+
+    size_t bytes_read = fread(buffer, 1, nbytes, file);
+    if (ferror(file))
+    {
+        ESP_LOGE(TAG, "Error reading file: %s", handle->path);
+        clearerr(file);
+        return -4;
+    }
+    return bytes_read;
+}
+
+ssize_t storage_read(storage_handle_t handle, void *buffer, size_t max_bytes)
+{
+    if (handle == NULL || !handle->in_use || buffer == NULL || max_bytes == 0)
+    {
+        ESP_LOGE(TAG, "Invalid input parameters for storage_read");
+        return -1;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    ssize_t bytes_read = storage_read_locked(handle, buffer, max_bytes, handle->position);
+    if (bytes_read > 0)
+    {
+        handle->position += bytes_read;
+    }
+    xSemaphoreGive(s_mutex);
+    return bytes_read;
+}
+
+ssize_t storage_pread(storage_handle_t handle, void *buffer, size_t nbytes, off_t offset)
+{
+    if (handle == NULL || !handle->in_use || buffer == NULL || nbytes == 0 || offset < 0)
+    {
+        ESP_LOGE(TAG, "Invalid input parameters for storage_pread");
+        return -1;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    ssize_t bytes_read = storage_read_locked(handle, buffer, nbytes, offset);
+    xSemaphoreGive(s_mutex);
+    return bytes_read;
+}
+
+ssize_t storage_read_at(const char *filename, char *buffer, off_t offset, size_t nbytes)
+{
+    storage_handle_t handle;
+    if (storage_open(filename, &handle) != ESP_OK)
+    {
+        return -2;
+    }
+
+    ssize_t bytes_read = storage_pread(handle, buffer, nbytes, offset);
+    storage_close(handle);
     return bytes_read;
 }
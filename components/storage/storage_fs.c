@@ -0,0 +1,53 @@
+#include "storage_fs.h"
+
+#include "esp_log.h"
+#include "esp_spiffs.h"
+#include <stdio.h>
+
+static const char *TAG = "storage";
+
+esp_err_t storage_fs_mount(size_t max_files)
+{
+    ESP_LOGI(TAG, "Initializing SPIFFS");
+
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = STORAGE_BASE_PATH,        // Path where the filesystem will be mounted
+        .partition_label = "storage",          // Partition label (must match partitions.csv)
+        .max_files = max_files,                // Maximum number of files that can be open at the same time
+        .format_if_mount_failed = true         // Format partition if mount fails
+    };
+
+    // Initialize and mount SPIFFS
+    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+
+    if (ret != ESP_OK)
+    {
+        if (ret == ESP_FAIL)
+        {
+            ESP_LOGE(TAG, "Failed to mount or format filesystem");
+        }
+        else if (ret == ESP_ERR_NOT_FOUND)
+        {
+            ESP_LOGE(TAG, "Failed to find SPIFFS partition");
+        }
+        else
+        {
+            ESP_LOGE(TAG, "Failed to initialize SPIFFS (%s)", esp_err_to_name(ret));
+        }
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "SPIFFS mounted");
+    return ESP_OK;
+}
+
+void storage_fs_unmount(void)
+{
+    esp_vfs_spiffs_unregister("storage");
+    ESP_LOGI(TAG, "SPIFFS unmounted");
+}
+
+bool storage_fs_path(const char *filename, char *path, size_t size)
+{
+    return snprintf(path, size, "%s", filename) < (int)size;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Filesystem backend of the storage component: SPIFFS on the chip, a host directory on linux
+
+#if CONFIG_IDF_TARGET_LINUX
+#define STORAGE_MAX_PATH 256
+#else
+#define STORAGE_MAX_PATH 64
+#endif
+
+#define STORAGE_BASE_PATH "/storage"
+
+/// Mounts the filesystem under STORAGE_BASE_PATH with room for `max_files` open files.
+esp_err_t storage_fs_mount(size_t max_files);
+
+void storage_fs_unmount(void);
+
+/// Maps a path under STORAGE_BASE_PATH to the one to pass to the C library. Returns false if the
+/// result does not fit in `size` bytes.
+bool storage_fs_path(const char *filename, char *path, size_t size);
@@ -0,0 +1,52 @@
+#include "storage_fs.h"
+
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "storage";
+
+#ifndef STORAGE_ROOT_DEFAULT_PATH
+#define STORAGE_ROOT_DEFAULT_PATH "data"
+#endif
+
+static const char *s_root;
+
+esp_err_t storage_fs_mount(size_t max_files)
+{
+    // The host has no partition, the directory the image would be built from stands in for it
+    const char *root = getenv("STORAGE_ROOT");
+    if (root == NULL)
+    {
+        root = STORAGE_ROOT_DEFAULT_PATH;
+    }
+
+    struct stat st;
+    if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        ESP_LOGE(TAG, "Storage directory %s not found", root);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    s_root = root;
+    ESP_LOGI(TAG, "Storage mapped to %s", root);
+    return ESP_OK;
+}
+
+void storage_fs_unmount(void)
+{
+    s_root = NULL;
+}
+
+bool storage_fs_path(const char *filename, char *path, size_t size)
+{
+    size_t base_len = strlen(STORAGE_BASE_PATH);
+    if (s_root == NULL || strncmp(filename, STORAGE_BASE_PATH, base_len) != 0 ||
+        (filename[base_len] != '/' && filename[base_len] != '\0'))
+    {
+        return false;
+    }
+    return snprintf(path, size, "%s%s", s_root, &filename[base_len]) < (int)size;
+}
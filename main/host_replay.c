@@ -0,0 +1,115 @@
+#include "host_replay.h"
+
+#include "esp_log.h"
+#include "esp_private/partition_linux.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "led_matrix.h"
+#include "nimble_sim.h"
+#include "persistence.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char *TAG = "host_replay";
+
+#define REPLAY_MTU 247
+
+void host_replay_setup(void)
+{
+    const char *image = getenv("WLED_FLASH_IMAGE");
+    if (image == NULL)
+    {
+        return;
+    }
+    if (access(image, R_OK | W_OK) != 0)
+    {
+        ESP_LOGW(TAG, "Flash image %s not found, using a temporary one", image);
+        return;
+    }
+
+    // Keeping the file carries NVS and the journal over to the next run
+    esp_partition_file_mmap_ctrl_t *ctrl = esp_partition_get_file_mmap_ctrl_input();
+    snprintf(ctrl->flash_file_name, sizeof(ctrl->flash_file_name), "%s", image);
+    ctrl->remove_dump = false;
+}
+
+/// Replays records of {uuid16 u16, length u16, value}, little endian, back to back
+static void host_replay_task(void *arg)
+{
+    FILE *capture = arg;
+
+    // In lockstep every write is shown before the next one, so the frames only depend on the capture
+    bool burst = getenv("WLED_REPLAY_BURST") != NULL;
+
+    while (!nimble_sim_advertising())
+    {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    uint16_t conn_handle = nimble_sim_connect(REPLAY_MTU);
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE)
+    {
+        ESP_LOGE(TAG, "Failed to connect");
+        exit(EXIT_FAILURE);
+    }
+
+    static uint8_t value[BLE_ATT_ATTR_MAX_LEN];
+    uint32_t writes = 0;
+    uint32_t rejected = 0;
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+
+    uint8_t header[4];
+    while (fread(header, sizeof(header), 1, capture) == 1)
+    {
+        uint16_t uuid16 = header[0] | (header[1] << 8);
+        uint16_t len = header[2] | (header[3] << 8);
+        if (len > sizeof(value) || fread(value, 1, len, capture) != len)
+        {
+            ESP_LOGE(TAG, "Truncated or oversized record after %lu writes", (unsigned long)writes);
+            break;
+        }
+
+        if (nimble_sim_write(conn_handle, uuid16, value, len) != 0)
+        {
+            rejected++;
+        }
+        if (!burst)
+        {
+            led_matrix_sync();
+        }
+        writes++;
+        bytes += len;
+    }
+
+    double seconds = (esp_timer_get_time() - start) / 1e6;
+    fclose(capture);
+
+    led_matrix_sync();
+    nimble_sim_disconnect(conn_handle);
+    persistence_flush();
+
+    printf("{\"writes\":%lu,\"rejected\":%lu,\"bytes\":%llu,\"seconds\":%.6f,\"writes_per_second\":%.1f}\n",
+           (unsigned long)writes, (unsigned long)rejected, (unsigned long long)bytes, seconds,
+           seconds > 0 ? writes / seconds : 0.0);
+    fflush(stdout);
+    exit(rejected == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void host_replay_start(void)
+{
+    const char *path = getenv("WLED_REPLAY");
+    if (path == NULL)
+    {
+        return;
+    }
+
+    FILE *capture = fopen(path, "rb");
+    if (capture == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open capture %s", path);
+        exit(EXIT_FAILURE);
+    }
+    xTaskCreate(host_replay_task, "host_replay", 8192, capture, 4, NULL);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+/// Host builds only: points the partition emulation at WLED_FLASH_IMAGE, if set. Must run before the
+/// first partition access.
+void host_replay_setup(void);
+
+/// Host builds only: once the device advertises, connects a simulated central and replays the capture
+/// file named by WLED_REPLAY, prints the throughput as JSON and exits. Every write is shown before the
+/// next one is sent, so a capture without timed effects always produces the same frames. With
+/// WLED_REPLAY_BURST set the writes go back to back as fast as the firmware accepts them, and how
+/// they merge into frames depends on scheduling. Without WLED_REPLAY the firmware just keeps running.
+void host_replay_start(void);
@@ -0,0 +1,92 @@
+#include "led_state.h"
+
+#include "esp_log.h"
+#include "journal.h"
+#include "led_command.h"
+#include "led_effects.h"
+#include "led_matrix.h"
+#include <stdlib.h>
+
+static const char *TAG = "led_state";
+
+typedef enum
+{
+    LED_STATE_RECORD_COMMAND = 1, ///< One applied led_command_t
+    LED_STATE_RECORD_FRAME = 2,   ///< The whole back buffer, written by compaction
+} led_state_record_t;
+
+static void led_state_replay(uint8_t type, const void *data, size_t len, void *ctx)
+{
+    switch (type)
+    {
+    case LED_STATE_RECORD_FRAME:
+        led_matrix_blit(data, len / 3);
+        break;
+
+    case LED_STATE_RECORD_COMMAND:
+        if (len == sizeof(led_command_t))
+        {
+            led_command_apply(data);
+        }
+        break;
+
+    default:
+        ESP_LOGW(TAG, "Unknown record type %u", type);
+        break;
+    }
+}
+
+/// Snapshot for compaction: the current frame followed by the effects still running on it.
+static bool led_state_snapshot(void *ctx)
+{
+    uint32_t size = led_matrix_get_size();
+    uint8_t *frame = malloc(size * 3);
+    if (frame == NULL)
+    {
+        return false;
+    }
+    led_matrix_read(frame, size);
+    esp_err_t ret = journal_compact_write(LED_STATE_RECORD_FRAME, frame, size * 3);
+    free(frame);
+
+    uint8_t ids[LED_EFFECT_MAX];
+    led_effect_params_t params[LED_EFFECT_MAX];
+    uint32_t count = led_effects_get_active(ids, params, LED_EFFECT_MAX);
+    for (uint32_t i = 0; i < count && ret == ESP_OK; i++)
+    {
+        led_command_t cmd = {
+            .op = LED_CMD_EFFECT,
+            .effect = ids[i],
+            .period_ms = params[i].period_ms,
+            .start = params[i].start,
+            .count = params[i].count,
+            .color = {params[i].color[0], params[i].color[1], params[i].color[2]},
+            .color2 = {params[i].color2[0], params[i].color2[1], params[i].color2[2]},
+        };
+        ret = journal_compact_write(LED_STATE_RECORD_COMMAND, &cmd, sizeof(cmd));
+    }
+    return ret == ESP_OK;
+}
+
+static void led_state_record(const led_command_t *cmd)
+{
+    // Saving a scene does not change what is shown and is persisted on its own
+    if (cmd->op == LED_CMD_SCENE_SAVE)
+    {
+        return;
+    }
+    journal_append(LED_STATE_RECORD_COMMAND, cmd, sizeof(*cmd));
+}
+
+void led_state_restore(void)
+{
+    led_matrix_setup();
+    if (journal_init(led_state_replay, led_state_snapshot, NULL) != ESP_OK)
+    {
+        return;
+    }
+
+    // The LED task sends the restored frame as its first one
+    led_matrix_commit();
+    led_command_set_observer(led_state_record);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+/// Restores the last LED state from the journal and keeps journaling every applied command.
+/// Must be called before the LED task is started.
+void led_state_restore(void);
@@ -1,11 +1,40 @@
+#include "assets.h"
+#include "benchmark.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host_replay.h"
+#include "latency.h"
 #include "led_matrix.h"
+#include "led_state.h"
 #include "persistence.h"
 #include "remote_control.h"
+#include "storage.h"
+#include <stdlib.h>
 
 void app_main(void)
 {
+#if CONFIG_WLED_BENCHMARK
+    // The benchmarks drive the components themselves, nothing else may run next to them
+    benchmark_run();
+#if CONFIG_IDF_TARGET_LINUX
+    exit(EXIT_SUCCESS);
+#endif
+    return;
+#endif
+
+#if CONFIG_IDF_TARGET_LINUX
+    host_replay_setup();
+#endif
     persistence_init("miniature_town");
+    storage_init();
+    assets_init();
+    led_state_restore();
     ble_init();
-    xTaskCreatePinnedToCore(led_matrix_init, "led_matrix", configMINIMAL_STACK_SIZE * 2, NULL, 5, NULL, 1);
+    xTaskCreatePinnedToCore(led_matrix_init, "led_matrix", CONFIG_WLED_LED_TASK_STACK_SIZE, NULL, 5, NULL, 1);
+#if CONFIG_WLED_LATENCY_TRACE
+    latency_console_start();
+#endif
+#if CONFIG_IDF_TARGET_LINUX
+    host_replay_start();
+#endif
 }
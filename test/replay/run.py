@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Replays BLE captures through the linux build and diffs the frames it sends.
+
+Every <name>.txt next to this script is a capture description for tools/make_capture.py,
+<name>.frames holds the frames the simulated strip must write for it. The firmware shows each
+write before it gets the next one, and the strip simulator writes no timestamps by default, so
+the output only depends on the capture. Captures must not start timed fades or effects.
+
+Build the firmware with the default configuration first:
+
+    idf.py --preview set-target linux build
+    test/replay/run.py build/miniature_town.elf
+
+Pass --update to rewrite the .frames files after an intended change of the output.
+"""
+
+import argparse
+import difflib
+import glob
+import os
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "tools"))
+
+import make_capture  # noqa: E402
+
+TIMEOUT_S = 60
+
+
+def replay(firmware, description, workdir):
+    capture = os.path.join(workdir, "capture.bin")
+    frames = os.path.join(workdir, "frames.log")
+    with open(description) as f:
+        data = make_capture.parse(f)
+    with open(capture, "wb") as f:
+        f.write(data)
+
+    env = dict(os.environ, WLED_REPLAY=capture, LED_STRIP_SIM_OUTPUT=frames)
+    for name in ("LED_STRIP_SIM_TIMESTAMPS", "WLED_REPLAY_BURST", "WLED_FLASH_IMAGE"):
+        env.pop(name, None)
+    result = subprocess.run([firmware], env=env, cwd=workdir, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            timeout=TIMEOUT_S)
+    if result.returncode != 0:
+        sys.stdout.write(result.stdout.decode(errors="replace"))
+        raise RuntimeError(f"firmware exited with {result.returncode}")
+    with open(frames) as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("firmware", help="firmware built for the linux target")
+    parser.add_argument("captures", nargs="*", help="capture descriptions, default all next to this script")
+    parser.add_argument("--update", action="store_true", help="write the output as the expected frames")
+    args = parser.parse_args()
+
+    firmware = os.path.abspath(args.firmware)
+    captures = args.captures or sorted(glob.glob(os.path.join(HERE, "*.txt")))
+    failed = 0
+    for description in captures:
+        expected_path = os.path.splitext(description)[0] + ".frames"
+        name = os.path.basename(description)
+        with tempfile.TemporaryDirectory() as workdir:
+            try:
+                actual = replay(firmware, description, workdir)
+            except (RuntimeError, subprocess.TimeoutExpired) as e:
+                print(f"FAIL {name}: {e}")
+                failed += 1
+                continue
+
+        if args.update:
+            with open(expected_path, "w") as f:
+                f.write(actual)
+            print(f"updated {os.path.basename(expected_path)}")
+            continue
+
+        with open(expected_path) as f:
+            expected = f.read()
+        if actual == expected:
+            print(f"ok   {name}")
+            continue
+        print(f"FAIL {name}: frames differ")
+        sys.stdout.writelines(difflib.unified_diff(expected.splitlines(True), actual.splitlines(True),
+                                                   expected_path, "actual"))
+        failed += 1
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Validates data/capability.json and compiles it into a compact binary form.
+
+The output is a C header with the capability table and the binary encoding as byte
+arrays, served by the capability service. The encoding is a flat TLV stream:
+
+    header   'M' 'T' 'C' version
+    record   tag u8, length u8, value[length]
+
+    0x01 MODULE      UTF-8 module name
+    0x02 CAPABILITY  nested records:
+        0x10 ID      u16 little endian
+        0x11 TYPE    u8 (see CAPABILITY_TYPES)
+        0x12 DEFAULT i32 little endian
+        0x13 LABEL   UTF-8 label
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+MAGIC = b"MTC"
+FORMAT_VERSION = 1
+
+TAG_MODULE = 0x01
+TAG_CAPABILITY = 0x02
+TAG_ID = 0x10
+TAG_TYPE = 0x11
+TAG_DEFAULT = 0x12
+TAG_LABEL = 0x13
+
+# Must match capa_type_t in capability_service.h
+CAPABILITY_TYPES = {
+    "toggle": 0,
+    "slider": 1,
+    "color": 2,
+}
+
+DEFAULT_MIN = -(2**31)
+DEFAULT_MAX = 2**31 - 1
+
+
+def fail(path, message):
+    sys.exit(f"{path}: {message}")
+
+
+def tlv(tag, value):
+    if len(value) > 255:
+        raise ValueError(f"TLV value for tag 0x{tag:02x} too long ({len(value)} bytes)")
+    return bytes([tag, len(value)]) + value
+
+
+def load(path):
+    try:
+        with open(path, encoding="utf-8") as f:
+            document = json.load(f)
+    except (OSError, json.JSONDecodeError) as e:
+        fail(path, e)
+
+    if not isinstance(document.get("module"), str):
+        fail(path, "'module' must be a string")
+    capabilities = document.get("capabilities")
+    if not isinstance(capabilities, list):
+        fail(path, "'capabilities' must be a list")
+
+    seen = set()
+    for index, capability in enumerate(capabilities):
+        where = f"capabilities[{index}]"
+        if not isinstance(capability.get("id"), int) or not 0 <= capability["id"] <= 0xFFFF:
+            fail(path, f"{where}: 'id' must be an integer between 0 and 65535")
+        if capability["id"] in seen:
+            fail(path, f"{where}: duplicate id {capability['id']}")
+        seen.add(capability["id"])
+        if capability.get("type") not in CAPABILITY_TYPES:
+            fail(path, f"{where}: unknown type {capability.get('type')!r}")
+        if not isinstance(capability.get("label"), str):
+            fail(path, f"{where}: 'label' must be a string")
+        name = f"{where} (id {capability['id']}, {capability['label']!r})"
+        default = capability.get("default", 0)
+        # capability.json spells defaults as strings, "0", accept those and plain integers. Anything
+        # else, including floats and booleans, would be silently truncated by int().
+        if isinstance(default, str) and re.fullmatch(r"[+-]?[0-9]+", default.strip()):
+            default = int(default)
+        if not isinstance(default, int) or isinstance(default, bool):
+            fail(path, f"{name}: 'default' must be an integer, got {capability.get('default')!r}")
+        if not DEFAULT_MIN <= default <= DEFAULT_MAX:
+            fail(path, f"{name}: 'default' {default} does not fit a signed 32 bit integer")
+        capability["default"] = default
+
+    return document
+
+
+def encode(document):
+    blob = bytearray(MAGIC + bytes([FORMAT_VERSION]))
+    blob += tlv(TAG_MODULE, document["module"].encode("utf-8"))
+    for capability in document["capabilities"]:
+        fields = tlv(TAG_ID, struct.pack("<H", capability["id"]))
+        fields += tlv(TAG_TYPE, bytes([CAPABILITY_TYPES[capability["type"]]]))
+        fields += tlv(TAG_DEFAULT, struct.pack("<i", capability["default"]))
+        fields += tlv(TAG_LABEL, capability["label"].encode("utf-8"))
+        blob += tlv(TAG_CAPABILITY, fields)
+    return bytes(blob)
+
+
+def c_string(value):
+    return json.dumps(value)
+
+
+def write_header(path, document, blob):
+    type_names = {v: k for k, v in CAPABILITY_TYPES.items()}
+    lines = [
+        "// Generated by tools/gen_capability.py from capability.json, do not edit",
+        "#pragma once",
+        "",
+        '#include "capability_service.h"',
+        "",
+        f"#define CAPA_MODULE_NAME {c_string(document['module'])}",
+        f"#define CAPA_COUNT {len(document['capabilities'])}",
+        f"#define CAPA_BINARY_FORMAT_VERSION {FORMAT_VERSION}",
+        "",
+        "static const capa_entry_t capa_table[] = {",
+    ]
+    for capability in document["capabilities"]:
+        type_name = type_names[CAPABILITY_TYPES[capability["type"]]].upper()
+        lines.append(
+            f"    {{.id = {capability['id']}, .type = CAPA_TYPE_{type_name}, "
+            f".default_value = {capability['default']}, .label = {c_string(capability['label'])}}},"
+        )
+    lines += ["};", "", "static const uint8_t capa_binary[] = {"]
+    for i in range(0, len(blob), 16):
+        lines.append("    " + ", ".join(f"0x{b:02x}" for b in blob[i : i + 16]) + ",")
+    lines += ["};", ""]
+
+    with open(path, "w", encoding="utf-8") as f:
+        f.write("\n".join(lines))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="capability.json")
+    parser.add_argument("header", help="generated C header")
+    args = parser.parse_args()
+
+    document = load(args.input)
+    blob = encode(document)
+    write_header(args.header, document, blob)
+    print(f"capability: {len(document['capabilities'])} entries, {len(blob)} bytes binary")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+"""Builds a capture file for the host build from a text description of BLE writes.
+
+Every non-empty line that does not start with '#' is one write: the characteristic UUID in
+hex followed by the value in hex, e.g. "a001 0102ff". The firmware built for the linux target
+replays the file through a simulated central when WLED_REPLAY names it. Records are stored back
+to back, all values little endian:
+
+    uuid16 u16, length u16, value
+"""
+
+import argparse
+import struct
+import sys
+
+MAX_VALUE_LEN = 512
+
+
+def parse(lines):
+    records = []
+    for number, line in enumerate(lines, 1):
+        line = line.strip()
+        if not line or line.startswith("#"):
+            continue
+        uuid, _, value = line.partition(" ")
+        try:
+            uuid16 = int(uuid, 16)
+            data = bytes.fromhex(value)
+        except ValueError:
+            sys.exit(f"line {number}: expected '<uuid16> <hex value>'")
+        if uuid16 > 0xFFFF or len(data) > MAX_VALUE_LEN:
+            sys.exit(f"line {number}: UUID or value out of range")
+        records.append(struct.pack("<HH", uuid16, len(data)) + data)
+    return b"".join(records)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", type=argparse.FileType("r"), help="text file with one write per line")
+    parser.add_argument("output", help="capture file to write")
+    parser.add_argument("--repeat", type=int, default=1, help="replay the writes this many times")
+    args = parser.parse_args()
+
+    capture = parse(args.input) * args.repeat
+    with open(args.output, "wb") as f:
+        f.write(capture)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Packs the files of a directory into a read-only asset image.
+
+The image is flashed to the `assets` partition and memory mapped by the assets component,
+so readers get pointers straight into flash. Layout, all values little endian:
+
+    header   magic "MTAS", version u16, count u16, image size u32
+    index    count entries of name char[32] (NUL padded), offset u32, size u32,
+             sorted by name for binary search
+    data     file contents, each aligned to 4 bytes, offsets relative to the image start
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = b"MTAS"
+VERSION = 1
+NAME_LEN = 32
+HEADER = struct.Struct("<4sHHI")
+ENTRY = struct.Struct(f"<{NAME_LEN}sII")
+ALIGN = 4
+
+
+def collect(directory):
+    files = []
+    for root, _, names in os.walk(directory):
+        for name in names:
+            path = os.path.join(root, name)
+            rel = os.path.relpath(path, directory).replace(os.sep, "/")
+            if len(rel.encode("utf-8")) >= NAME_LEN:
+                sys.exit(f"{path}: asset name longer than {NAME_LEN - 1} bytes")
+            with open(path, "rb") as f:
+                files.append((rel.encode("utf-8"), f.read()))
+    return sorted(files)
+
+
+def pack(files):
+    data_start = HEADER.size + ENTRY.size * len(files)
+    index = bytearray()
+    data = bytearray()
+    for name, content in files:
+        data += bytes(-(data_start + len(data)) % ALIGN)
+        index += ENTRY.pack(name, data_start + len(data), len(content))
+        data += content
+    image_size = data_start + len(data)
+    return HEADER.pack(MAGIC, VERSION, len(files), image_size) + index + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("directory", help="directory to pack")
+    parser.add_argument("image", help="output image")
+    parser.add_argument("--size", type=lambda v: int(v, 0), help="partition size, fail if the image is larger")
+    args = parser.parse_args()
+
+    image = pack(collect(args.directory))
+    if args.size is not None and len(image) > args.size:
+        sys.exit(f"asset image is {len(image)} bytes, partition only holds {args.size}")
+
+    with open(args.image, "wb") as f:
+        f.write(image)
+
+
+if __name__ == "__main__":
+    main()